@@ -0,0 +1,809 @@
+/*
+ *
+ *
+ Copyright 2010-2011 Sebastian Kraft
+
+ This file is part of GimpLensfun.
+
+ GimpLensfun is free software: you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation, either version
+ 3 of the License, or (at your option) any later version.
+
+ GimpLensfun is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied
+ warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ PURPOSE. See the GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public
+ License along with GimpLensfun. If not, see
+ http://www.gnu.org/licenses/.
+
+*/
+
+/*
+ *  Benchmark of the correction pipeline
+ *
+ *  Corrects synthetic images with a synthetic lens through the stages
+ *  of pipeline.hpp, without GIMP, and times every stage separately:
+ *
+ *    map       undistorted coordinates from lensfun (geometry mapping)
+ *    color     vignetting correction of the source windows
+ *    resample  interpolation of the output pixels
+ *    copy      copying source windows in and output tiles out
+ *
+ *  All rates are given in Mpix/s of output pixels, for each sample
+ *  type, channel count, image size and number of threads. The tiles
+ *  are spread over the threads, a stage rate is that of the stage
+ *  running on all threads at once.
+ *
+ *  The output of every run is hashed and has to be identical for all
+ *  runs and thread counts of an image. A difference is flagged in the
+ *  output column and makes the benchmark exit with status 2.
+ *
+ *  With -e the coordinate map is approximated from a sparse grid, the
+ *  largest deviation from the exact map is reported for every size.
+ *
+ *  With -R the lens is corrected without TCA, which makes the map
+ *  radial, and the coordinates are looked up in a radial table. Its
+ *  largest deviation from lensfun is reported as well.
+ *
+ *  With -g vignetting is applied by the resampler from a gain table
+ *  instead of by lensfun on the source window, the color column then
+ *  stays near zero.
+ *
+ *  With -m the cache misses of the fastest run are counted with the
+ *  hardware counters of Linux and given per output pixel. For
+ *  comparison every image is run once more with the tiles in row
+ *  order and resampled row by row without prefetching, the last
+ *  column is the reduction of the misses by the cache aware
+ *  traversal. Without access to the counters "n/a" is printed.
+ *
+ *  With -k only the convolutions of 8 bit footprints are compared:
+ *  every implementation the CPU supports is timed on the same random
+ *  footprints of the interpolation, the one the resampler uses is
+ *  marked. The fixed point ones must stay within one step of the
+ *  scalar float result, otherwise the benchmark exits with status 2.
+ *
+ *  usage: gimp-lensfun-benchmark [-s WxH] [-c channels] [-t threads]
+ *                                [-i interpolation] [-e error] [-r repeats] [-R] [-g] [-m] [-k]
+ *
+ *  -s, -c and -t may be given several times. Without them the
+ *  benchmark runs 2048x1536 and 6000x4000 images with 3 and 4
+ *  channels on one thread and on all available threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <chrono>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include <lensfun/lensfun.h>
+
+#include "interpolation.hpp"
+#include "pipeline.hpp"
+
+using namespace std;
+
+
+//####################################################################
+// parameters of the synthetic lens
+const float cBenchFocal    = 24.0f;
+const float cBenchAperture = 2.8f;
+const float cBenchDistance = 10.0f;
+const int   cBenchFlags    = LF_MODIFY_DISTORTION | LF_MODIFY_TCA | LF_MODIFY_VIGNETTING;
+
+// time spent in each stage, in seconds
+typedef struct
+{
+    double map;
+    double color;
+    double resample;
+    double copy;
+    long long misses;   // cache misses, -1 without counters
+} StageTimes;
+
+typedef struct
+{
+    vector<int>         widths, heights;
+    vector<int>         channels;
+    vector<int>         threads;
+    glInterpolationType interpolation;
+    float               maperror;
+    int                 repeats;
+    bool                radial;     // no TCA, map through a radial table
+    bool                gain;       // vignetting from a gain table
+    bool                misses;     // count cache misses
+    bool                conv;       // compare the convolutions only
+} BenchConfig;
+
+template <typename T> struct BenchPixel;
+template <> struct BenchPixel<unsigned char>
+{
+    static lfPixelFormat Format() { return LF_PF_U8; }
+    static const char *Name() { return "u8"; }
+    static unsigned char Value(unsigned int v) { return v & 0xff; }
+};
+template <> struct BenchPixel<unsigned short>
+{
+    static lfPixelFormat Format() { return LF_PF_U16; }
+    static const char *Name() { return "u16"; }
+    static unsigned short Value(unsigned int v) { return v & 0xffff; }
+};
+template <> struct BenchPixel<float>
+{
+    static lfPixelFormat Format() { return LF_PF_F32; }
+    static const char *Name() { return "f32"; }
+    static float Value(unsigned int v) { return (v & 0xffff) / 65535.0f; }
+};
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// Helper functions
+static double now()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+//--------------------------------------------------------------------
+static int max_threads()
+{
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+//--------------------------------------------------------------------
+// FNV-1a hash of the output image
+template <typename T>
+static unsigned long long hash_image(const vector<T> &img)
+{
+    const unsigned char *p = (const unsigned char *) &img[0];
+    const size_t iSize = sizeof(T) * img.size();
+    unsigned long long hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < iSize; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+//--------------------------------------------------------------------
+// Hardware counter of the cache misses of the calling thread, -1 if
+// not available
+static int open_miss_counter()
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.size           = sizeof(attr);
+    attr.config         = PERF_COUNT_HW_CACHE_MISSES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+//--------------------------------------------------------------------
+static long long close_miss_counter(int fd)
+{
+    long long count = -1;
+#ifdef __linux__
+    if (fd >= 0) {
+        if (read(fd, &count, sizeof(count)) != (ssize_t) sizeof(count))
+            count = -1;
+        close(fd);
+    }
+#endif
+    return count;
+}
+//--------------------------------------------------------------------
+static void set_threads(int iThreads)
+{
+#ifdef _OPENMP
+    omp_set_num_threads(iThreads);
+#endif
+}
+//--------------------------------------------------------------------
+// A wide angle lens with strong barrel distortion, vignetting and
+// lateral chromatic aberration, so all stages have work to do
+static lfLens *create_lens()
+{
+    lfLens *lens = new lfLens;
+
+    lens->SetMaker("Benchmark");
+    lens->SetModel("Synthetic 24mm f/2.8");
+    lens->MinFocal    = cBenchFocal;
+    lens->MaxFocal    = cBenchFocal;
+    lens->MinAperture = cBenchAperture;
+    lens->MaxAperture = 22.0f;
+    lens->CropFactor  = 1.0f;
+    lens->Type        = LF_RECTILINEAR;
+
+    lfLensCalibDistortion dist;
+    memset(&dist, 0, sizeof(dist));
+    dist.Model    = LF_DIST_MODEL_PTLENS;
+    dist.Focal    = cBenchFocal;
+    dist.Terms[0] = 0.01f;
+    dist.Terms[1] = -0.04f;
+    dist.Terms[2] = 0.005f;
+    lens->AddCalibDistortion(&dist);
+
+    lfLensCalibVignetting vign;
+    memset(&vign, 0, sizeof(vign));
+    vign.Model    = LF_VIGNETTING_MODEL_PA;
+    vign.Focal    = cBenchFocal;
+    vign.Aperture = cBenchAperture;
+    vign.Distance = cBenchDistance;
+    vign.Terms[0] = -0.4f;
+    vign.Terms[1] = 0.2f;
+    vign.Terms[2] = -0.05f;
+    lens->AddCalibVignetting(&vign);
+
+    lfLensCalibTCA tca;
+    memset(&tca, 0, sizeof(tca));
+    tca.Model    = LF_TCA_MODEL_LINEAR;
+    tca.Focal    = cBenchFocal;
+    tca.Terms[0] = 1.0003f;
+    tca.Terms[1] = 0.9997f;
+    lens->AddCalibTCA(&tca);
+
+    return lens;
+}
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// Benchmark
+//
+// Same tile loop as process_tiles() of the plug-in, with the drawable
+// replaced by an image in memory. Every thread times its own stages,
+// the times and cache misses are summed over all threads. bLocal
+// selects the cache aware traversal of the plug-in, otherwise tiles
+// go in row order and rows are resampled in one piece.
+template <typename T>
+static void run_pipeline(lfModifier *mod, const RadialMap *radial, const GainMap *gain,
+                         glInterpolationType interpolation, float fMaxMapError,
+                         bool bLocal, bool bCountMisses,
+                         const T *src, T *dst, int width, int height, int channels,
+                         StageTimes *times)
+{
+    const typename Resampler<T>::Func resample = GetResampler<T>(interpolation, channels);
+    const int iRadius = InterpolationRadius(interpolation);
+
+    TileScheduler sched;
+    InitTileScheduler(&sched, width, height, bLocal ? TILE_ORDER_MORTON : TILE_ORDER_ROWS);
+
+    times->misses = bCountMisses ? 0 : -1;
+
+    #pragma omp parallel
+    {
+        vector<float> coords(cStreamTileSize * cStreamTileSize * 2 * 3);
+        vector<T>     out(channels * cStreamTileSize * cStreamTileSize);
+        vector<T>     window;
+        StageTimes    own = { 0, 0, 0, 0, 0 };
+        ImgRect       tile;
+        const int     fd  = bCountMisses ? open_miss_counter() : -1;
+
+        while (NextTile(&sched, &tile))
+        {
+            const int tx = tile.x, ty = tile.y;
+            const int tw = tile.width, th = tile.height;
+            ImgRect   win;
+            double    t0, t1;
+
+            t0 = now();
+            MapCoordinates(mod, tx, ty, tw, th, &coords[0], fMaxMapError, radial);
+            t1 = now();
+            own.map += t1 - t0;
+
+            if (GetSourceWindow(&coords[0], tw*th, iRadius, width, height, &win))
+            {
+                const size_t iWindowSize = channels * win.width * win.height;
+                if (window.size() < iWindowSize + cInterpolationPadding)
+                    window.resize(iWindowSize + cInterpolationPadding);
+
+                t0 = now();
+                for (int i = 0; i < win.height; i++)
+                    memcpy(&window[channels * win.width * i],
+                           &src[channels * ((size_t) (win.y + i) * width + win.x)],
+                           sizeof(T) * channels * win.width);
+                t1 = now();
+                own.copy += t1 - t0;
+
+                ModifyColors<T>(mod, &window[0], &win, channels);
+                PremultiplyAlpha<T>(&window[0], &win, channels);
+                t0 = now();
+                own.color += t0 - t1;
+
+                ResampleTile<T>(resample, &window[0], &win, channels,
+                                &coords[0], tw, th, gain, &out[0], bLocal);
+                t1 = now();
+                own.resample += t1 - t0;
+            }
+            else
+            {
+                memset(&out[0], 0, sizeof(T) * channels * tw * th);
+            }
+
+            t0 = now();
+            for (int i = 0; i < th; i++)
+                memcpy(&dst[channels * ((size_t) (ty + i) * width + tx)],
+                       &out[channels * tw * i],
+                       sizeof(T) * channels * tw);
+            own.copy += now() - t0;
+
+            FinishTile(&sched);
+        }
+
+        own.misses = close_miss_counter(fd);
+
+        #pragma omp critical(stage_times)
+        {
+            times->map      += own.map;
+            times->color    += own.color;
+            times->resample += own.resample;
+            times->copy     += own.copy;
+            if (bCountMisses)
+                times->misses = ((own.misses < 0) || (times->misses < 0)) ? -1 : times->misses + own.misses;
+        }
+    }
+}
+//--------------------------------------------------------------------
+static int bench_flags(const BenchConfig *config)
+{
+    return config->radial ? (cBenchFlags & ~LF_MODIFY_TCA) : cBenchFlags;
+}
+//--------------------------------------------------------------------
+// Gain table of the vignetting of the lens, from a modifier that does
+// nothing else
+static bool build_gain_map(const lfLens *lens, int width, int height, GainMap *gain)
+{
+    lfModifier vmod (lens, lens->CropFactor, width, height);
+    vmod.Initialize (lens, LF_PF_F32, cBenchFocal, cBenchAperture, cBenchDistance, 1.0f,
+                     LF_RECTILINEAR, LF_MODIFY_VIGNETTING, false);
+    return BuildGainMap(&vmod, width, height, gain);
+}
+//--------------------------------------------------------------------
+// Largest deviation of the approximated or radial coordinate map from
+// the exact one over the whole image, in pixels
+static float measure_map_error(const lfLens *lens, int flags, int width, int height,
+                               float fMaxMapError, const RadialMap *radial)
+{
+    lfModifier *mod = new lfModifier (lens, lens->CropFactor, width, height);
+    mod->Initialize (lens, LF_PF_U8, cBenchFocal, cBenchAperture, cBenchDistance, 1.0f,
+                     LF_RECTILINEAR, flags, false);
+
+    vector<float> exact(cStreamTileSize * cStreamTileSize * 2 * 3);
+    vector<float> approx(cStreamTileSize * cStreamTileSize * 2 * 3);
+    float fError = 0.0f;
+
+    for (int ty = 0; ty < height; ty += cStreamTileSize)
+    {
+        for (int tx = 0; tx < width; tx += cStreamTileSize)
+        {
+            const int tw = min(cStreamTileSize, width - tx);
+            const int th = min(cStreamTileSize, height - ty);
+
+            MapCoordinates(mod, tx, ty, tw, th, &exact[0]);
+            MapCoordinates(mod, tx, ty, tw, th, &approx[0], fMaxMapError, radial);
+            for (int i = 0; i < tw*th*2*3; i++)
+                fError = max(fError, fabsf(exact[i] - approx[i]));
+        }
+    }
+
+    delete mod;
+    return fError;
+}
+//--------------------------------------------------------------------
+static void print_rate(double pixels, double seconds)
+{
+    printf(" %9.1f", seconds > 0 ? pixels / seconds / 1e6 : 0.0);
+}
+//--------------------------------------------------------------------
+static void print_misses(double pixels, long long misses, long long rowmisses)
+{
+    if ((misses < 0) || (rowmisses < 0)) {
+        printf(" %9s %9s %7s", "n/a", "n/a", "n/a");
+        return;
+    }
+    printf(" %9.3f %9.3f %6.1f%%", misses / pixels, rowmisses / pixels,
+           rowmisses > 0 ? 100.0 * (rowmisses - misses) / rowmisses : 0.0);
+}
+//--------------------------------------------------------------------
+// Returns the number of runs whose output differs from the first run
+// of the same image
+template <typename T>
+static int benchmark(const lfLens *lens, const BenchConfig *config)
+{
+    int iMismatches = 0;
+
+    for (unsigned int s = 0; s < config->widths.size(); s++)
+    {
+        const int width  = config->widths[s];
+        const int height = config->heights[s];
+
+        for (unsigned int c = 0; c < config->channels.size(); c++)
+        {
+            const int    channels = config->channels[c];
+            const size_t iSize    = (size_t) width * height * channels;
+            vector<T>    src(iSize);
+            vector<T>    dst(iSize);
+
+            // fixed pseudo random pattern, runs are comparable
+            unsigned int seed = 12345;
+            for (size_t i = 0; i < iSize; i++) {
+                seed = seed * 1103515245u + 12345u;
+                src[i] = BenchPixel<T>::Value(seed >> 8);
+            }
+
+            GainMap    gain;
+            const bool bGain  = config->gain && build_gain_map(lens, width, height, &gain);
+            const int  iFlags = bGain ? (bench_flags(config) & ~LF_MODIFY_VIGNETTING)
+                                      : bench_flags(config);
+
+            lfModifier *mod = new lfModifier (lens, lens->CropFactor, width, height);
+            mod->Initialize (lens, BenchPixel<T>::Format(), cBenchFocal,
+                             cBenchAperture, cBenchDistance, 1.0f, LF_RECTILINEAR,
+                             iFlags, false);
+
+            RadialMap  radial;
+            const bool bRadial = config->radial && BuildRadialMap(mod, width, height, &radial);
+
+            unsigned long long iRefHash = 0;
+
+            for (unsigned int t = 0; t < config->threads.size(); t++)
+            {
+                StageTimes best;
+                double     fBestTotal = 0;
+                bool       bIdentical = true;
+
+                set_threads(config->threads[t]);
+
+                // keep the fastest of all repeats
+                for (int r = 0; r < config->repeats; r++) {
+                    StageTimes times = { 0, 0, 0, 0, 0 };
+                    const double t0 = now();
+                    run_pipeline<T>(mod, bRadial ? &radial : NULL, bGain ? &gain : NULL,
+                                    config->interpolation, config->maperror,
+                                    true, config->misses,
+                                    &src[0], &dst[0],
+                                    width, height, channels, &times);
+                    const double fTotal = now() - t0;
+
+                    const unsigned long long iHash = hash_image(dst);
+                    if ((t == 0) && (r == 0))
+                        iRefHash = iHash;
+                    if (iHash != iRefHash) {
+                        bIdentical = false;
+                        iMismatches++;
+                    }
+
+                    if ((r == 0) || (fTotal < fBestTotal)) {
+                        best = times;
+                        fBestTotal = fTotal;
+                    }
+                }
+
+                // stage times are summed over the threads
+                const double pixels = (double) width * height;
+                const double stage  = pixels * config->threads[t];
+                printf("%-4s %2d %5dx%-5d %7d", BenchPixel<T>::Name(), channels,
+                       width, height, config->threads[t]);
+                print_rate(stage, best.map);
+                print_rate(stage, best.color);
+                print_rate(stage, best.resample);
+                print_rate(stage, best.copy);
+                print_rate(pixels, fBestTotal);
+                if (config->misses) {
+                    // once more in plain row order, for comparison
+                    StageTimes rows = { 0, 0, 0, 0, 0 };
+                    vector<T>  plain(iSize);
+                    run_pipeline<T>(mod, bRadial ? &radial : NULL, bGain ? &gain : NULL,
+                                    config->interpolation, config->maperror,
+                                    false, true, &src[0], &plain[0],
+                                    width, height, channels, &rows);
+                    if (hash_image(plain) != iRefHash) {
+                        bIdentical = false;
+                        iMismatches++;
+                    }
+                    print_misses(pixels, best.misses, rows.misses);
+                }
+                printf("  %016llx%s\n", iRefHash, bIdentical ? "" : " DIFFERS");
+                fflush(stdout);
+            }
+
+            delete mod;
+        }
+    }
+
+    return iMismatches;
+}
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// Convolution kernels
+//
+// Every convolution of 8 bit samples the CPU supports is run on the
+// same random footprints inside a random image. The fixed point ones
+// may differ from ConvScalar() by one step of the output at most.
+template <int Taps>
+struct ConvVariant
+{
+    const char *name;
+    typename KernelConv<unsigned char, Taps>::Func func;
+};
+
+// footprints per run, the image fits the L2 cache
+const int cConvFootprints = 65536;
+const int cConvImageSize  = 256;
+const int cConvRuns       = 20;
+
+template <typename Kernel>
+static int benchmark_conv(const BenchConfig *config)
+{
+    typedef typename KernelConv<unsigned char, Kernel::Taps>::Func Func;
+    const int w = cConvImageSize, h = cConvImageSize;
+    vector<ConvVariant<Kernel::Taps> > variants;
+    int iFailures = 0;
+
+    ConvVariant<Kernel::Taps> scalar = { "scalar", ConvScalar<unsigned char, Kernel::Taps> };
+    variants.push_back(scalar);
+#if GL_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        ConvVariant<Kernel::Taps> v = { "sse2", ConvSSE2<unsigned char, Kernel::Taps> };
+        variants.push_back(v);
+    }
+    if (__builtin_cpu_supports("ssse3") && ConvFixedSelect<unsigned char, Kernel::Taps>::Get()) {
+        ConvVariant<Kernel::Taps> v = { "fixed-ssse3", ConvFixedSelect<unsigned char, Kernel::Taps>::Get() };
+        variants.push_back(v);
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        if (ConvAVX2Select<unsigned char, Kernel::Taps>::Get()) {
+            ConvVariant<Kernel::Taps> v = { "avx2", ConvAVX2Select<unsigned char, Kernel::Taps>::Get() };
+            variants.push_back(v);
+        }
+        if (ConvFixedSelect<unsigned char, Kernel::Taps>::GetAVX2()) {
+            ConvVariant<Kernel::Taps> v = { "fixed-avx2", ConvFixedSelect<unsigned char, Kernel::Taps>::GetAVX2() };
+            variants.push_back(v);
+        }
+    }
+#endif
+
+    // footprints inside the image, with the taps of the kernel
+    vector<KernelTaps<Kernel::Taps> > taps(cConvFootprints);
+    srand(1);
+    for (int i = 0; i < cConvFootprints; i++) {
+        const float x = Kernel::Radius + (float) rand() / RAND_MAX * (w - 2*Kernel::Radius - 1);
+        const float y = Kernel::Radius + (float) rand() / RAND_MAX * (h - 2*Kernel::Radius - 1);
+        KernelSetup<Kernel, false>(x, y, w, h, &taps[i]);
+    }
+
+    for (unsigned int c = 0; c < config->channels.size(); c++)
+    {
+        const int channels = config->channels[c];
+        vector<unsigned char> img(channels * w * h + cInterpolationPadding);
+        vector<float>         ref(4 * cConvFootprints), out(4 * cConvFootprints);
+
+        for (size_t i = 0; i < img.size(); i++)
+            img[i] = BenchPixel<unsigned char>::Value(rand());
+
+        for (unsigned int v = 0; v < variants.size(); v++)
+        {
+            const Func conv = variants[v].func;
+            double     best = 0;
+
+            for (int r = 0; r < config->repeats; r++) {
+                const double t0 = now();
+                for (int k = 0; k < cConvRuns; k++)
+                    for (int i = 0; i < cConvFootprints; i++)
+                        conv(&img[0], channels * w, channels, &taps[i], &out[4*i]);
+                const double t = now() - t0;
+                if ((r == 0) || (t < best))
+                    best = t;
+            }
+            if (v == 0)
+                ref = out;
+
+            float fMaxDiff = 0;
+            for (int i = 0; i < cConvFootprints; i++)
+                for (int k = 0; k < channels; k++)
+                    fMaxDiff = max(fMaxDiff, fabsf(out[4*i + k] - ref[4*i + k]));
+
+            const bool bFailed = (fMaxDiff > 1.0f);
+            const bool bUsed   = (conv == GetKernelConv<unsigned char, Kernel::Taps>());
+            printf("%-12s %2d %9.1f %9.3f%s%s\n", variants[v].name, channels,
+                   (double) cConvRuns * cConvFootprints / best / 1e6, fMaxDiff,
+                   bUsed ? "  selected" : "", bFailed ? "  DIFFERS" : "");
+            if (bFailed)
+                iFailures++;
+        }
+    }
+    return iFailures;
+}
+//--------------------------------------------------------------------
+static int benchmark_conv(const BenchConfig *config)
+{
+    printf("8 bit convolutions in Mfootprints/s, largest difference from scalar in steps\n");
+    printf("%-12s %2s %9s %9s\n", "kernel", "ch", "rate", "diff");
+
+    switch (config->interpolation) {
+        case GL_INTERPOL_NN:  return benchmark_conv<NearestKernel>(config);
+        case GL_INTERPOL_BL:  return benchmark_conv<BilinearKernel>(config);
+        case GL_INTERPOL_BC:  return benchmark_conv<BicubicKernel>(config);
+        case GL_INTERPOL_LZ:  return benchmark_conv<LanczosKernel<2> >(config);
+        case GL_INTERPOL_LZ3: return benchmark_conv<LanczosKernel<3> >(config);
+    }
+    return 0;
+}
+//--------------------------------------------------------------------
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-s WxH] [-c channels] [-t threads] [-i interpolation] [-e error] [-r repeats] [-R] [-g] [-m] [-k]\n"
+            "  -s WxH            image size, may be repeated\n"
+            "  -c channels       1 to 4, may be repeated\n"
+            "  -t threads        number of threads, may be repeated\n"
+            "  -i interpolation  0 nearest, 1 bilinear, 2 Lanczos-2, 3 bicubic, 4 Lanczos-3\n"
+            "  -e error          maximum error of the approximated coordinate map in pixels\n"
+            "  -r repeats        runs per measurement, the fastest is reported\n"
+            "  -R                no TCA, coordinates from a radial table\n"
+            "  -g                vignetting from a gain table in the resampler\n"
+            "  -m                count cache misses, also for plain row order\n"
+            "  -k                compare the 8 bit convolutions instead\n",
+            name);
+}
+//--------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    BenchConfig config;
+    config.interpolation = GL_INTERPOL_LZ;
+    config.maperror = 0.0f;
+    config.repeats = 3;
+    config.radial = false;
+    config.gain = false;
+    config.misses = false;
+    config.conv = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = (i + 1 < argc) ? argv[i + 1] : NULL;
+        int w, h, v;
+        float f;
+
+        if (strcmp(argv[i], "-R") == 0) {
+            config.radial = true;
+            continue;
+        }
+        if (strcmp(argv[i], "-g") == 0) {
+            config.gain = true;
+            continue;
+        }
+        if (strcmp(argv[i], "-m") == 0) {
+            config.misses = true;
+            continue;
+        }
+        if (strcmp(argv[i], "-k") == 0) {
+            config.conv = true;
+            continue;
+        }
+
+        if ((strcmp(argv[i], "-s") == 0) && arg && (sscanf(arg, "%dx%d", &w, &h) == 2) &&
+            (w > 0) && (h > 0)) {
+            config.widths.push_back(w);
+            config.heights.push_back(h);
+        } else if ((strcmp(argv[i], "-c") == 0) && arg && (sscanf(arg, "%d", &v) == 1) &&
+                   (v >= 1) && (v <= 4)) {
+            config.channels.push_back(v);
+        } else if ((strcmp(argv[i], "-t") == 0) && arg && (sscanf(arg, "%d", &v) == 1) &&
+                   (v > 0)) {
+            config.threads.push_back(v);
+        } else if ((strcmp(argv[i], "-i") == 0) && arg && (sscanf(arg, "%d", &v) == 1) &&
+                   (v >= GL_INTERPOL_NN) && (v <= GL_INTERPOL_LZ3)) {
+            config.interpolation = (glInterpolationType) v;
+        } else if ((strcmp(argv[i], "-e") == 0) && arg && (sscanf(arg, "%f", &f) == 1) &&
+                   (f >= 0)) {
+            config.maperror = f;
+        } else if ((strcmp(argv[i], "-r") == 0) && arg && (sscanf(arg, "%d", &v) == 1) &&
+                   (v > 0)) {
+            config.repeats = v;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+    }
+
+    if (config.widths.empty()) {
+        config.widths.push_back(2048);
+        config.heights.push_back(1536);
+        config.widths.push_back(6000);
+        config.heights.push_back(4000);
+    }
+    if (config.channels.empty()) {
+        config.channels.push_back(3);
+        config.channels.push_back(4);
+    }
+    if (config.threads.empty()) {
+        config.threads.push_back(1);
+        if (max_threads() > 1)
+            config.threads.push_back(max_threads());
+    }
+
+    InitInterpolation(config.interpolation);
+
+    if (config.conv) {
+        if (benchmark_conv(&config) > 0) {
+            fprintf(stderr, "a fixed point convolution differs by more than one step\n");
+            return 2;
+        }
+        return 0;
+    }
+
+    lfLens *lens = create_lens();
+
+    if (config.maperror > 0) {
+        for (unsigned int s = 0; s < config.widths.size(); s++)
+            printf("%dx%d: map error %.4f px, limit %.4f px\n", config.widths[s], config.heights[s],
+                   measure_map_error(lens, bench_flags(&config), config.widths[s],
+                                     config.heights[s], config.maperror, NULL),
+                   config.maperror);
+    }
+    if (config.radial) {
+        for (unsigned int s = 0; s < config.widths.size(); s++)
+        {
+            const int   width  = config.widths[s];
+            const int   height = config.heights[s];
+            lfModifier *mod    = new lfModifier (lens, lens->CropFactor, width, height);
+            RadialMap   radial;
+
+            mod->Initialize (lens, LF_PF_U8, cBenchFocal, cBenchAperture, cBenchDistance, 1.0f,
+                             LF_RECTILINEAR, bench_flags(&config), false);
+            if (BuildRadialMap(mod, width, height, &radial))
+                printf("%dx%d: radial map error %.4f px, limit %.4f px\n", width, height,
+                       measure_map_error(lens, bench_flags(&config), width, height, 0, &radial),
+                       cRadialMaxError);
+            else
+                printf("%dx%d: no radial map, lensfun is used\n", width, height);
+            delete mod;
+        }
+    }
+
+    printf("rates in Mpix/s,%s output as hash\n",
+           config.misses ? " cache misses per pixel (cache aware, row order, reduction)," : "");
+    printf("%-4s %2s %11s %7s %9s %9s %9s %9s %9s",
+           "type", "ch", "size", "threads", "map", "color", "resample", "copy", "total");
+    if (config.misses)
+        printf(" %9s %9s %7s", "miss/px", "rows", "less");
+    printf("  %s\n", "output");
+
+    int iMismatches = 0;
+    iMismatches += benchmark<unsigned char>(lens, &config);
+    iMismatches += benchmark<unsigned short>(lens, &config);
+    iMismatches += benchmark<float>(lens, &config);
+
+    delete lens;
+
+    if (iMismatches > 0) {
+        fprintf(stderr, "%d runs produced a different output than the first run "
+                        "of the same image\n", iMismatches);
+        return 2;
+    }
+    return 0;
+}
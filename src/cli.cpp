@@ -0,0 +1,528 @@
+/*
+ *
+ *
+ Copyright 2010-2011 Sebastian Kraft
+
+ This file is part of GimpLensfun.
+
+ GimpLensfun is free software: you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation, either version
+ 3 of the License, or (at your option) any later version.
+
+ GimpLensfun is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied
+ warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ PURPOSE. See the GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public
+ License along with GimpLensfun. If not, see
+ http://www.gnu.org/licenses/.
+
+*/
+
+/*
+ *  Command line front end
+ *
+ *  Corrects a single image without GIMP, with the same core as the
+ *  plug-in. Camera, lens, focal length and aperture are read from the
+ *  EXIF data of the input file if present, options override them.
+ *
+ *  usage: gimp-lensfun-cli [options] input output
+ *
+ *  Input and output are TIFF (8 or 16 bit integer or 32 bit float
+ *  samples, gray or RGB, with or without alpha) or binary PGM/PPM
+ *  (8 or 16 bit). The output format follows from the extension of the
+ *  output file name, the sample type is kept. PGM and PPM output need
+ *  gray or RGB data without alpha.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <lensfun/lensfun.h>
+#include <tiffio.h>
+
+#ifndef DEBUG
+#define DEBUG 0
+#endif
+
+#include "lensfuncore.hpp"
+
+using namespace std;
+
+
+//####################################################################
+// image in memory
+typedef enum {
+    CLI_PIXEL_U8,
+    CLI_PIXEL_U16,
+    CLI_PIXEL_F32
+} CliPixelType;
+
+const int           cCliSampleSize[]     = { 1, 2, 4 };
+const lfPixelFormat cCliPixelFormat[]    = { LF_PF_U8, LF_PF_U16, LF_PF_F32 };
+
+typedef struct
+{
+    int width, height;
+    int channels;
+    CliPixelType type;
+    vector<unsigned char> data;     // interleaved samples in host byte order
+} CliImage;
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// Helper functions
+static size_t image_row_bytes(const CliImage *img)
+{
+    return (size_t) img->width * img->channels * cCliSampleSize[img->type];
+}
+//--------------------------------------------------------------------
+static bool has_extension(const char *filename, const char *ext)
+{
+    const size_t len = strlen(filename);
+    const size_t extlen = strlen(ext);
+
+    return (len > extlen) && (StrCompare(filename + len - extlen, ext) == 0);
+}
+//--------------------------------------------------------------------
+static void swap_bytes16(unsigned char *data, size_t iNumSamples)
+{
+    for (size_t i = 0; i < iNumSamples; i++) {
+        const unsigned char c = data[2*i];
+        data[2*i]   = data[2*i+1];
+        data[2*i+1] = c;
+    }
+}
+//--------------------------------------------------------------------
+static bool host_is_big_endian()
+{
+    const uint16_t v = 1;
+    return *((const unsigned char *) &v) == 0;
+}
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// PGM/PPM files
+//
+// Only binary gray (P5) and RGB (P6) are supported. 16 bit samples
+// are stored big endian.
+static bool ppm_read_value(FILE *fp, int *value)
+{
+    int c = fgetc(fp);
+
+    // whitespace and comments between the header fields
+    while ((c == ' ') || (c == '\t') || (c == '\r') || (c == '\n') || (c == '#')) {
+        if (c == '#') {
+            while ((c != '\n') && (c != EOF))
+                c = fgetc(fp);
+        }
+        c = fgetc(fp);
+    }
+
+    if ((c < '0') || (c > '9'))
+        return false;
+
+    *value = 0;
+    while ((c >= '0') && (c <= '9')) {
+        if (*value > 100000)
+            return false;
+        *value = *value * 10 + (c - '0');
+        c = fgetc(fp);
+    }
+    // c is the single whitespace character after the field
+    return (c != EOF);
+}
+//--------------------------------------------------------------------
+static bool read_ppm(const char *filename, CliImage *img)
+{
+    FILE *fp = fopen(filename, "rb");
+    int   maxval;
+
+    if (!fp) {
+        fprintf(stderr, "Could not open %s\n", filename);
+        return false;
+    }
+
+    const int magic = (fgetc(fp) == 'P') ? fgetc(fp) : EOF;
+
+    if (((magic != '5') && (magic != '6')) ||
+        !ppm_read_value(fp, &img->width) || !ppm_read_value(fp, &img->height) ||
+        !ppm_read_value(fp, &maxval) ||
+        (img->width <= 0) || (img->height <= 0) || ((maxval != 255) && (maxval != 65535))) {
+        fprintf(stderr, "%s: not a binary PGM/PPM file with 8 or 16 bit samples\n", filename);
+        fclose(fp);
+        return false;
+    }
+
+    img->channels = (magic == '5') ? 1 : 3;
+    img->type = (maxval == 255) ? CLI_PIXEL_U8 : CLI_PIXEL_U16;
+    img->data.resize(image_row_bytes(img) * img->height);
+
+    if (fread(&img->data[0], 1, img->data.size(), fp) != img->data.size()) {
+        fprintf(stderr, "%s: file is truncated\n", filename);
+        fclose(fp);
+        return false;
+    }
+    fclose(fp);
+
+    if ((img->type == CLI_PIXEL_U16) && !host_is_big_endian())
+        swap_bytes16(&img->data[0], img->data.size() / 2);
+
+    return true;
+}
+//--------------------------------------------------------------------
+static bool write_ppm(const char *filename, CliImage *img)
+{
+    if (((img->channels != 1) && (img->channels != 3)) || (img->type == CLI_PIXEL_F32)) {
+        fprintf(stderr, "%s: PGM/PPM needs 8 or 16 bit gray or RGB data, write a TIFF file instead\n",
+                filename);
+        return false;
+    }
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        fprintf(stderr, "Could not create %s\n", filename);
+        return false;
+    }
+
+    fprintf(fp, "P%c\n%d %d\n%d\n", (img->channels == 1) ? '5' : '6', img->width, img->height,
+            (img->type == CLI_PIXEL_U8) ? 255 : 65535);
+
+    // swapped in place, the image is not used any more afterwards
+    if ((img->type == CLI_PIXEL_U16) && !host_is_big_endian())
+        swap_bytes16(&img->data[0], img->data.size() / 2);
+
+    const bool bOK = (fwrite(&img->data[0], 1, img->data.size(), fp) == img->data.size());
+    if ((fclose(fp) != 0) || !bOK) {
+        fprintf(stderr, "Could not write %s\n", filename);
+        return false;
+    }
+
+    return true;
+}
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// TIFF files
+//
+// Strip based, interleaved gray or RGB images with an optional alpha
+// channel only.
+static bool read_tiff(const char *filename, CliImage *img)
+{
+    TIFF *tif = TIFFOpen(filename, "r");
+    if (!tif) {
+        fprintf(stderr, "Could not open %s\n", filename);
+        return false;
+    }
+
+    uint32_t width = 0, height = 0;
+    uint16_t spp, bps, format, planar, photometric = 0;
+
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+    TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &photometric);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &spp);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bps);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLEFORMAT, &format);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar);
+
+    if ((bps == 8) && (format == SAMPLEFORMAT_UINT)) {
+        img->type = CLI_PIXEL_U8;
+    } else if ((bps == 16) && (format == SAMPLEFORMAT_UINT)) {
+        img->type = CLI_PIXEL_U16;
+    } else if ((bps == 32) && (format == SAMPLEFORMAT_IEEEFP)) {
+        img->type = CLI_PIXEL_F32;
+    } else {
+        fprintf(stderr, "%s: unsupported sample format (%d bit)\n", filename, bps);
+        TIFFClose(tif);
+        return false;
+    }
+
+    const bool bGray = (photometric == PHOTOMETRIC_MINISBLACK);
+    if ((width == 0) || (height == 0) || TIFFIsTiled(tif) ||
+        (planar != PLANARCONFIG_CONTIG) ||
+        !(bGray || (photometric == PHOTOMETRIC_RGB)) ||
+        (spp < (bGray ? 1 : 3)) || (spp > (bGray ? 2 : 4))) {
+        fprintf(stderr, "%s: only strip based gray or RGB images are supported\n", filename);
+        TIFFClose(tif);
+        return false;
+    }
+
+    img->width    = width;
+    img->height   = height;
+    img->channels = spp;
+    img->data.resize(image_row_bytes(img) * img->height);
+
+    for (int y = 0; y < img->height; y++) {
+        if (TIFFReadScanline(tif, &img->data[image_row_bytes(img) * y], y, 0) < 0) {
+            fprintf(stderr, "%s: error in row %d\n", filename, y);
+            TIFFClose(tif);
+            return false;
+        }
+    }
+
+    TIFFClose(tif);
+    return true;
+}
+//--------------------------------------------------------------------
+static bool write_tiff(const char *filename, CliImage *img)
+{
+    TIFF *tif = TIFFOpen(filename, "w");
+    if (!tif) {
+        fprintf(stderr, "Could not create %s\n", filename);
+        return false;
+    }
+
+    TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, (uint32_t) img->width);
+    TIFFSetField(tif, TIFFTAG_IMAGELENGTH, (uint32_t) img->height);
+    TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, (uint16_t) img->channels);
+    TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, (uint16_t) (8 * cCliSampleSize[img->type]));
+    TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, (uint16_t) ((img->type == CLI_PIXEL_F32) ?
+                                                        SAMPLEFORMAT_IEEEFP : SAMPLEFORMAT_UINT));
+    TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, (uint16_t) ((img->channels < 3) ?
+                                                       PHOTOMETRIC_MINISBLACK : PHOTOMETRIC_RGB));
+    TIFFSetField(tif, TIFFTAG_PLANARCONFIG, (uint16_t) PLANARCONFIG_CONTIG);
+    TIFFSetField(tif, TIFFTAG_COMPRESSION, (uint16_t) COMPRESSION_NONE);
+    TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(tif, 0));
+    if ((img->channels == 2) || (img->channels == 4)) {
+        const uint16_t extra = EXTRASAMPLE_UNASSALPHA;
+        TIFFSetField(tif, TIFFTAG_EXTRASAMPLES, (uint16_t) 1, &extra);
+    }
+
+    for (int y = 0; y < img->height; y++) {
+        if (TIFFWriteScanline(tif, &img->data[image_row_bytes(img) * y], y, 0) < 0) {
+            fprintf(stderr, "Could not write %s\n", filename);
+            TIFFClose(tif);
+            return false;
+        }
+    }
+
+    TIFFClose(tif);
+    return true;
+}
+//--------------------------------------------------------------------
+static bool read_image(const char *filename, CliImage *img)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        fprintf(stderr, "Could not open %s\n", filename);
+        return false;
+    }
+    const int c = fgetc(fp);
+    fclose(fp);
+
+    // TIFF files start with "II" or "MM", PGM/PPM files with "P5"/"P6"
+    if (c == 'P')
+        return read_ppm(filename, img);
+    return read_tiff(filename, img);
+}
+//--------------------------------------------------------------------
+static bool write_image(const char *filename, CliImage *img)
+{
+    if (has_extension(filename, ".ppm") || has_extension(filename, ".pgm"))
+        return write_ppm(filename, img);
+    if (has_extension(filename, ".tif") || has_extension(filename, ".tiff"))
+        return write_tiff(filename, img);
+
+    fprintf(stderr, "%s: unknown output format, use .tif, .tiff, .pgm or .ppm\n", filename);
+    return false;
+}
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// Main
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [options] input output\n"
+            "  -m maker          camera maker\n"
+            "  -c camera         camera model\n"
+            "  -l lens           lens model\n"
+            "  -f focal          focal length in mm\n"
+            "  -a aperture       aperture (f-number)\n"
+            "  -d distance       focus distance in m (default 1)\n"
+            "  -s scale          scale factor, 0 scales the result to fit the image (default)\n"
+            "  -g geometry       target geometry as lensfun lfLensType (default 1, rectilinear)\n"
+            "  -x flags          corrections as lensfun LF_MODIFY_* flags (default 8, distortion)\n"
+            "  -r                simulate the lens instead of correcting it\n"
+            "  -k                keep only the largest rectangle without empty borders\n"
+            "  -i interpolation  0 nearest, 1 bilinear, 2 Lanczos-2 (default), 3 bicubic, 4 Lanczos-3\n"
+            "  -e error          maximum error of the interpolated distortion map in pixels,\n"
+            "                    0 evaluates lensfun at every pixel (default %g)\n"
+            "Camera, lens, focal length and aperture default to the EXIF data of the input.\n",
+            name, cDefaultMapError);
+}
+//--------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    const int iValidFlags = LF_MODIFY_TCA | LF_MODIFY_VIGNETTING | LF_MODIFY_DISTORTION |
+                            LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE;
+
+    // same defaults as the plug-in
+    MyLensfunOpts opts;
+    opts.ModifyFlags   = LF_MODIFY_DISTORTION;
+    opts.Inverse       = false;
+    opts.Scale         = 0.0;
+    opts.Crop          = 0;
+    opts.Focal         = 0;
+    opts.Aperture      = 0;
+    opts.Distance      = 1.0;
+    opts.TargetGeom    = LF_RECTILINEAR;
+    opts.Interpolation = GL_INTERPOL_LZ;
+    opts.MaxMapError   = cDefaultMapError;
+    opts.AutoCrop      = false;
+
+    // options given on the command line, applied after EXIF
+    MyLensfunOpts cmdopts = opts;
+    const char   *maker = NULL, *camera = NULL, *lens = NULL;
+    vector<const char *> files;
+    bool bValid = true;
+
+    for (int i = 1; (i < argc) && bValid; i++)
+    {
+        const char *opt = argv[i];
+        const char *arg = (i + 1 < argc) ? argv[i + 1] : NULL;
+        int v;
+
+        if ((opt[0] != '-') || (opt[1] == 0)) {
+            files.push_back(opt);
+            continue;
+        }
+        if (strcmp(opt, "-r") == 0) {
+            cmdopts.Inverse = true;
+            continue;
+        }
+        if (strcmp(opt, "-k") == 0) {
+            cmdopts.AutoCrop = true;
+            continue;
+        }
+        if ((strlen(opt) != 2) || !arg) {
+            bValid = false;
+            continue;
+        }
+
+        switch (opt[1]) {
+            case 'm': maker  = arg; break;
+            case 'c': camera = arg; break;
+            case 'l': lens   = arg; break;
+            case 'f': bValid = (sscanf(arg, "%f", &cmdopts.Focal) == 1) && (cmdopts.Focal > 0); break;
+            case 'a': bValid = (sscanf(arg, "%f", &cmdopts.Aperture) == 1) && (cmdopts.Aperture > 0); break;
+            case 'd': bValid = (sscanf(arg, "%f", &cmdopts.Distance) == 1) && (cmdopts.Distance > 0); break;
+            case 's': bValid = (sscanf(arg, "%f", &cmdopts.Scale) == 1) && (cmdopts.Scale >= 0); break;
+            case 'g':
+                bValid = (sscanf(arg, "%d", &v) == 1) && (v > LF_UNKNOWN) && (v <= LF_FISHEYE_THOBY);
+                cmdopts.TargetGeom = (lfLensType) v;
+                break;
+            case 'x':
+                bValid = (sscanf(arg, "%d", &v) == 1) && !(v & ~iValidFlags);
+                cmdopts.ModifyFlags = v;
+                break;
+            case 'i':
+                bValid = (sscanf(arg, "%d", &v) == 1) && (v >= GL_INTERPOL_NN) && (v <= GL_INTERPOL_LZ3);
+                cmdopts.Interpolation = (glInterpolationType) v;
+                break;
+            case 'e':
+                bValid = (sscanf(arg, "%f", &cmdopts.MaxMapError) == 1) &&
+                         (cmdopts.MaxMapError >= 0) && (cmdopts.MaxMapError <= 1);
+                break;
+            default:
+                bValid = false;
+        }
+        i++;
+    }
+
+    if (!bValid || (files.size() != 2)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    CliImage img;
+    if (!read_image(files[0], &img))
+        return 1;
+
+    lfDatabase *db = new lfDatabase ();
+    if (db->Load () != LF_NO_ERROR) {
+        fprintf(stderr, "Could not load the lensfun database\n");
+        delete db;
+        return 1;
+    }
+
+    read_opts_from_exif(db, files[0], &opts);
+
+    // command line settings take precedence over EXIF
+    if (maker)  opts.CamMaker = maker;
+    if (camera) opts.Camera   = camera;
+    if (lens)   opts.Lens     = lens;
+    if (cmdopts.Focal > 0)    opts.Focal    = cmdopts.Focal;
+    if (cmdopts.Aperture > 0) opts.Aperture = cmdopts.Aperture;
+    opts.Distance      = cmdopts.Distance;
+    opts.Scale         = cmdopts.Scale;
+    opts.TargetGeom    = cmdopts.TargetGeom;
+    opts.ModifyFlags   = cmdopts.ModifyFlags;
+    opts.Inverse       = cmdopts.Inverse;
+    opts.Interpolation = cmdopts.Interpolation;
+    opts.MaxMapError   = cmdopts.MaxMapError;
+    opts.AutoCrop      = cmdopts.AutoCrop;
+
+    RadialMap  *radial = NULL;
+    GainMap    *gain   = NULL;
+    lfModifier *mod = create_modifier(db, &opts, img.width, img.height, cCliPixelFormat[img.type],
+                                      &radial, &gain);
+    if (!mod) {
+        fprintf(stderr, "Camera \"%s %s\" or lens \"%s\" not found in the lensfun database\n",
+                opts.CamMaker.c_str(), opts.Camera.c_str(), opts.Lens.c_str());
+        delete db;
+        return 1;
+    }
+
+    ImgRect area = { 0, 0, img.width, img.height };
+    if (opts.AutoCrop && !GetValidRect(mod, img.width, img.height, &area))
+        fprintf(stderr, "No valid area found, the image is not cropped\n");
+
+    CliImage out;
+    out.width    = area.width;
+    out.height   = area.height;
+    out.channels = img.channels;
+    out.type     = img.type;
+    out.data.resize(image_row_bytes(&out) * out.height);
+    InitInterpolation(opts.Interpolation);
+
+    switch (img.type) {
+        case CLI_PIXEL_U8:
+            correct_image<unsigned char>  (mod, opts.Interpolation, opts.MaxMapError,
+                                           (const unsigned char *) &img.data[0],
+                                           (unsigned char *) &out.data[0],
+                                           img.width, img.height, img.channels, radial, gain, &area);
+            break;
+        case CLI_PIXEL_U16:
+            correct_image<unsigned short> (mod, opts.Interpolation, opts.MaxMapError,
+                                           (const unsigned short *) &img.data[0],
+                                           (unsigned short *) &out.data[0],
+                                           img.width, img.height, img.channels, radial, gain, &area);
+            break;
+        case CLI_PIXEL_F32:
+            correct_image<float>          (mod, opts.Interpolation, opts.MaxMapError,
+                                           (const float *) &img.data[0],
+                                           (float *) &out.data[0],
+                                           img.width, img.height, img.channels, radial, gain, &area);
+            break;
+    }
+
+    delete radial;
+    delete gain;
+    delete mod;
+    delete db;
+
+    return write_image(files[1], &out) ? 0 : 1;
+}
+//--------------------------------------------------------------------
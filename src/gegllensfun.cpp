@@ -0,0 +1,549 @@
+/*
+ *
+ *
+ Copyright 2010-2011 Sebastian Kraft
+
+ This file is part of GimpLensfun.
+
+ GimpLensfun is free software: you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation, either version
+ 3 of the License, or (at your option) any later version.
+
+ GimpLensfun is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied
+ warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ PURPOSE. See the GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public
+ License along with GimpLensfun. If not, see
+ http://www.gnu.org/licenses/.
+
+*/
+
+/*
+ *  Lensfun correction as a GEGL operation
+ *
+ *  A GEGL module providing the filter "gimp-lensfun:correct". GIMP
+ *  2.10 runs it on its own tiled engine (Tools > GEGL Operation...)
+ *  with on-canvas preview, in the precision of the image and without
+ *  copying the drawable to a plug-in process and back.
+ *
+ *  Camera, lens and parameters are properties of the operation. The
+ *  modifier is set up by the correction core like in the plug-in,
+ *  once per set of properties and input size, in prepare(). Every
+ *  chunk GEGL asks for then runs the stages of pipeline.hpp:
+ *
+ *    - get_required_for_output() maps the border and a coarse grid
+ *      of the chunk through lensfun, so GEGL fetches only the source
+ *      area the chunk needs,
+ *    - process() maps all pixels, corrects the vignetting of the
+ *      fetched source and resamples the chunk.
+ *
+ *  GEGL spreads the chunks over its own threads. The module is built
+ *  without OpenMP, the stages then run on the calling thread only.
+ *
+ *  Samples are processed as linear RGBA float, lensfun's vignetting
+ *  model refers to linear light.
+ */
+
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+#include <vector>
+
+#include <gegl.h>
+#include <gegl-plugin.h>
+
+#include <lensfun/lensfun.h>
+
+#ifndef DEBUG
+#define DEBUG 0
+#endif
+
+#include "interpolation.hpp"
+#include "pipeline.hpp"
+#include "lensfuncore.hpp"
+
+using namespace std;
+
+
+//####################################################################
+// operation parameters
+const char *const cOpName     = "gimp-lensfun:correct";
+const int         cOpChannels = 4;          // RGBA float
+const int         cOpMargin   = 2;          // pixels added to the required source
+const int         cOpGridStep = 16;         // interior points sampled for the required source
+
+enum
+{
+    PROP_0,
+    PROP_CAMERA_MAKER,
+    PROP_CAMERA,
+    PROP_LENS,
+    PROP_FOCAL,
+    PROP_APERTURE,
+    PROP_DISTANCE,
+    PROP_SCALE,
+    PROP_TARGET_GEOMETRY,
+    PROP_MODIFY_FLAGS,
+    PROP_INVERSE,
+    PROP_INTERPOLATION,
+    PROP_MAP_ERROR
+};
+
+typedef struct
+{
+    GeglOperationFilter parent_instance;
+
+    // properties
+    gchar        *cam_maker;
+    gchar        *camera;
+    gchar        *lens;
+    gdouble       focal;
+    gdouble       aperture;
+    gdouble       distance;
+    gdouble       scale;
+    gint          target_geometry;
+    gint          modify_flags;
+    gboolean      inverse;
+    gint          interpolation;
+    gdouble       map_error;
+
+    // set up by prepare() for the current properties and input size,
+    // read only while chunks are processed
+    gchar        *key;
+    lfModifier   *mod;
+    RadialMap    *radial;
+    GainMap      *gain;
+    GeglRectangle bounds;
+} GlLensfunOp;
+
+typedef struct
+{
+    GeglOperationFilterClass parent_class;
+} GlLensfunOpClass;
+
+G_DEFINE_DYNAMIC_TYPE (GlLensfunOp, gl_lensfun_op, GEGL_TYPE_OPERATION_FILTER)
+
+#define GL_LENSFUN_OP(obj) ((GlLensfunOp *) (obj))
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// Lensfun database, loaded once for all instances of the operation
+static const lfDatabase *op_database()
+{
+    static gsize       initialized = 0;
+    static lfDatabase *db          = NULL;
+
+    if (g_once_init_enter (&initialized)) {
+        db = new lfDatabase ();
+        if ((db->Load () != LF_NO_ERROR) && DEBUG)
+            g_print ("gimp-lensfun: could not load the lensfun database\n");
+        g_once_init_leave (&initialized, 1);
+    }
+    return db;
+}
+//--------------------------------------------------------------------
+static void op_release_modifier(GlLensfunOp *self)
+{
+    delete self->mod;
+    delete self->radial;
+    delete self->gain;
+    g_free (self->key);
+    self->mod    = NULL;
+    self->radial = NULL;
+    self->gain   = NULL;
+    self->key    = NULL;
+}
+//--------------------------------------------------------------------
+static void op_get_opts(const GlLensfunOp *self, MyLensfunOpts *opts)
+{
+    opts->ModifyFlags   = self->modify_flags;
+    opts->Inverse       = self->inverse;
+    opts->CamMaker      = self->cam_maker ? self->cam_maker : "";
+    opts->Camera        = self->camera ? self->camera : "";
+    opts->Lens          = self->lens ? self->lens : "";
+    opts->Scale         = (float) self->scale;
+    opts->Crop          = 0;
+    opts->Focal         = (float) self->focal;
+    opts->Aperture      = (float) self->aperture;
+    opts->Distance      = (float) self->distance;
+    opts->TargetGeom    = (lfLensType) self->target_geometry;
+    opts->Interpolation = (glInterpolationType) self->interpolation;
+    opts->MaxMapError   = (float) self->map_error;
+    opts->AutoCrop      = false;        // the operation keeps its extent
+}
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// GObject boilerplate
+static void gl_lensfun_op_set_property(GObject *object, guint property_id,
+                                       const GValue *value, GParamSpec *pspec)
+{
+    GlLensfunOp *self = GL_LENSFUN_OP (object);
+
+    switch (property_id) {
+        case PROP_CAMERA_MAKER:
+            g_free (self->cam_maker);
+            self->cam_maker = g_value_dup_string (value);
+            break;
+        case PROP_CAMERA:
+            g_free (self->camera);
+            self->camera = g_value_dup_string (value);
+            break;
+        case PROP_LENS:
+            g_free (self->lens);
+            self->lens = g_value_dup_string (value);
+            break;
+        case PROP_FOCAL:            self->focal = g_value_get_double (value); break;
+        case PROP_APERTURE:         self->aperture = g_value_get_double (value); break;
+        case PROP_DISTANCE:         self->distance = g_value_get_double (value); break;
+        case PROP_SCALE:            self->scale = g_value_get_double (value); break;
+        case PROP_TARGET_GEOMETRY:  self->target_geometry = g_value_get_int (value); break;
+        case PROP_MODIFY_FLAGS:     self->modify_flags = g_value_get_int (value); break;
+        case PROP_INVERSE:          self->inverse = g_value_get_boolean (value); break;
+        case PROP_INTERPOLATION:    self->interpolation = g_value_get_int (value); break;
+        case PROP_MAP_ERROR:        self->map_error = g_value_get_double (value); break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+//--------------------------------------------------------------------
+static void gl_lensfun_op_get_property(GObject *object, guint property_id,
+                                       GValue *value, GParamSpec *pspec)
+{
+    GlLensfunOp *self = GL_LENSFUN_OP (object);
+
+    switch (property_id) {
+        case PROP_CAMERA_MAKER:     g_value_set_string (value, self->cam_maker); break;
+        case PROP_CAMERA:           g_value_set_string (value, self->camera); break;
+        case PROP_LENS:             g_value_set_string (value, self->lens); break;
+        case PROP_FOCAL:            g_value_set_double (value, self->focal); break;
+        case PROP_APERTURE:         g_value_set_double (value, self->aperture); break;
+        case PROP_DISTANCE:         g_value_set_double (value, self->distance); break;
+        case PROP_SCALE:            g_value_set_double (value, self->scale); break;
+        case PROP_TARGET_GEOMETRY:  g_value_set_int (value, self->target_geometry); break;
+        case PROP_MODIFY_FLAGS:     g_value_set_int (value, self->modify_flags); break;
+        case PROP_INVERSE:          g_value_set_boolean (value, self->inverse); break;
+        case PROP_INTERPOLATION:    g_value_set_int (value, self->interpolation); break;
+        case PROP_MAP_ERROR:        g_value_set_double (value, self->map_error); break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+//--------------------------------------------------------------------
+static void gl_lensfun_op_finalize(GObject *object)
+{
+    GlLensfunOp *self = GL_LENSFUN_OP (object);
+
+    op_release_modifier (self);
+    g_free (self->cam_maker);
+    g_free (self->camera);
+    g_free (self->lens);
+
+    G_OBJECT_CLASS (gl_lensfun_op_parent_class)->finalize (object);
+}
+//--------------------------------------------------------------------
+static void gl_lensfun_op_init(GlLensfunOp *self)
+{
+    self->cam_maker = g_strdup ("");
+    self->camera    = g_strdup ("");
+    self->lens      = g_strdup ("");
+    self->key       = NULL;
+    self->mod       = NULL;
+    self->radial    = NULL;
+    self->gain      = NULL;
+}
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// Operation
+//
+// The output has the size of the input, the corrected image is
+// resampled into the same frame like in the plug-in. The input is
+// requested premultiplied, as the resampler expects it, the output
+// comes with straight alpha.
+static void gl_lensfun_op_prepare(GeglOperation *operation)
+{
+    GlLensfunOp   *self   = GL_LENSFUN_OP (operation);
+    GeglRectangle *input  = gegl_operation_source_get_bounding_box (operation, "input");
+
+    gegl_operation_set_format (operation, "input", babl_format ("RaGaBaA float"));
+    gegl_operation_set_format (operation, "output", babl_format ("RGBA float"));
+
+    if (!input || (input->width <= 0) || (input->height <= 0)) {
+        op_release_modifier (self);
+        return;
+    }
+
+    gchar *key = g_strdup_printf ("%s|%s|%s|%d|%d|%.6g|%.6g|%.6g|%.6g|%d|%d,%d,%dx%d",
+                                  self->cam_maker, self->camera, self->lens,
+                                  self->modify_flags, self->inverse ? 1 : 0,
+                                  self->scale, self->focal, self->aperture, self->distance,
+                                  self->target_geometry,
+                                  input->x, input->y, input->width, input->height);
+
+    if (self->key && (strcmp (self->key, key) == 0)) {
+        g_free (key);
+        return;
+    }
+
+    op_release_modifier (self);
+    self->key    = key;
+    self->bounds = *input;
+
+    MyLensfunOpts opts;
+    op_get_opts (self, &opts);
+    self->mod = create_modifier (op_database (), &opts, input->width, input->height,
+                                 LF_PF_F32, &self->radial, &self->gain);
+
+    if (DEBUG) g_print ("gimp-lensfun: %s\n", self->mod ? "modifier set up" : "camera or lens not found");
+}
+//--------------------------------------------------------------------
+static GeglRectangle gl_lensfun_op_get_bounding_box(GeglOperation *operation)
+{
+    GeglRectangle  result = { 0, 0, 0, 0 };
+    GeglRectangle *input  = gegl_operation_source_get_bounding_box (operation, "input");
+
+    if (input)
+        result = *input;
+    return result;
+}
+//--------------------------------------------------------------------
+static void op_extend_required(const lfModifier *mod, float x, float y,
+                               float *xmin, float *xmax, float *ymin, float *ymax)
+{
+    float c[2*3];
+
+    MapPoint(mod, x, y, c);
+    for (int k = 0; k < 3; k++) {
+        if (!(c[2*k] == c[2*k]) || !(c[2*k+1] == c[2*k+1]))
+            continue;
+        *xmin = std::min(*xmin, c[2*k]);    *xmax = std::max(*xmax, c[2*k]);
+        *ymin = std::min(*ymin, c[2*k+1]);  *ymax = std::max(*ymax, c[2*k+1]);
+    }
+}
+//--------------------------------------------------------------------
+// Source area the output chunk roi reads. Every pixel of its border
+// and a coarse grid inside are mapped through lensfun, which catches
+// the bulge of curved edges, the interpolation radius and a margin
+// are added.
+static GeglRectangle gl_lensfun_op_get_required_for_output(GeglOperation       *operation,
+                                                           const gchar         *input_pad,
+                                                           const GeglRectangle *roi)
+{
+    GlLensfunOp        *self   = GL_LENSFUN_OP (operation);
+    const GeglRectangle bounds = self->bounds;
+
+    if (!self->mod || (roi->width <= 0) || (roi->height <= 0))
+        return *roi;
+
+    const float x0 = (float) (roi->x - bounds.x);
+    const float y0 = (float) (roi->y - bounds.y);
+    const int   x1 = roi->width - 1;
+    const int   y1 = roi->height - 1;
+
+    float xmin = FLT_MAX, xmax = -FLT_MAX;
+    float ymin = FLT_MAX, ymax = -FLT_MAX;
+
+    for (int j = 0; j <= x1; j++) {
+        op_extend_required(self->mod, x0 + j, y0,      &xmin, &xmax, &ymin, &ymax);
+        op_extend_required(self->mod, x0 + j, y0 + y1, &xmin, &xmax, &ymin, &ymax);
+    }
+    for (int i = 1; i < y1; i++) {
+        op_extend_required(self->mod, x0,      y0 + i, &xmin, &xmax, &ymin, &ymax);
+        op_extend_required(self->mod, x0 + x1, y0 + i, &xmin, &xmax, &ymin, &ymax);
+    }
+    for (int i = cOpGridStep; i < y1; i += cOpGridStep)
+        for (int j = cOpGridStep; j < x1; j += cOpGridStep)
+            op_extend_required(self->mod, x0 + j, y0 + i, &xmin, &xmax, &ymin, &ymax);
+
+    GeglRectangle result = { 0, 0, 0, 0 };
+    if (!(xmin <= xmax) || !(ymin <= ymax))
+        return result;
+
+    // clamp as float first, unmapped pixels are far outside
+    const int   iRadius = InterpolationRadius((glInterpolationType) self->interpolation) + cOpMargin;
+    const float fw      = (float) bounds.width;
+    const float fh      = (float) bounds.height;
+    const int   sx0 = (int) floorf(std::min(std::max(xmin, -1.0f), fw)) - iRadius;
+    const int   sy0 = (int) floorf(std::min(std::max(ymin, -1.0f), fh)) - iRadius;
+    const int   sx1 = (int) ceilf(std::min(std::max(xmax, -1.0f), fw)) + iRadius;
+    const int   sy1 = (int) ceilf(std::min(std::max(ymax, -1.0f), fh)) + iRadius;
+
+    result.x      = bounds.x + sx0;
+    result.y      = bounds.y + sy0;
+    result.width  = sx1 - sx0 + 1;
+    result.height = sy1 - sy0 + 1;
+    gegl_rectangle_intersect (&result, &result, &bounds);
+    return result;
+}
+//--------------------------------------------------------------------
+// Any input pixel may end up anywhere in the output
+static GeglRectangle gl_lensfun_op_get_invalidated_by_change(GeglOperation       *operation,
+                                                             const gchar         *input_pad,
+                                                             const GeglRectangle *input_region)
+{
+    GlLensfunOp *self = GL_LENSFUN_OP (operation);
+
+    return self->mod ? self->bounds : *input_region;
+}
+//--------------------------------------------------------------------
+static gboolean gl_lensfun_op_process(GeglOperation       *operation,
+                                      GeglBuffer          *input,
+                                      GeglBuffer          *output,
+                                      const GeglRectangle *result,
+                                      gint                 level)
+{
+    GlLensfunOp        *self   = GL_LENSFUN_OP (operation);
+    const GeglRectangle bounds = self->bounds;
+
+    if (!self->mod) {
+        gegl_buffer_copy (input, result, GEGL_ABYSS_NONE, output, result);
+        return TRUE;
+    }
+
+    const glInterpolationType interpolation = (glInterpolationType) self->interpolation;
+    const int tw = result->width;
+    const int th = result->height;
+
+    vector<float> coords((size_t) tw * th * 2 * 3);
+    vector<float> out((size_t) cOpChannels * tw * th);
+    ImgRect       win;
+
+    MapCoordinates(self->mod, result->x - bounds.x, result->y - bounds.y, tw, th,
+                   &coords[0], (float) self->map_error, self->radial);
+
+    if (GetSourceWindow(&coords[0], tw*th, InterpolationRadius(interpolation),
+                        bounds.width, bounds.height, &win))
+    {
+        const GeglRectangle rect = { bounds.x + win.x, bounds.y + win.y, win.width, win.height };
+        vector<float>       src((size_t) cOpChannels * win.width * win.height + cInterpolationPadding);
+
+        gegl_buffer_get (input, &rect, 1.0, babl_format ("RaGaBaA float"), &src[0],
+                         GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+
+        // the vignetting gain scales premultiplied colors the same
+        ModifyColors<float>(self->mod, &src[0], &win, cOpChannels);
+        ResampleTile<float>(GetResampler<float>(interpolation, cOpChannels), &src[0], &win,
+                            cOpChannels, &coords[0], tw, th, self->gain, &out[0]);
+    }
+    // otherwise the chunk maps completely outside of the source and
+    // stays transparent
+
+    gegl_buffer_set (output, result, 0, babl_format ("RGBA float"), &out[0], GEGL_AUTO_ROWSTRIDE);
+    return TRUE;
+}
+//--------------------------------------------------------------------
+static void gl_lensfun_op_class_init(GlLensfunOpClass *klass)
+{
+    GObjectClass             *object_class    = G_OBJECT_CLASS (klass);
+    GeglOperationClass       *operation_class = GEGL_OPERATION_CLASS (klass);
+    GeglOperationFilterClass *filter_class    = GEGL_OPERATION_FILTER_CLASS (klass);
+    const GParamFlags         flags           = (GParamFlags) (G_PARAM_READWRITE |
+                                                               G_PARAM_CONSTRUCT |
+                                                               GEGL_PARAM_PAD_INPUT);
+
+    object_class->set_property = gl_lensfun_op_set_property;
+    object_class->get_property = gl_lensfun_op_get_property;
+    object_class->finalize     = gl_lensfun_op_finalize;
+
+    operation_class->prepare                   = gl_lensfun_op_prepare;
+    operation_class->get_bounding_box          = gl_lensfun_op_get_bounding_box;
+    operation_class->get_required_for_output   = gl_lensfun_op_get_required_for_output;
+    operation_class->get_invalidated_by_change = gl_lensfun_op_get_invalidated_by_change;
+    operation_class->threaded                  = TRUE;
+    filter_class->process                      = gl_lensfun_op_process;
+
+    g_object_class_install_property (object_class, PROP_CAMERA_MAKER,
+        g_param_spec_string ("camera-maker", "Camera maker",
+                             "Maker of the camera as in the lensfun database", "", flags));
+    g_object_class_install_property (object_class, PROP_CAMERA,
+        g_param_spec_string ("camera", "Camera",
+                             "Camera model as in the lensfun database", "", flags));
+    g_object_class_install_property (object_class, PROP_LENS,
+        g_param_spec_string ("lens", "Lens",
+                             "Lens model as in the lensfun database", "", flags));
+    g_object_class_install_property (object_class, PROP_FOCAL,
+        g_param_spec_double ("focal", "Focal length", "Focal length in mm",
+                             0.0, 10000.0, 0.0, flags));
+    g_object_class_install_property (object_class, PROP_APERTURE,
+        g_param_spec_double ("aperture", "Aperture", "F-number",
+                             0.0, 1000.0, 0.0, flags));
+    g_object_class_install_property (object_class, PROP_DISTANCE,
+        g_param_spec_double ("distance", "Distance", "Subject distance in m",
+                             0.0, 1000.0, 1.0, flags));
+    g_object_class_install_property (object_class, PROP_SCALE,
+        g_param_spec_double ("scale", "Scale",
+                             "Scale of the corrected image, 0 scales it to fit",
+                             0.0, 100.0, 0.0, flags));
+    g_object_class_install_property (object_class, PROP_TARGET_GEOMETRY,
+        g_param_spec_int ("target-geometry", "Target geometry",
+                          "Projection of the result (lfLensType)",
+                          LF_UNKNOWN, LF_FISHEYE_THOBY, LF_RECTILINEAR, flags));
+    g_object_class_install_property (object_class, PROP_MODIFY_FLAGS,
+        g_param_spec_int ("modify-flags", "Corrections",
+                          "Corrections to apply (LF_MODIFY_* flags)",
+                          0, LF_MODIFY_ALL, LF_MODIFY_DISTORTION, flags));
+    g_object_class_install_property (object_class, PROP_INVERSE,
+        g_param_spec_boolean ("inverse", "Inverse", "Apply the inverse correction",
+                              FALSE, flags));
+    g_object_class_install_property (object_class, PROP_INTERPOLATION,
+        g_param_spec_int ("interpolation", "Interpolation",
+                          "0 nearest, 1 bilinear, 2 Lanczos-2, 3 bicubic, 4 Lanczos-3",
+                          GL_INTERPOL_NN, GL_INTERPOL_LZ3, GL_INTERPOL_LZ, flags));
+    g_object_class_install_property (object_class, PROP_MAP_ERROR,
+        g_param_spec_double ("map-error", "Max. map error",
+                             "Maximum error of the approximated coordinate map in pixels, "
+                             "0 evaluates lensfun at every pixel",
+                             0.0, 1.0, cDefaultMapError, flags));
+
+    gegl_operation_class_set_keys (operation_class,
+        "name",        cOpName,
+        "title",       "Lensfun correction",
+        "categories",  "distort",
+        "description", "Corrects lens distortion, chromatic aberration and vignetting "
+                       "with the lensfun database",
+        NULL);
+
+    // the tables of both Lanczos kernels are filled once, chunks are
+    // resampled concurrently
+    InitInterpolation(GL_INTERPOL_LZ);
+    InitInterpolation(GL_INTERPOL_LZ3);
+}
+//--------------------------------------------------------------------
+static void gl_lensfun_op_class_finalize(GlLensfunOpClass *klass)
+{
+}
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// GEGL module entry points
+static const GeglModuleInfo sModuleInfo =
+{
+    GEGL_MODULE_ABI_VERSION
+};
+
+extern "C" {
+
+G_MODULE_EXPORT const GeglModuleInfo *gegl_module_query(GTypeModule *module)
+{
+    return &sModuleInfo;
+}
+
+G_MODULE_EXPORT gboolean gegl_module_register(GTypeModule *module)
+{
+    gl_lensfun_op_register_type (module);
+    return TRUE;
+}
+
+}
+//--------------------------------------------------------------------
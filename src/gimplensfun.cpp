@@ -25,15 +25,24 @@
 #include <math.h>
 #include <string>
 #include <vector>
+#include <map>
+#include <algorithm>
 #include <float.h>
 
 #include <lensfun/lensfun.h>
 #include <libgimp/gimp.h>
 #include <libgimp/gimpui.h>
+#include <glib/gstdio.h>
 
-#include <exiv2/error.hpp>
-#include <exiv2/image.hpp>
-#include <exiv2/exif.hpp>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef G_OS_WIN32
+#define fseek64 _fseeki64
+#else
+#define fseek64 fseeko
+#endif
 
 #define VERSIONSTR "0.2.5-dev"
 
@@ -42,7 +51,9 @@
 #define DEBUG 0
 #endif
 
-#include "LUT.hpp"
+#include "interpolation.hpp"
+#include "pipeline.hpp"
+#include "lensfuncore.hpp"
 
 using namespace std;
 
@@ -56,6 +67,14 @@ static void run   (const gchar      *name,
                    GimpParam       **return_vals);
 
 static gboolean create_dialog_window (GimpDrawable *drawable);
+
+const int cNumSettingsArgs = 13;                   // see settings_args in query()
+const int cMinSettingsArgs = 11;                   // settings appended later are optional
+const int cNumPDBArgs      = 3 + cNumSettingsArgs;  // run-mode, image, drawable
+const int cNumBatchArgs    = 6 + cNumSettingsArgs;  // run-mode, files, images, output-dir
+
+static void preview_invalidated (GimpPreview *preview, gpointer data);
+static void preview_cancel (void);
 //--------------------------------------------------------------------
 
 
@@ -63,22 +82,141 @@ static gboolean create_dialog_window (GimpDrawable *drawable);
 // Global variables
 GtkWidget *camera_combo, *maker_combo, *lens_combo;
 GtkWidget *CorrVignetting, *CorrTCA, *CorrDistortion;
+GtkWidget *preview = NULL;
 lfDatabase *ldb;
 bool bComboBoxLock = false;
 //--------------------------------------------------------------------
 
 
 //####################################################################
-// interpolation parameters
-const int cLanczosWidth = 2;
-const int cLanczosTableRes = 256;
-LUT<float> LanczosLUT (cLanczosWidth * 2 * cLanczosTableRes + 1);
+// lensfun database snapshot
+const guint32   cDBSnapshotVersion  = 2;
+
+// first line of the snapshot: cDBSnapshotVersion, LF_VERSION of the
+// writer, fingerprint of the XML files it was made from and the bytes
+// of database XML following the line
+#define DB_SNAPSHOT_HEADER "<!-- gimp-lensfun database snapshot %u, lensfun %u, fingerprint %016llx, %lu bytes -->\n"
+
+// fingerprint of the loaded database, see database_fingerprint()
+static guint64 sDBFingerprint = 0;
+
+
+//####################################################################
+// on-disk cache of coordinate maps
+const char      cMapCacheMagic[8] = { 'G', 'L', 'F', 'M', 'A', 'P', 'C', 'H' };
+const guint32   cMapCacheVersion  = 1;
+const gint64    cMapCacheMaxBytes = G_GINT64_CONSTANT(4) << 30;  // 4 GiB
+const gint16    cMapInvalid       = -32768;     // marks coordinates lensfun could not map
+// Displacements are stored with at least 1/64 pixel resolution, about
+// the limit of the interpolation kernels, so a map read from the cache
+// gives the same result as computing it. Larger ones are not cached.
+const gint      cMapMinFracBits   = 6;
+const gint      cMapMaxFracBits   = 8;
+
+typedef struct
+{
+    char    Magic[8];
+    guint32 Version;            // cMapCacheVersion
+    guint32 LensfunVersion;     // LF_VERSION of the writer
+    guint32 Width;
+    guint32 Height;
+    guint32 Pairs;              // coordinate pairs per pixel, 1 or 3 (TCA)
+    guint32 FracBits;           // fixed point fraction bits of the displacements
+    guint32 KeySize;            // bytes of the cache key following the header
+    guint32 Reserved;
+} CoordMapHeader;
+
+// A coordinate map is either read from a mapped cache file or, on a
+// cache miss, written to a temporary file while the image is processed
+typedef struct
+{
+    GMappedFile  *map;          // != NULL if reading
+    const gint16 *data;
+    FILE         *fp;           // != NULL if writing
+    gchar        *path;
+    gchar        *tmppath;
+    gint64        offset;       // of the map data in the file
+    gint          width, height;
+    gint          pairs;
+    gint          fracbits;
+    bool          overflow;     // a displacement did not fit, drop the file
+} CoordMapCache;
+
+// Modifier and coordinate map of the last processed image, reused by
+// the next one if settings, size and pixel type are the same
+typedef struct
+{
+    lfModifier   *mod;
+    RadialMap    *radial;       // NULL unless the correction is radial
+    GainMap      *gain;         // NULL unless the resampler does vignetting
+    gchar        *key;
+    CoordMapCache cache;
+} ProcessContext;
+
+typedef enum GL_PIXEL {
+    GL_PIXEL_U8,
+    GL_PIXEL_U16,
+    GL_PIXEL_F32
+} glPixelType;
+
+const lfPixelFormat cLensfunPixelFormat[] = {
+    LF_PF_U8,
+    LF_PF_U16,
+    LF_PF_F32
+};
+
+// source and destination of the pixel data of a drawable
+typedef struct
+{
+    GimpDrawable *drawable;
+    glPixelType   type;
+    gint          channels;
+#if GIMP_CHECK_VERSION(2,10,0)
+    GeglBuffer   *buffer_in;
+    GeglBuffer   *buffer_out;
+    const Babl   *format;
+#else
+    GimpPixelRgn  rgn_in;       // the output goes to the shadow tiles directly
+#endif
+} DrawableIO;
+
+// buffers reused from one output tile to the next
+template <typename T>
+struct TileBuffers
+{
+    float *UndistCoord;         // 3 coordinate pairs per output pixel
+    T     *ImgBufferOut;        // output tile, only for the preview
+    T     *ImgBuffer;           // source window, grows on demand
+    gsize  iBufferSize;
+    gsize  iMaxWindow;          // largest source window so far
+};
+
+
+//####################################################################
+// preview state
+//
+// The preview is rendered band by band from an idle handler, so the
+// dialog stays responsive. A parameter change removes the handler
+// and starts over with a fresh modifier.
+const int cPreviewBandRows = 32;
 
-typedef enum GL_INTERPOL {
-    GL_INTERPOL_NN,		// Nearest Neighbour
-    GL_INTERPOL_BL,		// Bilinear
-    GL_INTERPOL_LZ		// Lanczos
-} glInterpolationType;
+typedef struct
+{
+    guint         idle_id;          // running render, 0 if none
+    lfModifier   *mod;
+    RadialMap    *radial;
+    GainMap      *gain;
+    DrawableIO    io;
+    TileBuffers<guchar> bufs;
+    gint          x1, y1;           // selection in drawable coordinates
+    gint          width, height;
+    gint          px, py;           // visible area in drawable coordinates
+    gint          pwidth, pheight;
+    gint          row;              // next row of the visible area
+    guchar       *buffer;           // visible area as drawn
+} PreviewState;
+
+static PreviewState sPreview;
 
 
 //####################################################################
@@ -102,25 +240,26 @@ const string    CameraMakers[] = {
     "NULL"
 };
 //--------------------------------------------------------------------
+// Interpolation methods in the order of the dialog combo box
+const glInterpolationType cInterpolationMenu[] = {
+    GL_INTERPOL_NN,
+    GL_INTERPOL_BL,
+    GL_INTERPOL_BC,
+    GL_INTERPOL_LZ,
+    GL_INTERPOL_LZ3
+};
+const char *const cInterpolationNames[] = {
+    "Nearest neighbour",
+    "Bilinear",
+    "Bicubic",
+    "Lanczos-2",
+    "Lanczos-3"
+};
+//--------------------------------------------------------------------
 
 
 //####################################################################
-// struct for holding camera/lens info and parameters
-typedef struct
-{
-    int ModifyFlags;
-    bool Inverse;
-    std::string Camera;
-    std::string CamMaker;
-    std::string Lens;
-    float Scale;
-    float Crop;
-    float Focal;
-    float Aperture;
-    float Distance;
-    lfLensType TargetGeom;
-} MyLensfunOpts;
-//--------------------------------------------------------------------
+// camera/lens info and parameters of the current image
 static MyLensfunOpts sLensfunParameters =
 {
     LF_MODIFY_DISTORTION,
@@ -133,7 +272,10 @@ static MyLensfunOpts sLensfunParameters =
     0,
     0,
     1.0,
-    LF_RECTILINEAR
+    LF_RECTILINEAR,
+    GL_INTERPOL_LZ,
+    cDefaultMapError,
+    false
 };
 //--------------------------------------------------------------------
 
@@ -153,6 +295,9 @@ typedef struct
     float Aperture;
     float Distance;
     lfLensType TargetGeom;
+    glInterpolationType Interpolation;
+    float MaxMapError;
+    bool AutoCrop;
 } MyLensfunOptStorage;
 //--------------------------------------------------------------------
 static MyLensfunOptStorage sLensfunParameterStorage =
@@ -167,7 +312,10 @@ static MyLensfunOptStorage sLensfunParameterStorage =
     0,
     0,
     1.0,
-    LF_RECTILINEAR
+    LF_RECTILINEAR,
+    GL_INTERPOL_LZ,
+    cDefaultMapError,
+    false
 };
 
 
@@ -206,18 +354,159 @@ static void  query (void)
         }
     };
 
+    static GimpParamDef batch_args[] =
+    {
+        {
+            GIMP_PDB_INT32,
+            (char *)"run-mode",
+            (char *)"Run mode"
+        },
+        {
+            GIMP_PDB_INT32,
+            (char *)"num-files",
+            (char *)"Number of image files"
+        },
+        {
+            GIMP_PDB_STRINGARRAY,
+            (char *)"files",
+            (char *)"Image files to load, correct and save to output-dir"
+        },
+        {
+            GIMP_PDB_INT32,
+            (char *)"num-images",
+            (char *)"Number of open images"
+        },
+        {
+            GIMP_PDB_INT32ARRAY,
+            (char *)"images",
+            (char *)"IDs of open images to correct in place"
+        },
+        {
+            GIMP_PDB_STRING,
+            (char *)"output-dir",
+            (char *)"Directory the corrected files are saved to"
+        }
+    };
+
+    static GimpParamDef batch_return[] =
+    {
+        {
+            GIMP_PDB_INT32,
+            (char *)"num-corrected",
+            (char *)"Number of images that have been corrected"
+        }
+    };
+
+    // correction settings, appended to the arguments of both procedures
+    static GimpParamDef settings_args[] =
+    {
+        {
+            GIMP_PDB_STRING,
+            (char *)"maker",
+            (char *)"Camera maker"
+        },
+        {
+            GIMP_PDB_STRING,
+            (char *)"camera",
+            (char *)"Camera model"
+        },
+        {
+            GIMP_PDB_STRING,
+            (char *)"lens",
+            (char *)"Lens model"
+        },
+        {
+            GIMP_PDB_FLOAT,
+            (char *)"focal",
+            (char *)"Focal length in mm"
+        },
+        {
+            GIMP_PDB_FLOAT,
+            (char *)"aperture",
+            (char *)"Aperture (f-number)"
+        },
+        {
+            GIMP_PDB_FLOAT,
+            (char *)"distance",
+            (char *)"Focus distance in m"
+        },
+        {
+            GIMP_PDB_FLOAT,
+            (char *)"scale",
+            (char *)"Scale factor, 0 scales the result to fit the image"
+        },
+        {
+            GIMP_PDB_INT32,
+            (char *)"target-geometry",
+            (char *)"Target geometry as lensfun lfLensType (1 = rectilinear)"
+        },
+        {
+            GIMP_PDB_INT32,
+            (char *)"modify-flags",
+            (char *)"Corrections as lensfun LF_MODIFY_* flags (TCA = 1, vignetting = 2, distortion = 8, geometry = 16, scale = 32)"
+        },
+        {
+            GIMP_PDB_INT32,
+            (char *)"inverse",
+            (char *)"Simulate the lens instead of correcting it { FALSE, TRUE }"
+        },
+        {
+            GIMP_PDB_INT32,
+            (char *)"interpolation",
+            (char *)"Interpolation { NEAREST (0), LINEAR (1), LANCZOS2 (2), BICUBIC (3), LANCZOS3 (4) }"
+        },
+        {
+            GIMP_PDB_FLOAT,
+            (char *)"map-error",
+            (char *)"Maximum error of the interpolated distortion map in pixels, 0 evaluates lensfun at every pixel (0.05 if omitted)"
+        },
+        {
+            GIMP_PDB_INT32,
+            (char *)"auto-crop",
+            (char *)"Crop the layer to the largest rectangle without empty borders, only if the whole layer is corrected { FALSE, TRUE }"
+        }
+    };
+
+    vector<GimpParamDef> vArgs (args, args + G_N_ELEMENTS (args));
+    vArgs.insert (vArgs.end(), settings_args, settings_args + G_N_ELEMENTS (settings_args));
+
+    vector<GimpParamDef> vBatchArgs (batch_args, batch_args + G_N_ELEMENTS (batch_args));
+    vBatchArgs.insert (vBatchArgs.end(), settings_args, settings_args + G_N_ELEMENTS (settings_args));
+
     gimp_install_procedure (
         "plug-in-lensfun",
         "Correct lens distortion with lensfun",
-        "Correct lens distortion with lensfun",
+        "Correct lens distortion with lensfun. Called non-interactively "
+        "with only run-mode, image and drawable, the settings are read "
+        "from the EXIF data of the image file or, failing that, taken "
+        "from the last interactive run. With all arguments given they "
+        "are used as is and the stored settings are left untouched.",
         "Sebastian Kraft",
         "Copyright Sebastian Kraft",
         "2010",
         "_GimpLensfun...",
-        "RGB",
+        "RGB*, GRAY*",
+        GIMP_PLUGIN,
+        vArgs.size(), 0,
+        &vArgs[0], NULL);
+
+    gimp_install_procedure (
+        "plug-in-lensfun-batch",
+        "Correct lens distortion of several images with lensfun",
+        "Correct lens distortion of several images with lensfun in one "
+        "run. Files are loaded, corrected and saved under the same name "
+        "to output-dir, open images are corrected in place. If maker is "
+        "empty, camera, lens, focal length and aperture are taken from "
+        "the EXIF data of each image. Images with the same settings and "
+        "size share the lensfun setup and the coordinate map.",
+        "Sebastian Kraft",
+        "Copyright Sebastian Kraft",
+        "2010",
+        NULL,
+        "",
         GIMP_PLUGIN,
-        G_N_ELEMENTS (args), 0,
-        args, NULL);
+        vBatchArgs.size(), G_N_ELEMENTS (batch_return),
+        &vBatchArgs[0], batch_return);
 
     gimp_plugin_menu_register ("plug-in-lensfun",
                                "<Image>/Filters/Enhance");
@@ -228,37 +517,6 @@ static void  query (void)
 //####################################################################
 // Some helper functions
 
-// Round float to integer value
-int roundfloat2int(float d)
-{
-    return d<0?d-.5:d+.5;
-}
-//--------------------------------------------------------------------
-void StrReplace(std::string& str, const std::string& old, const std::string& newstr)
-{
-    size_t pos = 0;
-    while ((pos = str.find(old, pos)) != std::string::npos)
-    {
-        str.replace(pos, old.length(), newstr);
-        pos += newstr.length();
-    }
-}
-//--------------------------------------------------------------------
-int StrCompare(const std::string& str1, const std::string& str2, bool CaseSensitive = false)
-{
-    string s1 = str1;
-    string s2 = str2;
-
-    if (!CaseSensitive)
-    {
-        transform(s1.begin(), s1.end(), s1.begin(), ::tolower);
-        transform(s2.begin(), s2.end(), s2.begin(), ::tolower);
-    }
-
-    return s1.compare(s2);
-
-}
-//--------------------------------------------------------------------
 #ifdef POSIX
 unsigned long long int timespec2llu(struct timespec *ts) {
     return (unsigned long long int) ( ((unsigned long long int)ts->tv_sec * 1000000000) + ts->tv_nsec);
@@ -333,186 +591,441 @@ static void PrintLenses (const lfLens **lenses)
 
 
 //####################################################################
-// set dialog combo boxes to values
-static void dialog_set_cboxes( string sNewMake, string sNewCamera, string sNewLens) {
-
-    vector<string> vCameraList;
-    vector<string> vLensList;
-
-    const lfCamera**    cameras     = NULL;
-    const lfLens**  lenses      = NULL;
-    GtkTreeModel*   store       = NULL;
+// Camera and lens catalogue of the dialog
+//
+// The database is indexed once per session, makers to their cameras
+// and cameras to the lenses that fit them. Every name carries a key
+// of its lower case letters and digits, lookups compare keys only.
+// The cameras of a maker are those lensfun finds for its name, which
+// covers all spellings of the maker in the database, and are listed
+// the first time the maker is selected. lensfun picks the lenses of
+// a camera by mount and crop factor, so cameras sharing both share
+// one lens list. It is filled the first time such a camera is
+// selected.
+typedef struct
+{
+    string          Name;
+    string          Key;
+    const lfLens   *lens;
+} CatalogueLens;
 
-    int iCurrMakerID    = -1;
-    int iCurrCameraID   = -1;
-    int iCurrLensId     = -1;
+typedef struct
+{
+    string          Name;
+    string          Key;
+    const lfCamera *camera;
+    int             iLensList;      // into Catalogue::lensLists, -1 until needed
+} CatalogueCamera;
 
-    sLensfunParameters.CamMaker.clear();
-    sLensfunParameters.Camera.clear();
-    sLensfunParameters.Lens.clear();
+typedef struct
+{
+    vector<CatalogueCamera> cameras;        // sorted by key
+} CatalogueMaker;
 
-    if (sNewMake.empty()==true)
-            return;
+typedef struct
+{
+    map<string, CatalogueMaker>     makers;         // by key of the maker name
+    map<string, int>                lensListIds;    // mount and crop factor -> lensLists
+    vector<vector<CatalogueLens> >  lensLists;      // sorted by key
+} Catalogue;
 
-    // try to match maker with predefined list
-    int iNumMakers = 0;
-    for (int i = 0; CameraMakers[i].compare("NULL")!=0; i++)
-    {
-        if (StrCompare(CameraMakers[i], sNewMake)==0) {
-            gtk_combo_box_set_active(GTK_COMBO_BOX(maker_combo), i);
-            iCurrMakerID = i;
-        }
-        iNumMakers++;
-    }
+static Catalogue sCatalogue;
 
-    if (iCurrMakerID>=0)
-        sLensfunParameters.CamMaker = CameraMakers[iCurrMakerID];
-    else {
-        gtk_combo_box_append_text( GTK_COMBO_BOX(maker_combo), sNewMake.c_str());
-        gtk_combo_box_set_active(GTK_COMBO_BOX(maker_combo), iNumMakers);
-        iNumMakers++;
-        sLensfunParameters.CamMaker = sNewMake;
-    }
+// Incremental filter of a combo box entry. The rows matching the text
+// typed so far are remembered, typing more only rechecks those.
+typedef struct
+{
+    vector<const string *> keys;    // of the rows of the combo box
+    vector<char>           matched; // rows matching typed
+    string                 typed;   // text the rows were matched against
+} TypeAhead;
 
-    // clear camera/lens combobox
-    store = gtk_combo_box_get_model( GTK_COMBO_BOX(camera_combo) );
-    gtk_list_store_clear( GTK_LIST_STORE( store ) );
-    store = gtk_combo_box_get_model( GTK_COMBO_BOX(lens_combo) );
-    gtk_list_store_clear( GTK_LIST_STORE( store ) );
+static TypeAhead sCameraTypeAhead;
+static TypeAhead sLensTypeAhead;
+//--------------------------------------------------------------------
+static string catalogue_key(const char *name)
+{
+    string key;
+    for (const char *c = name; c && *c; c++)
+        if (g_ascii_isalnum (*c) || (*c & 0x80))
+            key += g_ascii_tolower (*c);
+    return key;
+}
+//--------------------------------------------------------------------
+template <typename E>
+static bool catalogue_less(const E &a, const E &b)
+{
+    return (a.Key < b.Key) || ((a.Key == b.Key) && (a.Name < b.Name));
+}
+//--------------------------------------------------------------------
+template <typename E>
+static bool catalogue_key_less(const E &a, const string &key)
+{
+    return a.Key < key;
+}
+//--------------------------------------------------------------------
+// Entry of the sorted list v with the given key, NULL if there is none
+template <typename E>
+static E *catalogue_find(vector<E> &v, const string &key)
+{
+    typename vector<E>::iterator it = lower_bound(v.begin(), v.end(), key, catalogue_key_less<E>);
+    return ((it != v.end()) && (it->Key == key) && !key.empty()) ? &*it : NULL;
+}
+//--------------------------------------------------------------------
+// Maker entry for a maker name, NULL for an empty name. Names of the
+// dialog and the EXIF data may be a shorter or longer form of the one
+// in the database, like "Olympus" and "Olympus Imaging Corp." or
+// "NIKON CORPORATION" and "Nikon", lensfun matches them loosely.
+static CatalogueMaker *catalogue_find_maker(const lfDatabase *db, const string &name)
+{
+    const string key = catalogue_key(name.c_str());
 
-    // get all cameras from maker out of database
-    cameras = ldb->FindCamerasExt (sLensfunParameters.CamMaker.c_str(), NULL, LF_SEARCH_LOOSE );
-    if (cameras) {
-        for (int i=0; cameras [i]; i++){
-            vCameraList.push_back(string(lf_mlstr_get(cameras[i]->Model)));
-        }
-        sort(vCameraList.begin(), vCameraList.end());
-    } else {
-        return;
-    }
+    if (key.empty())
+        return NULL;
 
-    for (unsigned int i=0; i<vCameraList.size(); i++)
+    map<string, CatalogueMaker>::iterator it = sCatalogue.makers.find(key);
+    if (it == sCatalogue.makers.end())
     {
-        gtk_combo_box_append_text( GTK_COMBO_BOX( camera_combo ), vCameraList[i].c_str());
-        // set to active if model matches current camera
-        if ((!sNewCamera.empty()) && (StrCompare(sNewCamera, vCameraList[i])==0)) {
-            gtk_combo_box_set_active(GTK_COMBO_BOX(camera_combo), i);
-            sLensfunParameters.Camera = sNewCamera;
+        CatalogueMaker maker;
+        const lfCamera **cameras = db->FindCamerasExt (name.c_str(), NULL, LF_SEARCH_LOOSE);
+        for (int i = 0; cameras && cameras[i]; i++) {
+            CatalogueCamera camera;
+            camera.Name      = string(lf_mlstr_get (cameras[i]->Model));
+            camera.Key       = catalogue_key(camera.Name.c_str());
+            camera.camera    = cameras[i];
+            camera.iLensList = -1;
+            maker.cameras.push_back(camera);
         }
+        lf_free (cameras);
+        sort(maker.cameras.begin(), maker.cameras.end(), catalogue_less<CatalogueCamera>);
 
-        if (StrCompare(string(lf_mlstr_get(cameras[i]->Model)), sNewCamera)==0)
-            iCurrCameraID = i;
-    }
-
-    // return if camera is unidentified
-    if (iCurrCameraID == -1)
-    {
-        lf_free(cameras);
-        return;
-    }
-
-    // find lenses for camera model
-    lenses = ldb->FindLenses (cameras[iCurrCameraID], NULL, NULL);
-    if (lenses) {
-        vLensList.clear();
-        for (int i = 0; lenses [i]; i++)
-            vLensList.push_back(string(lf_mlstr_get(lenses[i]->Model)));
-        sort(vLensList.begin(), vLensList.end());
-    } else {
-        lf_free(cameras);
-        return;
+        it = sCatalogue.makers.insert(make_pair(key, maker)).first;
+        if (DEBUG) g_print ("Catalogue: %d cameras of %s\n", (int) maker.cameras.size(), name.c_str());
     }
-
-    for (unsigned int i = 0; i<vLensList.size(); i++)
+    return &it->second;
+}
+//--------------------------------------------------------------------
+static vector<CatalogueLens> &catalogue_lenses(const lfDatabase *db, CatalogueCamera *camera)
+{
+    if (camera->iLensList < 0)
     {
-        gtk_combo_box_append_text( GTK_COMBO_BOX( lens_combo ), (vLensList[i]).c_str());
+        gchar *key = g_strdup_printf ("%s|%g", camera->camera->Mount ? camera->camera->Mount : "",
+                                      camera->camera->CropFactor);
+        map<string, int>::iterator it = sCatalogue.lensListIds.find(key);
+
+        if (it == sCatalogue.lensListIds.end()) {
+            vector<CatalogueLens> list;
+            const lfLens **lenses = db->FindLenses (camera->camera, NULL, NULL);
+            for (int i = 0; lenses && lenses[i]; i++) {
+                CatalogueLens lens;
+                lens.Name = string(lf_mlstr_get (lenses[i]->Model));
+                lens.Key  = catalogue_key(lens.Name.c_str());
+                lens.lens = lenses[i];
+                list.push_back(lens);
+            }
+            lf_free (lenses);
+            sort(list.begin(), list.end(), catalogue_less<CatalogueLens>);
 
-        // set active if lens matches current lens model
-        if ((!sNewLens.empty()) && (StrCompare(sNewLens, vLensList[i])==0)) {
-            gtk_combo_box_set_active(GTK_COMBO_BOX(lens_combo), i);
-            sLensfunParameters.Lens = sNewLens;
+            it = sCatalogue.lensListIds.insert(make_pair(string(key), (int) sCatalogue.lensLists.size())).first;
+            sCatalogue.lensLists.push_back(list);
         }
 
-        if (StrCompare(string(lf_mlstr_get(lenses[i]->Model)), sNewLens)==0)
-            iCurrLensId = i;
+        camera->iLensList = it->second;
+        g_free (key);
     }
+    return sCatalogue.lensLists[camera->iLensList];
+}
+//--------------------------------------------------------------------
+// Completion match function of the camera and lens entries. Every
+// word of the typed text has to occur in the key of a row, so
+// "70 200 2.8" finds "EF 70-200mm f/2.8L IS USM".
+static gboolean typeahead_match(GtkEntryCompletion *completion, const gchar *key,
+                                GtkTreeIter *iter, gpointer data)
+{
+    TypeAhead *ta  = (TypeAhead *) data;
+    gint       row = -1;
 
-    gtk_widget_set_sensitive(CorrTCA, false);
-    gtk_widget_set_sensitive(CorrVignetting, false);
+    gtk_tree_model_get (gtk_entry_completion_get_model (completion), iter, 1, &row, -1);
+    if ((row < 0) || (row >= (gint) ta->keys.size()))
+        return FALSE;
 
-    if (iCurrLensId >= 0)
+    if ((ta->matched.size() != ta->keys.size()) || (ta->typed != key))
     {
-        if (lenses[iCurrLensId]->CalibTCA != NULL)
-            gtk_widget_set_sensitive(CorrTCA, true);
-        if (lenses[iCurrLensId]->CalibVignetting != NULL)
-            gtk_widget_set_sensitive(CorrVignetting, true);
+        // more text can only narrow the matching rows down
+        const bool bNarrow = (ta->matched.size() == ta->keys.size()) &&
+                             (strncmp (key, ta->typed.c_str(), ta->typed.length()) == 0);
+
+        vector<string> vWords;
+        gchar **words = g_strsplit (key, " ", -1);
+        for (int i = 0; words[i]; i++) {
+            const string word = catalogue_key(words[i]);
+            if (!word.empty())
+                vWords.push_back(word);
+        }
+        g_strfreev (words);
+
+        ta->matched.resize(ta->keys.size(), 1);
+        for (unsigned int i = 0; i < ta->keys.size(); i++) {
+            if (bNarrow && !ta->matched[i])
+                continue;
+            bool bMatch = true;
+            for (unsigned int j = 0; bMatch && (j < vWords.size()); j++)
+                bMatch = (ta->keys[i]->find(vWords[j]) != string::npos);
+            ta->matched[i] = bMatch;
+        }
+        ta->typed = key;
     }
 
-    lf_free(lenses);
-    lf_free(cameras);
+    return ta->matched[row];
 }
 //--------------------------------------------------------------------
-
-//####################################################################
-// dialog callback functions
-static void
-maker_cb_changed( GtkComboBox *combo,
-                  gpointer     data )
+// Combo box with an entry for camera or lens. Column 0 holds the name,
+// column 1 the row index for the type-ahead filter.
+static GtkWidget *combo_entry_new(TypeAhead *ta)
 {
-    if (!bComboBoxLock) {
-        bComboBoxLock = true;
-        dialog_set_cboxes(gtk_combo_box_get_active_text(GTK_COMBO_BOX(maker_combo)),
-                          "",
-                          "");
-        bComboBoxLock = false;
-    }
+    GtkListStore       *store      = gtk_list_store_new (2, G_TYPE_STRING, G_TYPE_INT);
+    GtkWidget          *combo      = gtk_combo_box_entry_new_with_model (GTK_TREE_MODEL (store), 0);
+    GtkEntryCompletion *completion = gtk_entry_completion_new ();
+
+    gtk_entry_completion_set_model (completion, GTK_TREE_MODEL (store));
+    gtk_entry_completion_set_text_column (completion, 0);
+    gtk_entry_completion_set_match_func (completion, typeahead_match, ta, NULL);
+    gtk_entry_set_completion (GTK_ENTRY (gtk_bin_get_child (GTK_BIN (combo))), completion);
+
+    g_object_unref (completion);
+    g_object_unref (store);
+    return combo;
 }
 //--------------------------------------------------------------------
-static void
-camera_cb_changed( GtkComboBox *combo,
-                   gpointer     data )
+// Replace the rows of a camera or lens combo box, the entry is cleared
+template <typename E>
+static void combo_entry_fill(GtkWidget *combo, TypeAhead *ta, const vector<E> &items)
 {
-    if (!bComboBoxLock) {
-        bComboBoxLock = true;
-        dialog_set_cboxes(string(gtk_combo_box_get_active_text(GTK_COMBO_BOX(maker_combo))),
-                          string(gtk_combo_box_get_active_text(GTK_COMBO_BOX(camera_combo))),
-                          "");
-        bComboBoxLock = false;
+    GtkListStore *store = GTK_LIST_STORE (gtk_combo_box_get_model (GTK_COMBO_BOX (combo)));
+    GtkTreeIter   iter;
+
+    gtk_list_store_clear (store);
+    ta->keys.clear();
+    ta->matched.clear();
+    ta->typed.clear();
+
+    for (unsigned int i = 0; i < items.size(); i++) {
+        gtk_list_store_append (store, &iter);
+        gtk_list_store_set (store, &iter, 0, items[i].Name.c_str(), 1, (gint) i, -1);
+        ta->keys.push_back(&items[i].Key);
     }
+
+    gtk_entry_set_text (GTK_ENTRY (gtk_bin_get_child (GTK_BIN (combo))), "");
 }
 //--------------------------------------------------------------------
-static void
-lens_cb_changed( GtkComboBox *combo,
-                 gpointer     data )
+// Text of a combo box, the selected row or what has been typed
+static string combo_get_text(GtkWidget *combo)
 {
-    if (!bComboBoxLock) {
-        bComboBoxLock = true;
-        dialog_set_cboxes(string(gtk_combo_box_get_active_text(GTK_COMBO_BOX(maker_combo))),
-                          string(gtk_combo_box_get_active_text(GTK_COMBO_BOX(camera_combo))),
-                          string(gtk_combo_box_get_active_text(GTK_COMBO_BOX(lens_combo))));
-        bComboBoxLock = false;
-    }
+    gchar *text = gtk_combo_box_get_active_text (GTK_COMBO_BOX (combo));
+    string str  = text ? string(text) : string();
+    g_free (text);
+    return str;
 }
 //--------------------------------------------------------------------
-static void
-focal_changed( GtkComboBox *combo,
-               gpointer     data )
+
+
+//####################################################################
+// set dialog combo boxes to values
+static CatalogueMaker  *sDialogMaker  = NULL;
+static CatalogueCamera *sDialogCamera = NULL;
+//--------------------------------------------------------------------
+// Select a lens of the current camera, the corrections are offered
+// as far as the lens has calibration data for them
+static void dialog_set_lens(const string &sNewLens)
 {
-    sLensfunParameters.Focal = (float) gtk_adjustment_get_value(GTK_ADJUSTMENT(data));
+    const CatalogueLens *lens = NULL;
+
+    sLensfunParameters.Lens.clear();
+
+    if (sDialogCamera) {
+        vector<CatalogueLens> &lenses = catalogue_lenses(ldb, sDialogCamera);
+        lens = catalogue_find(lenses, catalogue_key(sNewLens.c_str()));
+        if (lens) {
+            gtk_combo_box_set_active(GTK_COMBO_BOX(lens_combo), (gint) (lens - &lenses[0]));
+            sLensfunParameters.Lens = lens->Name;
+        }
+    }
+
+    gtk_widget_set_sensitive(CorrTCA, lens && (lens->lens->CalibTCA != NULL));
+    gtk_widget_set_sensitive(CorrVignetting, lens && (lens->lens->CalibVignetting != NULL));
 }
 //--------------------------------------------------------------------
-static void
-aperture_changed( GtkComboBox *combo,
-               gpointer     data )
+// Select a camera of the current maker and list its lenses
+static void dialog_set_camera(const string &sNewCamera, const string &sNewLens)
 {
-    sLensfunParameters.Aperture = (float) gtk_adjustment_get_value(GTK_ADJUSTMENT(data));
+    static const vector<CatalogueLens> cNoLenses;
+
+    sLensfunParameters.Camera.clear();
+    sDialogCamera = sDialogMaker ? catalogue_find(sDialogMaker->cameras, catalogue_key(sNewCamera.c_str()))
+                                 : NULL;
+
+    if (sDialogCamera) {
+        gtk_combo_box_set_active(GTK_COMBO_BOX(camera_combo),
+                                 (gint) (sDialogCamera - &sDialogMaker->cameras[0]));
+        sLensfunParameters.Camera = sDialogCamera->Name;
+        combo_entry_fill(lens_combo, &sLensTypeAhead, catalogue_lenses(ldb, sDialogCamera));
+    } else {
+        combo_entry_fill(lens_combo, &sLensTypeAhead, cNoLenses);
+    }
+
+    dialog_set_lens(sNewLens);
 }
 //--------------------------------------------------------------------
-static void
+static void dialog_set_cboxes( string sNewMake, string sNewCamera, string sNewLens) {
+
+    static const vector<CatalogueCamera> cNoCameras;
+
+    int iCurrMakerID    = -1;
+
+    sLensfunParameters.CamMaker.clear();
+    sLensfunParameters.Camera.clear();
+    sLensfunParameters.Lens.clear();
+
+    if (sNewMake.empty()==true)
+            return;
+
+    // try to match maker with predefined list
+    const string sMakeKey = catalogue_key(sNewMake.c_str());
+    int iNumMakers = 0;
+    for (int i = 0; CameraMakers[i].compare("NULL")!=0; i++)
+    {
+        if (catalogue_key(CameraMakers[i].c_str()) == sMakeKey) {
+            gtk_combo_box_set_active(GTK_COMBO_BOX(maker_combo), i);
+            iCurrMakerID = i;
+        }
+        iNumMakers++;
+    }
+
+    if (iCurrMakerID>=0)
+        sLensfunParameters.CamMaker = CameraMakers[iCurrMakerID];
+    else {
+        gtk_combo_box_append_text( GTK_COMBO_BOX(maker_combo), sNewMake.c_str());
+        gtk_combo_box_set_active(GTK_COMBO_BOX(maker_combo), iNumMakers);
+        iNumMakers++;
+        sLensfunParameters.CamMaker = sNewMake;
+    }
+
+    // list the cameras of the maker
+    sDialogMaker = catalogue_find_maker(ldb, sLensfunParameters.CamMaker);
+    combo_entry_fill(camera_combo, &sCameraTypeAhead,
+                     sDialogMaker ? sDialogMaker->cameras : cNoCameras);
+
+    dialog_set_camera(sNewCamera, sNewLens);
+}
+//--------------------------------------------------------------------
+
+//####################################################################
+// dialog callback functions
+
+// stop a running preview render and schedule a new one
+static void
+preview_update( void )
+{
+    if (preview) {
+        preview_cancel();
+        gimp_preview_invalidate(GIMP_PREVIEW(preview));
+    }
+}
+//--------------------------------------------------------------------
+static void
+maker_cb_changed( GtkComboBox *combo,
+                  gpointer     data )
+{
+    if (!bComboBoxLock) {
+        bComboBoxLock = true;
+        dialog_set_cboxes(combo_get_text(maker_combo), "", "");
+        bComboBoxLock = false;
+        preview_update();
+    }
+}
+//--------------------------------------------------------------------
+// Camera and lens entries change with every key typed, the selection
+// only follows once the text names a camera or lens of the list
+static void
+camera_cb_changed( GtkComboBox *combo,
+                   gpointer     data )
+{
+    if (!bComboBoxLock) {
+        const string sCamera = combo_get_text(camera_combo);
+        if (!sDialogMaker || !catalogue_find(sDialogMaker->cameras, catalogue_key(sCamera.c_str())))
+            return;
+
+        bComboBoxLock = true;
+        dialog_set_camera(sCamera, "");
+        bComboBoxLock = false;
+        preview_update();
+    }
+}
+//--------------------------------------------------------------------
+static void
+lens_cb_changed( GtkComboBox *combo,
+                 gpointer     data )
+{
+    if (!bComboBoxLock) {
+        const string sLens = combo_get_text(lens_combo);
+        if (!sDialogCamera || !catalogue_find(catalogue_lenses(ldb, sDialogCamera), catalogue_key(sLens.c_str())))
+            return;
+
+        bComboBoxLock = true;
+        dialog_set_lens(sLens);
+        bComboBoxLock = false;
+        preview_update();
+    }
+}
+//--------------------------------------------------------------------
+static void
+focal_changed( GtkComboBox *combo,
+               gpointer     data )
+{
+    sLensfunParameters.Focal = (float) gtk_adjustment_get_value(GTK_ADJUSTMENT(data));
+    preview_update();
+}
+//--------------------------------------------------------------------
+static void
+aperture_changed( GtkComboBox *combo,
+               gpointer     data )
+{
+    sLensfunParameters.Aperture = (float) gtk_adjustment_get_value(GTK_ADJUSTMENT(data));
+    preview_update();
+}
+//--------------------------------------------------------------------
+static void
+maperror_changed( GtkAdjustment *adj,
+                  gpointer       data )
+{
+    sLensfunParameters.MaxMapError = (float) gtk_adjustment_get_value(GTK_ADJUSTMENT(data));
+    preview_update();
+}
+//--------------------------------------------------------------------
+static void
+interpolation_changed( GtkComboBox *combo,
+                       gpointer     data )
+{
+    const gint iActive = gtk_combo_box_get_active(combo);
+    if (iActive >= 0) {
+        sLensfunParameters.Interpolation = cInterpolationMenu[iActive];
+        preview_update();
+    }
+}
+//--------------------------------------------------------------------
+static void
 scalecheck_changed( GtkCheckButton *togglebutn,
                     gpointer     data )
 {
     sLensfunParameters.Scale = !gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(togglebutn));
+    preview_update();
+}
+//--------------------------------------------------------------------
+static void
+autocrop_changed( GtkCheckButton *togglebutn,
+                  gpointer     data )
+{
+    sLensfunParameters.AutoCrop = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(togglebutn));
 }
 //--------------------------------------------------------------------
 static void
@@ -531,6 +1044,8 @@ modify_changed( GtkCheckButton *togglebutn,
     if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(CorrVignetting))
         && GTK_WIDGET_SENSITIVE(CorrVignetting))
         sLensfunParameters.ModifyFlags |= LF_MODIFY_VIGNETTING;
+
+    preview_update();
 }//--------------------------------------------------------------------
 
 
@@ -544,6 +1059,10 @@ static gboolean create_dialog_window (GimpDrawable *drawable)
     GtkWidget *camera_label, *lens_label, *maker_label;
     GtkWidget *focal_label, *aperture_label;
     GtkWidget *scalecheck;
+    GtkWidget *autocropcheck;
+    GtkWidget *interpolation_label, *interpolation_combo;
+    GtkWidget *maperror_label, *spinbutton_maperror;
+    GtkObject *spinbutton_maperror_adj;
 
     GtkWidget *spinbutton;
     GtkObject *spinbutton_adj;
@@ -568,6 +1087,11 @@ static gboolean create_dialog_window (GimpDrawable *drawable)
     gtk_container_add (GTK_CONTAINER (GTK_DIALOG (dialog)->vbox), main_vbox);
     gtk_widget_show (main_vbox);
 
+    // preview of the visible part of the drawable
+    preview = gimp_drawable_preview_new (drawable, NULL);
+    gtk_box_pack_start (GTK_BOX (main_vbox), preview, TRUE, TRUE, 0);
+    gtk_widget_show (preview);
+
     frame = gtk_frame_new (NULL);
     gtk_widget_show (frame);
     gtk_box_pack_start (GTK_BOX (main_vbox), frame, TRUE, TRUE, 0);
@@ -608,7 +1132,7 @@ static gboolean create_dialog_window (GimpDrawable *drawable)
     gtk_widget_show (camera_label);
     gtk_table_attach(GTK_TABLE(table), camera_label, 0, 1, iTableRow, iTableRow+1, GTK_FILL, GTK_FILL, 0,0 );
 
-    camera_combo = gtk_combo_box_new_text();
+    camera_combo = combo_entry_new(&sCameraTypeAhead);
     gtk_widget_show (camera_combo);
 
     gtk_table_attach_defaults(GTK_TABLE(table), camera_combo, 1,2, iTableRow, iTableRow+1 );
@@ -621,7 +1145,7 @@ static gboolean create_dialog_window (GimpDrawable *drawable)
     gtk_widget_show (lens_label);
     gtk_table_attach_defaults(GTK_TABLE(table), lens_label, 0,1,iTableRow, iTableRow+1 );
 
-    lens_combo = gtk_combo_box_new_text();
+    lens_combo = combo_entry_new(&sLensTypeAhead);
     gtk_widget_show (lens_combo);
 
     gtk_table_attach_defaults(GTK_TABLE(table), lens_combo, 1,2,iTableRow, iTableRow+1 );
@@ -668,7 +1192,7 @@ static gboolean create_dialog_window (GimpDrawable *drawable)
     gtk_frame_set_label_widget (GTK_FRAME (frame2), frame_label2);
     gtk_label_set_use_markup (GTK_LABEL (frame_label2), TRUE);
 
-    table2 = gtk_table_new(6, 2, TRUE);
+    table2 = gtk_table_new(8, 2, TRUE);
     gtk_table_set_homogeneous(GTK_TABLE(table2), false);
     gtk_table_set_row_spacings(GTK_TABLE(table2), 2);
     gtk_table_set_col_spacings(GTK_TABLE(table2), 2);
@@ -684,6 +1208,13 @@ static gboolean create_dialog_window (GimpDrawable *drawable)
     gtk_table_attach_defaults(GTK_TABLE(table2), scalecheck, 1,2,iTableRow, iTableRow+1 );
     iTableRow++;
 
+    // crop to the part without empty borders
+    autocropcheck = gtk_check_button_new_with_label("Crop to valid area");
+    gtk_widget_show (autocropcheck);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(autocropcheck), sLensfunParameters.AutoCrop);
+    gtk_table_attach_defaults(GTK_TABLE(table2), autocropcheck, 1,2,iTableRow, iTableRow+1 );
+    iTableRow++;
+
     // enable distortion correction
     CorrDistortion = gtk_check_button_new_with_label("Distortion");
     //gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(check), FALSE);
@@ -710,6 +1241,36 @@ static gboolean create_dialog_window (GimpDrawable *drawable)
     gtk_table_attach_defaults(GTK_TABLE(table2), CorrTCA, 1,2,iTableRow, iTableRow+1 );
     iTableRow++;
 
+    // interpolation method
+    interpolation_label = gtk_label_new ("Interpolation:");
+    gtk_misc_set_alignment(GTK_MISC(interpolation_label),0.0,0.5);
+    gtk_widget_show (interpolation_label);
+    gtk_table_attach(GTK_TABLE(table2), interpolation_label, 0, 1, iTableRow, iTableRow+1, GTK_FILL, GTK_FILL, 0,0 );
+
+    interpolation_combo = gtk_combo_box_new_text();
+    for (unsigned int i = 0; i < G_N_ELEMENTS(cInterpolationMenu); i++)
+    {
+        gtk_combo_box_append_text( GTK_COMBO_BOX( interpolation_combo ), cInterpolationNames[i]);
+        if (cInterpolationMenu[i] == sLensfunParameters.Interpolation)
+            gtk_combo_box_set_active(GTK_COMBO_BOX(interpolation_combo), i);
+    }
+    gtk_widget_show (interpolation_combo);
+    gtk_table_attach_defaults(GTK_TABLE(table2), interpolation_combo, 1,2,iTableRow, iTableRow+1 );
+    iTableRow++;
+
+    // accuracy of the approximated coordinate map
+    maperror_label = gtk_label_new ("Max. map error (px):");
+    gtk_misc_set_alignment(GTK_MISC(maperror_label),0.0,0.5);
+    gtk_widget_show (maperror_label);
+    gtk_table_attach(GTK_TABLE(table2), maperror_label, 0, 1, iTableRow, iTableRow+1, GTK_FILL, GTK_FILL, 0,0 );
+
+    spinbutton_maperror_adj = gtk_adjustment_new (sLensfunParameters.MaxMapError, 0, 1, 0.01, 0, 0);
+    spinbutton_maperror = gtk_spin_button_new (GTK_ADJUSTMENT (spinbutton_maperror_adj), 0.01, 2);
+    gtk_spin_button_set_numeric (GTK_SPIN_BUTTON (spinbutton_maperror), TRUE);
+    gtk_widget_show (spinbutton_maperror);
+    gtk_table_attach_defaults(GTK_TABLE(table2), spinbutton_maperror, 1,2,iTableRow, iTableRow+1 );
+    iTableRow++;
+
     gtk_container_add (GTK_CONTAINER (frame2), table2);
     gtk_widget_show_all(table2);
 
@@ -730,19 +1291,30 @@ static gboolean create_dialog_window (GimpDrawable *drawable)
     g_signal_connect (spinbutton_aperture_adj, "value_changed",
                       G_CALLBACK (aperture_changed), spinbutton_aperture_adj);
 
+    g_signal_connect( G_OBJECT( interpolation_combo ), "changed",
+                      G_CALLBACK( interpolation_changed ), NULL );
+    g_signal_connect (spinbutton_maperror_adj, "value_changed",
+                      G_CALLBACK (maperror_changed), spinbutton_maperror_adj);
     g_signal_connect( G_OBJECT( scalecheck ), "toggled",
                       G_CALLBACK( scalecheck_changed ), NULL );
+    g_signal_connect( G_OBJECT( autocropcheck ), "toggled",
+                      G_CALLBACK( autocrop_changed ), NULL );
     g_signal_connect( G_OBJECT( CorrDistortion ), "toggled",
                       G_CALLBACK( modify_changed ), NULL );
     g_signal_connect( G_OBJECT( CorrTCA ), "toggled",
                       G_CALLBACK( modify_changed ), NULL );
     g_signal_connect( G_OBJECT( CorrVignetting ), "toggled",
                       G_CALLBACK( modify_changed ), NULL );
+    g_signal_connect( G_OBJECT( preview ), "invalidated",
+                      G_CALLBACK( preview_invalidated ), drawable );
 
     // show and run
     gtk_widget_show (dialog);
     run = (gimp_dialog_run (GIMP_DIALOG (dialog)) == GTK_RESPONSE_OK);
 
+    preview_cancel ();
+    preview = NULL;
+
     gtk_widget_destroy (dialog);
     return run;
 }
@@ -750,412 +1322,1459 @@ static gboolean create_dialog_window (GimpDrawable *drawable)
 
 
 //####################################################################
-// Interpolation functions
-inline float Lanczos(float x)
+// Cache of coordinate maps
+//
+// Evaluating the lensfun model for every pixel costs as much as the
+// resampling itself, while in a catalogue the same camera, lens,
+// focal length, aperture and image size come up again and again. The
+// undistorted coordinates are therefore stored on disk as 16 bit
+// fixed point displacements relative to the output pixel, keyed by
+// the correction parameters, the image size and the database files.
+// On a hit the map file is memory mapped and the lensfun math is
+// skipped entirely.
+static gchar *coord_cache_key(const MyLensfunOpts *opts, gint width, gint height)
+{
+    // the fingerprint of the database files invalidates the maps
+    // when the calibration data is updated or edited
+    return g_strdup_printf ("%x|%016llx|%s|%s|%s|%d|%d|%.6g|%.6g|%.6g|%.6g|%.6g|%d|%.6g|%dx%d",
+                            (guint) LF_VERSION, (unsigned long long) sDBFingerprint,
+                            opts->CamMaker.c_str(), opts->Camera.c_str(), opts->Lens.c_str(),
+                            opts->ModifyFlags, opts->Inverse ? 1 : 0,
+                            opts->Scale, opts->Crop, opts->Focal, opts->Aperture, opts->Distance,
+                            (int) opts->TargetGeom, opts->MaxMapError, width, height);
+}
+//--------------------------------------------------------------------
+// Create a uniquely named temporary file next to path, so parallel
+// plug-in processes never write to the same file
+static FILE *open_temp_file(const gchar *path, gchar **tmppath)
 {
-    if ( (x<FLT_MIN) && (x>-FLT_MIN) )
-        return 1.0f;
+    *tmppath = g_strdup_printf ("%s.XXXXXX", path);
 
-    if ( (x >= cLanczosWidth) || (x <= (-1)*cLanczosWidth) )
-        return 0.0f;
+    const gint fd = g_mkstemp (*tmppath);
+    if (fd < 0)
+        return NULL;
 
-    float xpi = x * static_cast<float>(M_PI);
-    return ( cLanczosWidth * sin(xpi) * sin(xpi/cLanczosWidth) ) / ( xpi*xpi );
+    FILE *fp = fdopen (fd, "wb");
+    if (fp == NULL)
+        g_close (fd, NULL);
+    return fp;
 }
 //--------------------------------------------------------------------
-void InitInterpolation(glInterpolationType intType)
+static gchar *coord_cache_dir()
 {
-    switch(intType) {
-        case GL_INTERPOL_NN: break;
-        case GL_INTERPOL_BL: break;
-        case GL_INTERPOL_LZ:
-                for (int i = -cLanczosWidth*cLanczosTableRes; i < cLanczosWidth*cLanczosTableRes; i++) {
-                    LanczosLUT[i + cLanczosWidth*cLanczosTableRes] = Lanczos(static_cast<float>(i)/static_cast<float>(cLanczosTableRes));
-                }
-
-                break;
+    return g_build_filename (g_get_user_cache_dir (), "gimp-lensfun", "maps", NULL);
+}
+//--------------------------------------------------------------------
+// Estimate the largest displacement of the map from the image border
+// and a coarse grid, to choose the fixed point format
+static float coord_cache_max_displacement(const lfModifier *mod, gint width, gint height)
+{
+    const int cSteps = 32;
+    float     coords[2*3];
+    float     maxd = 0.0f;
+
+    for (int i = 0; i <= cSteps; i++) {
+        for (int j = 0; j <= cSteps; j++) {
+            const float x = static_cast<float>(width - 1) * j / cSteps;
+            const float y = static_cast<float>(height - 1) * i / cSteps;
+            mod->ApplySubpixelGeometryDistortion (x, y, 1, 1, coords);
+            for (int k = 0; k < 3; k++) {
+                const float d = MAX(fabs(coords[2*k] - x), fabs(coords[2*k+1] - y));
+                if (d == d && d > maxd)
+                    maxd = d;
+            }
+        }
     }
+    return maxd;
 }
 //--------------------------------------------------------------------
-inline int InterpolateLanczos(guchar *ImgBuffer, gint w, gint h, gint channels, float xpos, float ypos, int chan)
+// Delete the oldest maps until the cache fits into cMapCacheMaxBytes
+static void coord_cache_prune()
 {
-
-    int   xl   = int(xpos);
-    int   yl   = int(ypos);
-    float y    = 0.0f;
-    float norm = 0.0f;
-    float L    = 0.0f;
-
-    // border checking
-    if ((xl-cLanczosWidth+1 < 0) ||
-        (xl+cLanczosWidth >= w)  ||
-        (yl-cLanczosWidth+1 < 0) ||
-        (yl+cLanczosWidth >= h))
-    {
-        return 0;
-    }
-
-    // convolve with lanczos kernel
-    for (int i = xl-cLanczosWidth+1; i < xl+cLanczosWidth; i++) {
-        for (int j = yl-cLanczosWidth+1; j < yl+cLanczosWidth; j++) {
-            L = LanczosLUT[ (xpos - static_cast<float>(i))*static_cast<float>(cLanczosTableRes) + static_cast<float>(cLanczosWidth*cLanczosTableRes) ]
-                   * LanczosLUT[ (ypos - static_cast<float>(j))*static_cast<float>(cLanczosTableRes) + static_cast<float>(cLanczosWidth*cLanczosTableRes) ];
-            // L = Lanczos(xpos - static_cast<float>(i))
-            //                   * Lanczos(ypos - static_cast<float>(j));
-            y += static_cast<float>(ImgBuffer[ (channels*w*j) + (i*channels) + chan ]) * L;
-            norm += L;
+    typedef std::pair<gint64, string> CacheEntry;
+    vector<CacheEntry> vEntries;
+    vector<gint64>     vSizes;
+    gchar       *dirname = coord_cache_dir();
+    const gchar *name;
+    gint64       total = 0;
+
+    GDir *dir = g_dir_open (dirname, 0, NULL);
+    if (dir == NULL) {
+        g_free (dirname);
+        return;
+    }
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        if (!g_str_has_suffix (name, ".map"))
+            continue;
+        gchar   *filename = g_build_filename (dirname, name, NULL);
+        GStatBuf st;
+        if (g_stat (filename, &st) == 0) {
+            vEntries.push_back(CacheEntry(st.st_mtime, string(filename)));
+            total += st.st_size;
+        }
+        g_free (filename);
+    }
+    g_dir_close (dir);
+    g_free (dirname);
+
+    sort(vEntries.begin(), vEntries.end());
+    for (unsigned int i = 0; (i < vEntries.size()) && (total > cMapCacheMaxBytes); i++) {
+        GStatBuf st;
+        if (g_stat (vEntries[i].second.c_str(), &st) == 0) {
+            total -= st.st_size;
+            g_unlink (vEntries[i].second.c_str());
         }
     }
-    // normalize
-    y = y / norm;
-
-    // clip
-    if (y>255)
-        y = 255;
-    if (y<0)
-        y = 0;
-
-    // round to integer and return
-    return roundfloat2int(y);
 }
 //--------------------------------------------------------------------
-inline int InterpolateLinear(guchar *ImgBuffer, gint w, gint h, gint channels, float xpos, float ypos, int chan)
+// Open the map for the current parameters. Returns true if the map can
+// be read from the cache, otherwise prepares writing it.
+static bool coord_cache_open(CoordMapCache *cache, const MyLensfunOpts *opts,
+                             const lfModifier *mod, gint width, gint height)
 {
-    // interpolated values in x and y  direction
-    float   x1, x2, y;
+    gchar *key     = coord_cache_key(opts, width, height);
+    gchar *hash    = g_compute_checksum_for_string (G_CHECKSUM_SHA1, key, -1);
+    gchar *dirname = coord_cache_dir();
+    gchar *name    = g_strdup_printf ("%s.map", hash);
+    const guint32 iKeySize = strlen(key);
+    CoordMapHeader header;
+
+    memset(cache, 0, sizeof(CoordMapCache));
+    cache->path   = g_build_filename (dirname, name, NULL);
+    cache->offset = (sizeof(header) + iKeySize + 7) & ~7;
+    cache->width  = width;
+    cache->height = height;
+    g_free (name);
+    g_free (hash);
+
+    // try to read the map
+    cache->map = g_mapped_file_new (cache->path, FALSE, NULL);
+    if (cache->map) {
+        const gchar *contents = g_mapped_file_get_contents (cache->map);
+        const gsize  length   = g_mapped_file_get_length (cache->map);
+
+        if (length >= sizeof(header))
+            memcpy(&header, contents, sizeof(header));
+        if ((length >= sizeof(header)) &&
+            (memcmp(header.Magic, cMapCacheMagic, sizeof(header.Magic)) == 0) &&
+            (header.Version == cMapCacheVersion) &&
+            (header.LensfunVersion == LF_VERSION) &&
+            (header.Width == (guint32) width) && (header.Height == (guint32) height) &&
+            (header.KeySize == iKeySize) &&
+            ((gint) header.FracBits >= cMapMinFracBits) && ((gint) header.FracBits <= cMapMaxFracBits) &&
+            (length == cache->offset + sizeof(gint16) * 2 * header.Pairs * width * height) &&
+            (memcmp(contents + sizeof(header), key, iKeySize) == 0))
+        {
+            cache->data     = (const gint16 *) (contents + cache->offset);
+            cache->pairs    = header.Pairs;
+            cache->fracbits = header.FracBits;
+            if (DEBUG) g_print ("Coordinate map cache hit: %s\n", cache->path);
+            g_free (dirname);
+            g_free (key);
+            return true;
+        }
+        g_mapped_file_unref (cache->map);
+        cache->map = NULL;
+    }
 
-    // surrounding integer rounded coordinates
-    int     xl, xr, yu, yl;
+    // choose the fixed point format and start writing the map
+    const float maxd = coord_cache_max_displacement(mod, width, height);
+    cache->pairs    = (opts->ModifyFlags & LF_MODIFY_TCA) ? 3 : 1;
+    cache->fracbits = cMapMaxFracBits;
+    while ((cache->fracbits > cMapMinFracBits) && (maxd * 1.25f + 1.0f) * (1 << cache->fracbits) > 32767.0f)
+        cache->fracbits--;
+
+    if ((maxd * 1.25f + 1.0f) * (1 << cache->fracbits) <= 32767.0f) {
+        memcpy(header.Magic, cMapCacheMagic, sizeof(header.Magic));
+        header.Version        = cMapCacheVersion;
+        header.LensfunVersion = LF_VERSION;
+        header.Width          = width;
+        header.Height         = height;
+        header.Pairs          = cache->pairs;
+        header.FracBits       = cache->fracbits;
+        header.KeySize        = iKeySize;
+        header.Reserved       = 0;
+
+        g_mkdir_with_parents (dirname, 0755);
+        cache->fp = open_temp_file (cache->path, &cache->tmppath);
+        if (cache->fp &&
+            ((fwrite (&header, sizeof(header), 1, cache->fp) != 1) ||
+             (fwrite (key, 1, iKeySize, cache->fp) != iKeySize)))
+        {
+            cache->overflow = true;
+        }
+    }
+    if (DEBUG) g_print ("Coordinate map cache miss, %s\n", cache->fp ? "writing map" : "map not cacheable");
 
-    xl = floor(xpos);
-    xr = ceil (xpos + 1e-10);
-    yu = floor(ypos);
-    yl = ceil (ypos + 1e-10);
+    g_free (dirname);
+    g_free (key);
+    return false;
+}
+//--------------------------------------------------------------------
+// Decode the undistorted coordinates of a tile from the mapped file
+static void coord_cache_get_tile(const CoordMapCache *cache, gint tx, gint ty,
+                                 gint tw, gint th, float *UndistCoord)
+{
+    const float fScale = 1.0f / static_cast<float>(1 << cache->fracbits);
+    const int   pairs  = cache->pairs;
 
-    // border checking
-    if ((xl < 0)  ||
-        (xr >= w) ||
-        (yu < 0)  ||
-        (yl >= h))
+    #pragma omp parallel for
+    for (int i = 0; i < th; i++)
     {
-        return 0;
+        const gint16 *src = &cache->data[2 * pairs * ((gsize) (ty + i) * cache->width + tx)];
+        float        *dst = &UndistCoord[i*tw*2*3];
+        const float   y   = static_cast<float>(ty + i);
+
+        for (int j = 0; j < tw; j++) {
+            const float x = static_cast<float>(tx + j);
+            for (int k = 0; k < 3; k++) {
+                const gint16 *d = &src[2 * (pairs == 3 ? k : 0)];
+                if (d[0] == cMapInvalid) {
+                    dst[2*k]   = -1.0e6f;
+                    dst[2*k+1] = -1.0e6f;
+                } else {
+                    dst[2*k]   = x + static_cast<float>(d[0]) * fScale;
+                    dst[2*k+1] = y + static_cast<float>(d[1]) * fScale;
+                }
+            }
+            src += 2 * pairs;
+            dst += 2 * 3;
+        }
     }
+}
+//--------------------------------------------------------------------
+// Encode the coordinates of a freshly computed tile into the map file
+static void coord_cache_put_tile(CoordMapCache *cache, gint tx, gint ty,
+                                 gint tw, gint th, const float *UndistCoord)
+{
+    if ((cache->fp == NULL) || cache->overflow)
+        return;
 
+    const float fScale = static_cast<float>(1 << cache->fracbits);
+    const int   pairs  = cache->pairs;
+    gint16     *row    = g_new (gint16, 2 * pairs * tw);
 
-    float px1y1 = (float) ImgBuffer[ (channels*w*yu) + (xl*channels) + chan ];
-    float px1y2 = (float) ImgBuffer[ (channels*w*yl) + (xl*channels) + chan ];
-    float px2y1 = (float) ImgBuffer[ (channels*w*yu) + (xr*channels) + chan ];
-    float px2y2 = (float) ImgBuffer[ (channels*w*yl) + (xr*channels) + chan ];
-
-    x1 = (static_cast<float>(xr) - xpos)*px1y1 + (xpos - static_cast<float>(xl))*px2y1;
-    x2 = (static_cast<float>(xr) - xpos)*px1y2 + (xpos - static_cast<float>(xl))*px2y2;
+    for (int i = 0; (i < th) && !cache->overflow; i++)
+    {
+        const float *src = &UndistCoord[i*tw*2*3];
+        const float  y   = static_cast<float>(ty + i);
+
+        for (int j = 0; j < tw; j++) {
+            const float x = static_cast<float>(tx + j);
+            for (int k = 0; k < pairs; k++) {
+                const float dx = (src[2*k]   - x) * fScale;
+                const float dy = (src[2*k+1] - y) * fScale;
+                gint16 *d = &row[2 * (j*pairs + k)];
+                if (!(dx == dx) || !(dy == dy)) {
+                    // NaN, lensfun could not map this pixel
+                    d[0] = d[1] = cMapInvalid;
+                } else if ((fabs(dx) > 32767.0f) || (fabs(dy) > 32767.0f)) {
+                    cache->overflow = true;
+                } else {
+                    d[0] = roundfloat2int(dx);
+                    d[1] = roundfloat2int(dy);
+                }
+            }
+            src += 2 * 3;
+        }
 
-    y  = (ypos - static_cast<float>(yu))*x2    + (static_cast<float>(yl) - ypos)*x1;
+        const gint64 offset = cache->offset + (gint64) sizeof(gint16) * 2 * pairs * ((gint64) (ty + i) * cache->width + tx);
+        if ((fseek64 (cache->fp, offset, SEEK_SET) != 0) ||
+            (fwrite (row, sizeof(gint16) * 2 * pairs, tw, cache->fp) != (gsize) tw))
+        {
+            cache->overflow = true;
+        }
+    }
 
-    return roundfloat2int(y);
+    g_free (row);
 }
 //--------------------------------------------------------------------
-inline int InterpolateNearest(guchar *ImgBuffer, gint w, gint h, gint channels, float xpos, float ypos, int chan)
+// Finish reading or writing. A written map is only moved into the
+// cache if every tile has been stored.
+static void coord_cache_close(CoordMapCache *cache, bool bComplete)
 {
-    int x = roundfloat2int(xpos);
-    int y = roundfloat2int(ypos);
-
-
-    // border checking
-    if ((x < 0)  ||
-        (x >= w) ||
-        (y < 0)  ||
-        (y >= h))
-    {
-        return 0;
+    if (cache->map)
+        g_mapped_file_unref (cache->map);
+
+    if (cache->fp) {
+        bool bOK = (fclose (cache->fp) == 0) && bComplete && !cache->overflow;
+        if (bOK) {
+            g_unlink (cache->path);
+            bOK = (g_rename (cache->tmppath, cache->path) == 0);
+        }
+        if (!bOK)
+            g_unlink (cache->tmppath);
+        else
+            coord_cache_prune();
+        if (DEBUG) g_print ("Coordinate map %s\n", bOK ? "stored" : "discarded");
     }
 
-    return ImgBuffer[ (channels*w*y) + (x*channels) + chan ];
+    g_free (cache->tmppath);
+    g_free (cache->path);
+    memset(cache, 0, sizeof(CoordMapCache));
 }
 //--------------------------------------------------------------------
 
 
 //####################################################################
-// Processing
-static void process_image (GimpDrawable *drawable) {
-    gint         channels;
-    gint         x1, y1, x2, y2, imgwidth, imgheight;
-
-    GimpPixelRgn rgn_in, rgn_out;
-    guchar *ImgBuffer;
-    guchar *ImgBufferOut;
+// Pixel access to the drawable
+//
+// GIMP 2.10 hands out GeglBuffers in the native precision of the
+// image, older versions only provide 8 bit pixel regions. The preview
+// opens the drawable read only and always works on 8 bit data.
+//
+// Tiles travel over the same pipe to the GIMP core as PDB calls, and
+// libgimp does not lock it. Worker threads therefore access pixels,
+// and the coordinator reports progress, in the critical section
+// gimp_wire only.
+//
+// The output is written straight into the tiles of the shadow, see
+// write_tile().
+#if GIMP_CHECK_VERSION(2,10,0)
+// GEGL 0.4.14 made the buffer iterator handle a variable number of
+// buffers, which changed the constructor and the fields
+#if (GEGL_MINOR_VERSION > 4) || ((GEGL_MINOR_VERSION == 4) && (GEGL_MICRO_VERSION >= 14))
+#define GL_ITERATOR_DATA(iter)  ((iter)->items[0].data)
+#define GL_ITERATOR_ROI(iter)   ((iter)->items[0].roi)
+static GeglBufferIterator *gl_buffer_iterator_new(GeglBuffer *buffer, const GeglRectangle *rect,
+                                                  const Babl *format, GeglAccessMode access)
+{
+    return gegl_buffer_iterator_new (buffer, rect, 0, format, access, GEGL_ABYSS_NONE, 1);
+}
+#else
+#define GL_ITERATOR_DATA(iter)  ((iter)->data[0])
+#define GL_ITERATOR_ROI(iter)   ((iter)->roi[0])
+static GeglBufferIterator *gl_buffer_iterator_new(GeglBuffer *buffer, const GeglRectangle *rect,
+                                                  const Babl *format, GeglAccessMode access)
+{
+    return gegl_buffer_iterator_new (buffer, rect, 0, format, access, GEGL_ABYSS_NONE);
+}
+#endif
+#endif
+static void drawable_io_init(DrawableIO *io, GimpDrawable *drawable,
+                             gint x, gint y, gint width, gint height,
+                             bool bPreview = false)
+{
+    io->drawable = drawable;
+
+#if GIMP_CHECK_VERSION(2,10,0)
+    const gint32  drawableID = drawable->drawable_id;
+    bool          bLinear    = false;
+    string        sFormat;
+
+    switch (gimp_image_get_precision (gimp_item_get_image (drawableID))) {
+        case GIMP_PRECISION_U8_LINEAR:
+            bLinear = true;
+            // fall through
+        case GIMP_PRECISION_U8_GAMMA:
+            io->type = GL_PIXEL_U8;
+            break;
+        case GIMP_PRECISION_U16_LINEAR:
+            bLinear = true;
+            // fall through
+        case GIMP_PRECISION_U16_GAMMA:
+            io->type = GL_PIXEL_U16;
+            break;
+        case GIMP_PRECISION_U32_LINEAR:
+        case GIMP_PRECISION_HALF_LINEAR:
+        case GIMP_PRECISION_FLOAT_LINEAR:
+        case GIMP_PRECISION_DOUBLE_LINEAR:
+            bLinear = true;
+            // fall through
+        default:
+            io->type = GL_PIXEL_F32;
+            break;
+    }
 
-    if ((sLensfunParameters.CamMaker.length()==0) ||
-        (sLensfunParameters.Camera.length()==0) ||
-        (sLensfunParameters.Lens.length()==0)) {
-            return;
+    // the preview area draws gamma encoded 8 bit pixels
+    if (bPreview) {
+        io->type = GL_PIXEL_U8;
+        bLinear  = false;
     }
 
-    #ifdef POSIX
-    struct timespec profiling_start, profiling_stop;
-    #endif
+    if (gimp_drawable_is_gray (drawableID))
+        sFormat = bLinear ? "Y" : "Y'";
+    else
+        sFormat = bLinear ? "RGB" : "R'G'B'";
+    if (gimp_drawable_has_alpha (drawableID))
+        sFormat += "A";
+    switch (io->type) {
+        case GL_PIXEL_U8:  sFormat += " u8"; break;
+        case GL_PIXEL_U16: sFormat += " u16"; break;
+        case GL_PIXEL_F32: sFormat += " float"; break;
+    }
 
-    // get image size
-    gimp_drawable_mask_bounds (drawable->drawable_id,
-                               &x1, &y1,
-                               &x2, &y2);
-    imgwidth = x2-x1;
-    imgheight = y2-y1;
+    io->format     = babl_format (sFormat.c_str());
+    io->channels   = babl_format_get_n_components (io->format);
+    io->buffer_in  = gimp_drawable_get_buffer (drawableID);
+    io->buffer_out = bPreview ? NULL : gimp_drawable_get_shadow_buffer (drawableID);
 
-    // get number of channels
-    channels = gimp_drawable_bpp (drawable->drawable_id);
+    if (DEBUG) g_print ("Pixel format: %s\n", sFormat.c_str());
+#else
+    io->type     = GL_PIXEL_U8;
+    io->channels = gimp_drawable_bpp (drawable->drawable_id);
 
-    gimp_pixel_rgn_init (&rgn_in,
+    gimp_pixel_rgn_init (&io->rgn_in,
                          drawable,
-                         x1, y1,
-                         imgwidth, imgheight,
+                         x, y,
+                         width, height,
                          FALSE, FALSE);
-    gimp_pixel_rgn_init (&rgn_out,
-                         drawable,
-                         x1, y1,
-                         imgwidth, imgheight,
-                         TRUE, TRUE);
 
-    //Init input and output buffer
-    ImgBuffer = g_new (guchar, channels * (imgwidth+1) * (imgheight+1));
-    ImgBufferOut = g_new (guchar, channels * (imgwidth+1) * (imgheight+1));
-    InitInterpolation(GL_INTERPOL_LZ);
+    // the tile cache only has to hold the source window of the current
+    // tile of every thread, and the one shadow tile it is writing
+    gint iThreads = 1;
+#ifdef _OPENMP
+    iThreads = omp_get_max_threads ();
+#endif
+    gimp_tile_cache_ntiles (iThreads * ((cStreamTileSize / gimp_tile_width () + 2)
+                                        * (cStreamTileSize / gimp_tile_height () + 2) + 1));
+#endif
+}
+//--------------------------------------------------------------------
+static void drawable_io_get(DrawableIO *io, void *buf, gint x, gint y, gint width, gint height)
+{
+#if GIMP_CHECK_VERSION(2,10,0)
+    // GEGL_RECTANGLE() is a C compound literal, not usable in C++
+    const GeglRectangle rect = { x, y, width, height };
+    #pragma omp critical(gimp_wire)
+    gegl_buffer_get (io->buffer_in, &rect, 1.0,
+                     io->format, buf, GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+#else
+    #pragma omp critical(gimp_wire)
+    gimp_pixel_rgn_get_rect (&io->rgn_in, (guchar *) buf, x, y, width, height);
+#endif
+}
+
+//--------------------------------------------------------------------
+static void drawable_io_close(DrawableIO *io)
+{
+#if GIMP_CHECK_VERSION(2,10,0)
+    if (io->buffer_out)
+        g_object_unref (io->buffer_out);
+    g_object_unref (io->buffer_in);
+#endif
+}
+//--------------------------------------------------------------------
+static void drawable_io_finish(DrawableIO *io, gint x, gint y, gint width, gint height)
+{
+    drawable_io_close (io);
+#if !GIMP_CHECK_VERSION(2,10,0)
+    gimp_drawable_flush (io->drawable);
+#endif
+    gimp_drawable_merge_shadow (io->drawable->drawable_id, TRUE);
+    gimp_drawable_update (io->drawable->drawable_id,
+                          x, y,
+                          width, height);
+}
+//--------------------------------------------------------------------
 
-    // Copy pixel data from GIMP to internal buffer
-    gimp_pixel_rgn_get_rect (&rgn_in, ImgBuffer, x1, y1, imgwidth, imgheight);
 
-    if (sLensfunParameters.Scale<1) {
-        sLensfunParameters.ModifyFlags |= LF_MODIFY_SCALE;
+//####################################################################
+// Processing
+//
+// The output is produced tile by tile with the stages of pipeline.hpp,
+// only the source window of each tile is fetched from the drawable,
+// and the output is resampled straight into the shadow tiles.
+//
+// The pipeline for a single tile is shared with the preview, which
+// runs it on bands of the visible area.
+//
+// All functions are instantiated for every sample type, so the inner
+// loops are specialized at compile time for u8, u16 and float data.
+template <typename T>
+static void tile_buffers_init(TileBuffers<T> *bufs, gint channels, gint iMaxPixels,
+                              bool bOutput = true)
+{
+    bufs->UndistCoord  = g_new (float, iMaxPixels * 2 * 3);
+    bufs->ImgBufferOut = bOutput ? g_new (T, channels * iMaxPixels) : NULL;
+    bufs->ImgBuffer    = NULL;
+    bufs->iBufferSize  = 0;
+    bufs->iMaxWindow   = 0;
+}
+//--------------------------------------------------------------------
+template <typename T>
+static void tile_buffers_free(TileBuffers<T> *bufs)
+{
+    g_free(bufs->ImgBufferOut);
+    g_free(bufs->ImgBuffer);
+    g_free(bufs->UndistCoord);
+    bufs->UndistCoord  = NULL;
+    bufs->ImgBufferOut = NULL;
+    bufs->ImgBuffer    = NULL;
+}
+//--------------------------------------------------------------------
+// Fetch the source window of one output tile of the selection at
+// (x1, y1) into bufs->ImgBuffer and correct its vignetting.
+// bufs->UndistCoord has to hold the undistorted coordinates of the
+// tile. Returns false if the tile maps completely outside of the
+// source image.
+template <typename T>
+static bool fetch_source(DrawableIO *io, lfModifier *mod, TileBuffers<T> *bufs,
+                         glInterpolationType interpolation,
+                         gint x1, gint y1, gint imgwidth, gint imgheight,
+                         gint tw, gint th, ImgRect *win)
+{
+    const gint channels = io->channels;
+
+    if (!GetSourceWindow(bufs->UndistCoord, tw*th, InterpolationRadius(interpolation),
+                         imgwidth, imgheight, win))
+        return false;
+
+    // fetch only the source window from GIMP
+    const gsize iWindowSize = channels * win->width * win->height;
+    if (iWindowSize > bufs->iBufferSize) {
+        g_free(bufs->ImgBuffer);
+        bufs->ImgBuffer = (T *) g_malloc (sizeof(T) * iWindowSize + cInterpolationPadding);
+        bufs->iBufferSize = iWindowSize;
     }
+    if (iWindowSize > bufs->iMaxWindow)
+        bufs->iMaxWindow = iWindowSize;
 
-    const lfCamera **cameras = ldb->FindCamerasExt (sLensfunParameters.CamMaker.c_str(), sLensfunParameters.Camera.c_str());
-    sLensfunParameters.Crop = cameras[0]->CropFactor;
+    drawable_io_get (io, bufs->ImgBuffer, x1 + win->x, y1 + win->y, win->width, win->height);
+
+    // vignetting is applied to the fetched copy of the window
+    ModifyColors<T>(mod, bufs->ImgBuffer, win, channels);
+    PremultiplyAlpha<T>(bufs->ImgBuffer, win, channels);
+    return true;
+}
+//--------------------------------------------------------------------
+// Resample one output tile of the selection at (x1, y1) into
+// bufs->ImgBufferOut, for the preview
+template <typename T>
+static void resample_tile(DrawableIO *io, lfModifier *mod, const GainMap *gain,
+                          TileBuffers<T> *bufs, glInterpolationType interpolation,
+                          gint x1, gint y1, gint imgwidth, gint imgheight,
+                          gint tw, gint th)
+{
+    const gint channels = io->channels;
+    ImgRect    win;
 
-    const lfLens **lenses = ldb->FindLenses (cameras[0], NULL, sLensfunParameters.Lens.c_str());
+    if (!fetch_source<T>(io, mod, bufs, interpolation, x1, y1, imgwidth, imgheight, tw, th, &win))
+    {
+        // tile maps completely outside of the source image
+        memset(bufs->ImgBufferOut, 0, sizeof(T) * channels * tw * th);
+        return;
+    }
 
-    if (DEBUG) {
-        g_print("\nApplied settings:\n");
-        g_print("\tCamera: %s, %s\n", cameras[0]->Maker, cameras[0]->Model);
-        g_print("\tLens: %s\n", lenses[0]->Model);
-        g_print("\tFocal Length: %f\n", sLensfunParameters.Focal);
-        g_print("\tF-Stop: %f\n", sLensfunParameters.Aperture);
-        g_print("\tCrop Factor: %f\n", sLensfunParameters.Crop);
-        g_print("\tScale: %f\n", sLensfunParameters.Scale);
-
-        #ifdef POSIX
-        clock_gettime(CLOCK_REALTIME, &profiling_start);
-        #endif
+    ResampleTile<T>(GetResampler<T>(interpolation, channels), bufs->ImgBuffer, &win, channels,
+                    bufs->UndistCoord, tw, th, gain, bufs->ImgBufferOut);
+}
+//--------------------------------------------------------------------
+// Resample the part of an output tile that one tile of the drawable
+// covers into its memory at out, rows iStride samples apart. Without
+// a source the part is cleared.
+template <typename T>
+static void resample_part(typename Resampler<T>::Func resample, const T *src,
+                          const ImgRect *win, gint channels,
+                          const float *UndistCoord, gint tw, const GainMap *gain,
+                          const ImgRect *part, T *out, gsize iStride)
+{
+    if (src) {
+        ResampleRect<T>(resample, src, win, channels, UndistCoord, tw, part, gain, out, iStride);
+    } else {
+        for (int i = 0; i < part->height; i++)
+            memset(&out[i * iStride], 0, sizeof(T) * channels * part->width);
     }
+}
+//--------------------------------------------------------------------
+// Resample the output tile at (x, y) of the drawable straight into the
+// tiles of its shadow. GIMP hands them out one after the other, each
+// gets the part of the output tile it covers. There is no output
+// buffer, and a shadow tile is released as soon as it is complete.
+// src is the source window win of the tile, NULL if it maps outside
+// of the source image.
+template <typename T>
+static void write_tile(DrawableIO *io, typename Resampler<T>::Func resample,
+                       const T *src, const ImgRect *win, const float *UndistCoord,
+                       const GainMap *gain, gint x, gint y, gint tw, gint th)
+{
+    const gint channels = io->channels;
 
-    //init lensfun modifier
-    lfModifier *mod = new lfModifier (lenses[0], sLensfunParameters.Crop, imgwidth, imgheight);
-    mod->Initialize (  lenses[0], LF_PF_U8, sLensfunParameters.Focal,
-                         sLensfunParameters.Aperture, sLensfunParameters.Distance, sLensfunParameters.Scale, sLensfunParameters.TargetGeom,
-                         sLensfunParameters.ModifyFlags, sLensfunParameters.Inverse);
+#if GIMP_CHECK_VERSION(2,10,0)
+    const GeglRectangle  rect = { x, y, tw, th };
+    GeglBufferIterator  *iter;
+    gboolean             bMore;
 
-    int iRowCount = 0;
-    #pragma omp parallel
+    #pragma omp critical(gimp_wire)
     {
-        // buffer containing undistorted coordinates for one row
-        float *UndistCoord = g_new (float, imgwidth*2*channels);
-
-        //main loop for processing, iterate through rows
-        #pragma omp for
-        for (int i = 0; i < imgheight; i++)
-        {
-            mod->ApplyColorModification( &ImgBuffer[(channels*imgwidth*i)],
-                                        0, i, imgwidth, 1,
-                                        LF_CR_3(RED, GREEN, BLUE),
-                                        channels*imgwidth);
+        iter  = gl_buffer_iterator_new (io->buffer_out, &rect, io->format, GEGL_ACCESS_WRITE);
+        bMore = gegl_buffer_iterator_next (iter);
+    }
+    while (bMore)
+    {
+        const GeglRectangle *roi  = &GL_ITERATOR_ROI (iter);
+        const ImgRect        part = { roi->x - x, roi->y - y, roi->width, roi->height };
 
-            mod->ApplySubpixelGeometryDistortion (0, i, imgwidth, 1, UndistCoord);
+        resample_part<T>(resample, src, win, channels, UndistCoord, tw, gain, &part,
+                         (T *) GL_ITERATOR_DATA (iter), channels * roi->width);
 
-            float*  UndistIter = UndistCoord;
-            guchar *OutputBuffer = &ImgBufferOut[channels*imgwidth*i];
-            //iterate through subpixels in one row
-            for (int j = 0; j < imgwidth*channels; j += channels)
-            {
-                *OutputBuffer = InterpolateLanczos(ImgBuffer, imgwidth, imgheight, channels, UndistIter [0], UndistIter [1], 0);
-                OutputBuffer++;
-                *OutputBuffer = InterpolateLanczos(ImgBuffer, imgwidth, imgheight, channels, UndistIter [2], UndistIter [3], 1);
-                OutputBuffer++;
-                *OutputBuffer = InterpolateLanczos(ImgBuffer, imgwidth, imgheight, channels, UndistIter [4], UndistIter [5], 2);
-                OutputBuffer++;
-
-                // move pointer to next pixel
-                UndistIter += 2 * 3;
-            }
-            #pragma omp atomic
-            iRowCount++;
-            //update progress bar only every N rows
-            if (iRowCount % 200 == 0) {
-                 #pragma omp critical
-                 {
-                 gimp_progress_update ((gdouble) (iRowCount - y1) / (gdouble) (imgheight));
-                 }
-            }
-        }
-        g_free(UndistCoord);
+        #pragma omp critical(gimp_wire)
+        bMore = gegl_buffer_iterator_next (iter);
     }
+#else
+    GimpPixelRgn rgn;
+    gpointer     pr;
 
-    delete mod;
-
-    #ifdef POSIX
-    if (DEBUG) {
-        clock_gettime(CLOCK_REALTIME, &profiling_stop);
-        unsigned long long int time_diff = timespec2llu(&profiling_stop) - timespec2llu(&profiling_start);
-        g_print("\nPerformance: %12llu ns, %d pixel -> %llu ns/pixel\n", time_diff, imgwidth*imgheight, time_diff / (imgwidth*imgheight));
+    #pragma omp critical(gimp_wire)
+    {
+        gimp_pixel_rgn_init (&rgn, io->drawable, x, y, tw, th, TRUE, TRUE);
+        pr = gimp_pixel_rgns_register (1, &rgn);
     }
-    #endif
+    while (pr != NULL)
+    {
+        const ImgRect part = { (int) rgn.x - x, (int) rgn.y - y, (int) rgn.w, (int) rgn.h };
 
-    //write data back to gimp
-    gimp_pixel_rgn_set_rect (&rgn_out, ImgBufferOut, x1, y1, imgwidth, imgheight);
+        resample_part<T>(resample, src, win, channels, UndistCoord, tw, gain, &part,
+                         (T *) rgn.data, rgn.rowstride / sizeof(T));
 
-    gimp_drawable_flush (drawable);
-    gimp_drawable_merge_shadow (drawable->drawable_id, TRUE);
-    gimp_drawable_update (drawable->drawable_id,
-                          x1, y1,
-                          imgwidth, imgheight);
-    gimp_displays_flush ();
-    gimp_drawable_detach (drawable);
+        #pragma omp critical(gimp_wire)
+        pr = gimp_pixel_rgns_process (pr);
+    }
+#endif
+}
+//--------------------------------------------------------------------
+// microseconds between progress reports while the last tiles finish
+const gulong cProgressInterval = 20000;
+
+// Called by the coordinating thread only. Progress is reported in
+// whole percents, every update is a round trip to the GIMP core. A
+// failed update means GIMP has dropped the progress of the plugin,
+// the job is cancelled then.
+static void report_progress(TileScheduler *sched, gint *iLastPercent)
+{
+    const gint iPercent = (gint) (100.0 * TileProgress(sched));
+    if (iPercent <= *iLastPercent)
+        return;
 
-    // free memory
-    g_free(ImgBufferOut);
-    g_free(ImgBuffer);
+    gboolean bOK;
+    #pragma omp critical(gimp_wire)
+    bOK = gimp_progress_update ((gdouble) iPercent / 100.0);
 
-    lf_free(lenses);
-    lf_free(cameras);
+    *iLastPercent = iPercent;
+    if (!bOK)
+        CancelTiles(sched);
 }
 //--------------------------------------------------------------------
+// Correct all tiles of the selection. The tiles are spread over the
+// threads by a TileScheduler, each thread with its own buffers. The
+// thread that called the function also reports the progress once it
+// runs out of tiles. Tiles that don't touch area are only cleared,
+// every pixel of the shadow is written either way. Returns false if
+// the job has been cancelled.
+template <typename T>
+static bool process_tiles(DrawableIO *io, lfModifier *mod, const RadialMap *radial,
+                          const GainMap *gain, CoordMapCache *cache,
+                          glInterpolationType interpolation, float fMaxMapError,
+                          gint x1, gint y1, gint imgwidth, gint imgheight, const ImgRect *area)
+{
+    TileScheduler sched;
+    InitTileScheduler(&sched, imgwidth, imgheight);
 
+    const typename Resampler<T>::Func resample = GetResampler<T>(interpolation, io->channels);
+    gint  iLastPercent = -1;
+    gsize iMaxWindow   = 0;
 
-//####################################################################
-// Read camera and lens info from exif and try to find in database
-//
-static int read_opts_from_exif(const char *filename) {
+    #pragma omp parallel
+    {
+        TileBuffers<T> bufs;
+        tile_buffers_init(&bufs, io->channels, cStreamTileSize * cStreamTileSize, false);
+        ImgRect tile, win;
+
+        while (NextTile(&sched, &tile))
+        {
+            const int tx = tile.x, ty = tile.y;
+            const int tw = tile.width, th = tile.height;
 
-    Exiv2::Image::AutoPtr Exiv2image;
-    Exiv2::ExifData exifData;
+            if ((tx >= area->x + area->width) || (tx + tw <= area->x) ||
+                (ty >= area->y + area->height) || (ty + th <= area->y))
+            {
+                // cropped away afterwards
+                write_tile<T>(io, resample, NULL, &tile, NULL, gain, x1 + tx, y1 + ty, tw, th);
+            }
+            else
+            {
+                // undistorted coordinates for every pixel of the output tile
+                if (cache->map) {
+                    coord_cache_get_tile(cache, tx, ty, tw, th, bufs.UndistCoord);
+                } else {
+                    MapCoordinates(mod, tx, ty, tw, th, bufs.UndistCoord, fMaxMapError, radial);
+                    #pragma omp critical(coord_cache)
+                    coord_cache_put_tile(cache, tx, ty, tw, th, bufs.UndistCoord);
+                }
 
-    const lfCamera  **cameras    = 0;
-    const lfCamera  *camera      = 0;
+                const bool bInside = fetch_source<T>(io, mod, &bufs, interpolation,
+                                                     x1, y1, imgwidth, imgheight, tw, th, &win);
 
-    const lfLens    **lenses     = 0;
-    const lfLens    *lens        = 0;
-    std::string LensNameMN;
+                // resample into the shadow tiles of gimp
+                write_tile<T>(io, resample, bInside ? bufs.ImgBuffer : NULL, &win, bufs.UndistCoord,
+                              gain, x1 + tx, y1 + ty, tw, th);
+            }
+
+            FinishTile(&sched);
+
+            #pragma omp master
+            report_progress(&sched, &iLastPercent);
+        }
+
+        // the others may still be busy with their last tiles
+        #pragma omp master
+        {
+            while ((TileProgress(&sched) < 1.0) && !sched.cancelled) {
+                g_usleep (cProgressInterval);
+                report_progress(&sched, &iLastPercent);
+            }
+        }
+
+        #pragma omp critical(max_window)
+        iMaxWindow = MAX(iMaxWindow, bufs.iMaxWindow);
+
+        tile_buffers_free(&bufs);
+    }
 
     if (DEBUG) {
-        g_print ("Reading exif data...");
+        g_print("Largest source window: %lu bytes (full frame: %lu bytes)\n",
+                (unsigned long) (sizeof(T) * iMaxWindow),
+                (unsigned long) (sizeof(T) * io->channels * imgwidth * imgheight));
     }
 
-    try {
-        // read exif from file
-        Exiv2image = Exiv2::ImageFactory::open(string(filename));
-        Exiv2image.get();
-        Exiv2image->readMetadata();
-        exifData = Exiv2image->exifData();
+    return !sched.cancelled;
+}
+//--------------------------------------------------------------------
+static void process_context_release(ProcessContext *ctx)
+{
+    if (ctx->mod) {
+        coord_cache_close(&ctx->cache, true);
+        delete ctx->mod;
+        delete ctx->radial;
+        delete ctx->gain;
+    }
+    g_free(ctx->key);
+    memset(ctx, 0, sizeof(ProcessContext));
+}
+//--------------------------------------------------------------------
+// Correct the selection of drawable with the settings of opts. The
+// modifier and coordinate map are taken over from ctx if they fit,
+// otherwise ctx is set up for this image. Returns false if camera
+// or lens are not found in the database, the drawable is indexed or
+// the correction has been cancelled.
+static bool process_image (GimpDrawable *drawable, MyLensfunOpts *opts, ProcessContext *ctx) {
+    gint         x1, y1, x2, y2, imgwidth, imgheight;
+    DrawableIO   io;
 
-        if (exifData.empty()) {
-            if (DEBUG) {
-                g_print ("no exif data found. \n");
-            }
-            return -1;
+    #ifdef POSIX
+    struct timespec profiling_start, profiling_stop;
+    #endif
+
+    // palette indices can't be interpolated
+    if (gimp_drawable_is_indexed (drawable->drawable_id)) {
+        gimp_drawable_detach (drawable);
+        return false;
+    }
+
+    // get image size
+    gimp_drawable_mask_bounds (drawable->drawable_id,
+                               &x1, &y1,
+                               &x2, &y2);
+    imgwidth = x2-x1;
+    imgheight = y2-y1;
+
+    drawable_io_init (&io, drawable, x1, y1, imgwidth, imgheight);
+    InitInterpolation(opts->Interpolation);
+
+    // the crop factor follows from the camera, which is part of the
+    // key already, and is only looked up by create_modifier()
+    MyLensfunOpts keyopts = *opts;
+    keyopts.Crop = 0;
+    gchar *key    = coord_cache_key(&keyopts, imgwidth, imgheight);
+    gchar *ctxkey = g_strdup_printf("%s|%d", key, (int) io.type);
+    g_free(key);
+
+    if (ctx->key && (strcmp(ctx->key, ctxkey) == 0)) {
+        // a map written for the previous image is complete now and
+        // is read back instead of being computed again
+        if (ctx->cache.fp) {
+            coord_cache_close(&ctx->cache, true);
+            coord_cache_open(&ctx->cache, opts, ctx->mod, imgwidth, imgheight);
         }
+        g_free(ctxkey);
+        if (DEBUG) g_print("Reusing modifier of the previous image\n");
+    } else {
+        process_context_release(ctx);
+        ctx->mod = create_modifier(ldb, opts, imgwidth, imgheight,
+                                   cLensfunPixelFormat[io.type], &ctx->radial, &ctx->gain);
+        if (!ctx->mod) {
+            g_free(ctxkey);
+            drawable_io_close (&io);
+            gimp_drawable_detach (drawable);
+            return false;
+        }
+        ctx->key = ctxkey;
+        coord_cache_open(&ctx->cache, opts, ctx->mod, imgwidth, imgheight);
+    }
+
+    // Only a whole layer is cropped to its valid rectangle, cutting
+    // a selection out of a layer would throw away the rest of it. The
+    // tiles outside are cleared, the map would stay incomplete and is
+    // not written then.
+    ImgRect area = { 0, 0, imgwidth, imgheight };
+    if (opts->AutoCrop && gimp_item_is_layer (drawable->drawable_id) &&
+        (imgwidth == (gint) gimp_drawable_width (drawable->drawable_id)) &&
+        (imgheight == (gint) gimp_drawable_height (drawable->drawable_id)) &&
+        GetValidRect(ctx->mod, imgwidth, imgheight, &area)) {
+        if (DEBUG) g_print("Valid area: %d x %d at %d, %d\n", area.width, area.height, area.x, area.y);
+        if (((area.width < imgwidth) || (area.height < imgheight)) && ctx->cache.fp)
+            coord_cache_close(&ctx->cache, false);
+    }
+
+    #ifdef POSIX
+    if (DEBUG) {
+        clock_gettime(CLOCK_REALTIME, &profiling_start);
+    }
+    #endif
+
+    bool bDone = false;
+    switch (io.type) {
+        case GL_PIXEL_U8:
+            bDone = process_tiles<guchar>  (&io, ctx->mod, ctx->radial, ctx->gain, &ctx->cache,
+                                            opts->Interpolation, opts->MaxMapError,
+                                            x1, y1, imgwidth, imgheight, &area);
+            break;
+        case GL_PIXEL_U16:
+            bDone = process_tiles<guint16> (&io, ctx->mod, ctx->radial, ctx->gain, &ctx->cache,
+                                            opts->Interpolation, opts->MaxMapError,
+                                            x1, y1, imgwidth, imgheight, &area);
+            break;
+        case GL_PIXEL_F32:
+            bDone = process_tiles<gfloat>  (&io, ctx->mod, ctx->radial, ctx->gain, &ctx->cache,
+                                            opts->Interpolation, opts->MaxMapError,
+                                            x1, y1, imgwidth, imgheight, &area);
+            break;
+    }
+
+    #ifdef POSIX
+    if (DEBUG) {
+        clock_gettime(CLOCK_REALTIME, &profiling_stop);
+        unsigned long long int time_diff = timespec2llu(&profiling_stop) - timespec2llu(&profiling_start);
+        g_print("\nPerformance: %12llu ns, %d pixel -> %llu ns/pixel\n", time_diff, imgwidth*imgheight, time_diff / (imgwidth*imgheight));
+    }
+    #endif
+
+    if (!bDone) {
+        // the shadow is dropped, the map is incomplete
+        coord_cache_close(&ctx->cache, false);
+        drawable_io_close (&io);
+        gimp_drawable_detach (drawable);
+        return false;
+    }
+
+    drawable_io_finish (&io, x1, y1, imgwidth, imgheight);
+
+    // the canvas follows if the layer is all there is to the image
+    if ((area.width < imgwidth) || (area.height < imgheight)) {
+        const gint32 imageID = gimp_item_get_image (drawable->drawable_id);
+        gint         iLayers;
+
+        gimp_layer_resize (drawable->drawable_id, area.width, area.height, -area.x, -area.y);
+        g_free (gimp_image_get_layers (imageID, &iLayers));
+        if (iLayers == 1)
+            gimp_image_resize_to_layers (imageID);
     }
-    catch (Exiv2::AnyError& e) {
-        if (DEBUG) {
-            g_print ("exception on reading data. \n");
+
+    gimp_displays_flush ();
+    gimp_drawable_detach (drawable);
+
+    return true;
+}
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// Preview
+//
+// Only the visible area of the preview is processed, with a modifier
+// set up for the whole selection so the result matches the final
+// image. Pixels outside the selection are shown unchanged.
+static gboolean preview_render_band (gpointer data)
+{
+    PreviewState *p = &sPreview;
+
+    // next band of the visible area, clipped to the selection
+    const gint y0 = MAX(p->py + p->row, p->y1);
+    const gint y1 = MIN(p->py + p->row + cPreviewBandRows, p->y1 + p->height);
+    const gint x0 = MAX(p->px, p->x1);
+    const gint x1 = MIN(p->px + p->pwidth, p->x1 + p->width);
+
+    if ((x1 > x0) && (y1 > y0))
+    {
+        const gint tw = x1 - x0;
+        const gint th = y1 - y0;
+        const gint channels = p->io.channels;
+
+        MapCoordinates(p->mod, x0 - p->x1, y0 - p->y1, tw, th, p->bufs.UndistCoord,
+                       sLensfunParameters.MaxMapError, p->radial);
+        resample_tile<guchar>(&p->io, p->mod, p->gain, &p->bufs, sLensfunParameters.Interpolation,
+                              p->x1, p->y1, p->width, p->height, tw, th);
+
+        for (int i = 0; i < th; i++)
+        {
+            memcpy(&p->buffer[channels * ((y0 - p->py + i) * p->pwidth + (x0 - p->px))],
+                   &p->bufs.ImgBufferOut[channels * tw * i],
+                   channels * tw);
         }
-        return -1;
+        gimp_preview_draw_buffer (GIMP_PREVIEW (preview), p->buffer, channels * p->pwidth);
     }
 
-    // search database for camera
-    cameras = ldb->FindCameras (exifData["Exif.Image.Make"].toString().c_str(), exifData["Exif.Image.Model"].toString().c_str());
-    if (cameras) {
-        camera = cameras [0];
-        sLensfunParameters.Crop = camera->CropFactor;
-        sLensfunParameters.Camera = string(lf_mlstr_get(camera->Model));
-        sLensfunParameters.CamMaker = string(lf_mlstr_get(camera->Maker));
-    }  else {
-        sLensfunParameters.CamMaker = exifData["Exif.Image.Make"].toString();
+    p->row += cPreviewBandRows;
+    if (p->row < p->pheight)
+        return TRUE;
+
+    p->idle_id = 0;
+    return FALSE;
+}
+//--------------------------------------------------------------------
+static void preview_cancel (void)
+{
+    PreviewState *p = &sPreview;
+
+    if (p->idle_id) {
+        g_source_remove (p->idle_id);
+        p->idle_id = 0;
+    }
+    if (p->mod) {
+        delete p->mod;
+        delete p->radial;
+        delete p->gain;
+        p->mod = NULL;
+        p->radial = NULL;
+        p->gain = NULL;
+        tile_buffers_free (&p->bufs);
+        drawable_io_close (&p->io);
+    }
+    g_free (p->buffer);
+    p->buffer = NULL;
+}
+//--------------------------------------------------------------------
+static void preview_invalidated (GimpPreview *gpreview, gpointer data)
+{
+    PreviewState *p = &sPreview;
+    GimpDrawable *drawable = (GimpDrawable *) data;
+    gint          x2, y2;
+
+    preview_cancel ();
+
+    gimp_drawable_mask_bounds (drawable->drawable_id, &p->x1, &p->y1, &x2, &y2);
+    p->width  = x2 - p->x1;
+    p->height = y2 - p->y1;
+    gimp_preview_get_position (gpreview, &p->px, &p->py);
+    gimp_preview_get_size (gpreview, &p->pwidth, &p->pheight);
+    p->row = 0;
+
+    // show the unprocessed area until the bands are done
+    drawable_io_init (&p->io, drawable, 0, 0, drawable->width, drawable->height, true);
+    p->buffer = g_new (guchar, p->io.channels * p->pwidth * p->pheight);
+    drawable_io_get (&p->io, p->buffer, p->px, p->py, p->pwidth, p->pheight);
+    gimp_preview_draw_buffer (gpreview, p->buffer, p->io.channels * p->pwidth);
+
+    InitInterpolation(sLensfunParameters.Interpolation);
+    p->mod = create_modifier (ldb, &sLensfunParameters, p->width, p->height, LF_PF_U8,
+                              &p->radial, &p->gain);
+    if (!p->mod) {
+        drawable_io_close (&p->io);
+        return;
     }
-    //PrintCameras(cameras, ldb);
 
-    //Get lensID
-    string CamMaker = exifData["Exif.Image.Make"].toString();
-    transform(CamMaker.begin(), CamMaker.end(),CamMaker.begin(), ::tolower);
-    string MakerNoteKey;
+    tile_buffers_init (&p->bufs, p->io.channels, p->pwidth * cPreviewBandRows);
+    p->idle_id = g_idle_add (preview_render_band, NULL);
+}
+//--------------------------------------------------------------------
 
-    //Select special MakerNote Tag for lens depending on Maker
-    if ((CamMaker.find("pentax"))!=string::npos) {
-        MakerNoteKey = "Exif.Pentax.LensType";
+
+//####################################################################
+// Load the lensfun database, preferably from the snapshot
+//
+// lfDatabase::Load() searches all database directories and opens and
+// parses every XML file in them. After a full load the merged database
+// is written to a single XML file in the user cache directory, tagged
+// with a fingerprint of the name, size and mtime of every XML file it
+// was built from. As long as the fingerprint matches, later runs
+// memory map the snapshot and hand it to lensfun in one piece. It is
+// still XML and parsed by lensfun on every run, lensfun offers no way
+// to fill a database from anything else. The debug output reports the
+// load time and whether it came from the snapshot or the XML files.
+
+// FNV-1a hash
+static guint64 hash_bytes(guint64 hash, const void *data, gsize size)
+{
+    const guchar *p = (const guchar *) data;
+    for (gsize i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
     }
-    else if ((CamMaker.find("canon"))!=string::npos) {
-        MakerNoteKey = "Exif.CanonCs.LensType";
+    return hash;
+}
+//--------------------------------------------------------------------
+static guint64 hash_xml_files(guint64 hash, const gchar *dirname)
+{
+    vector<string> vFiles;
+    const gchar   *name;
+
+    GDir *dir = g_dir_open (dirname, 0, NULL);
+    if (dir == NULL)
+        return hash;
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        if (g_str_has_suffix (name, ".xml"))
+            vFiles.push_back(string(name));
     }
-    else if ((CamMaker.find("minolta"))!=string::npos) {
-        MakerNoteKey = "Exif.Minolta.LensID";
+    g_dir_close (dir);
+
+    // directory listings come in no particular order
+    sort(vFiles.begin(), vFiles.end());
+
+    for (unsigned int i = 0; i < vFiles.size(); i++) {
+        gchar   *filename = g_build_filename (dirname, vFiles[i].c_str(), NULL);
+        GStatBuf st;
+        if (g_stat (filename, &st) == 0) {
+            const gint64 size  = st.st_size;
+            const gint64 mtime = st.st_mtime;
+            hash = hash_bytes(hash, filename, strlen(filename));
+            hash = hash_bytes(hash, &size, sizeof(size));
+            hash = hash_bytes(hash, &mtime, sizeof(mtime));
+        }
+        g_free (filename);
     }
-    else if ((CamMaker.find("nikon"))!=string::npos) {
-        MakerNoteKey = "Exif.NikonLd3.LensIDNumber";
-        if (exifData[MakerNoteKey].toString().size()==0) {
-            MakerNoteKey = "Exif.NikonLd2.LensIDNumber";
+    return hash;
+}
+//--------------------------------------------------------------------
+// Fingerprint of all places lfDatabase::Load() reads from
+static guint64 database_fingerprint(const lfDatabase *db)
+{
+    const gchar *const *sysdirs = g_get_system_data_dirs ();
+    const guint32 version = LF_VERSION;
+    guint64 hash = 14695981039346656037ULL;
+
+    hash = hash_bytes(hash, &cDBSnapshotVersion, sizeof(cDBSnapshotVersion));
+    hash = hash_bytes(hash, &version, sizeof(version));
+
+    vector<string> vDirs;
+    for (int i = 0; sysdirs[i]; i++) {
+        gchar *dir = g_build_filename (sysdirs[i], "lensfun", NULL);
+        vDirs.push_back(string(dir));
+        g_free (dir);
+    }
+    vDirs.push_back("/var/lib/lensfun-updates");
+    if (db->HomeDataDir)
+        vDirs.push_back(string(db->HomeDataDir));
+    if (db->UserUpdatesDir)
+        vDirs.push_back(string(db->UserUpdatesDir));
+
+    for (unsigned int i = 0; i < vDirs.size(); i++) {
+        gchar *versioned = g_build_filename (vDirs[i].c_str(), "version_1", NULL);
+        hash = hash_xml_files(hash, vDirs[i].c_str());
+        hash = hash_xml_files(hash, versioned);
+        g_free (versioned);
+    }
+    return hash;
+}
+//--------------------------------------------------------------------
+static gchar *database_snapshot_path()
+{
+    return g_build_filename (g_get_user_cache_dir (), "gimp-lensfun", "database.xml", NULL);
+}
+//--------------------------------------------------------------------
+static bool load_database_snapshot(lfDatabase *db, guint64 fingerprint)
+{
+    gchar       *path = database_snapshot_path();
+    GMappedFile *map  = g_mapped_file_new (path, FALSE, NULL);
+    bool         bLoaded = false;
+
+    g_free (path);
+    if (map == NULL)
+        return false;
+
+    const gchar *contents = g_mapped_file_get_contents (map);
+    const gsize  length   = g_mapped_file_get_length (map);
+    const gchar *eol      = contents ? (const gchar *) memchr (contents, '\n', MIN(length, 256)) : NULL;
+
+    if (eol) {
+        const string       line(contents, eol + 1 - contents);
+        const gsize        iDataSize = length - line.size();
+        guint              iVersion = 0, iLensfunVersion = 0;
+        unsigned long long iFingerprint = 0;
+        unsigned long      iSize = 0;
+
+        if ((sscanf(line.c_str(), DB_SNAPSHOT_HEADER,
+                    &iVersion, &iLensfunVersion, &iFingerprint, &iSize) == 4) &&
+            (iVersion == cDBSnapshotVersion) &&
+            (iLensfunVersion == LF_VERSION) &&
+            (iFingerprint == fingerprint) &&
+            (iSize == iDataSize))
+        {
+            bLoaded = (db->Load ("gimp-lensfun snapshot", eol + 1, iDataSize) == LF_NO_ERROR);
         }
-        if (exifData[MakerNoteKey].toString().size()==0) {
-            MakerNoteKey = "Exif.NikonLd1.LensIDNumber";
+    }
+
+    g_mapped_file_unref (map);
+    return bLoaded;
+}
+//--------------------------------------------------------------------
+static void save_database_snapshot(const lfDatabase *db, guint64 fingerprint)
+{
+    char *data = lfDatabase::Save (db->GetMounts (), db->GetCameras (), db->GetLenses ());
+    if (data == NULL)
+        return;
+
+    gchar *path    = database_snapshot_path();
+    gchar *dirname = g_path_get_dirname (path);
+    gchar *tmppath = NULL;
+    const gsize iDataSize = strlen(data);
+
+    // write to a temporary file first, parallel runs must never see
+    // a partially written snapshot
+    g_mkdir_with_parents (dirname, 0755);
+    FILE *fp = open_temp_file (path, &tmppath);
+    if (fp) {
+        bool bOK = (fprintf (fp, DB_SNAPSHOT_HEADER, cDBSnapshotVersion, (guint) LF_VERSION,
+                             (unsigned long long) fingerprint, (unsigned long) iDataSize) > 0) &&
+                   (fwrite (data, 1, iDataSize, fp) == iDataSize);
+        bOK = (fclose (fp) == 0) && bOK;
+        if (bOK) {
+            g_unlink (path);
+            bOK = (g_rename (tmppath, path) == 0);
         }
+        if (!bOK)
+            g_unlink (tmppath);
+        if (DEBUG) g_print ("%s database snapshot %s\n", bOK ? "Wrote" : "Failed to write", path);
     }
-    else if ((CamMaker.find("olympus"))!=string::npos) {
-        MakerNoteKey = "Exif.OlympusEq.LensType";
+
+    g_free (tmppath);
+    g_free (dirname);
+    g_free (path);
+    lf_free (data);
+}
+//--------------------------------------------------------------------
+static lfDatabase *load_database()
+{
+    GTimer     *timer = g_timer_new ();
+    lfDatabase *db    = new lfDatabase ();
+    const char *source = "snapshot";
+    lfError     err   = LF_NO_ERROR;
+
+    const guint64 fingerprint = database_fingerprint(db);
+    sDBFingerprint = fingerprint;
+
+    if (!load_database_snapshot(db, fingerprint)) {
+        // start over, a broken snapshot may have been loaded partially
+        delete db;
+        db = new lfDatabase ();
+        source = "XML files";
+        err = db->Load ();
+        if (err == LF_NO_ERROR)
+            save_database_snapshot(db, fingerprint);
     }
-    else {
-        //Use default lens model tag for all other makers
-        MakerNoteKey = "Exif.Photo.LensModel";
+
+    if (DEBUG) {
+        g_print ("%s from %s in %.1f ms\n", (err == LF_NO_ERROR) ? "OK" : "failed!",
+                 source, g_timer_elapsed (timer, NULL) * 1000.0);
     }
+    g_timer_destroy (timer);
 
-    //Decode Lens ID
-    if ((MakerNoteKey.size()>0) && (exifData[MakerNoteKey].toString().size()>0))  {
-        Exiv2::ExifKey ek(MakerNoteKey);
-        Exiv2::ExifData::const_iterator md = exifData.findKey(ek);
-        if (md != exifData.end()) {
-            LensNameMN = md->print(&exifData);
+    return db;
+}
+//--------------------------------------------------------------------
 
-            //Modify some lens names for better searching in lfDatabase
-            if ((CamMaker.find("nikon"))!=std::string::npos) {
-                StrReplace(LensNameMN, "Nikon", "");
-                StrReplace(LensNameMN, "Zoom-Nikkor", "");
+
+//####################################################################
+// Cache of EXIF lens data
+//
+// Opening a file with exiv2 parses all of its metadata, which takes
+// long for large TIFFs, and the fuzzy camera and lens search grows
+// with the database. Both results are kept in a key file in the user
+// cache directory:
+//
+//   - "file" entries hold the lens related EXIF data of a file, keyed
+//     by its path, size and mtime. A hit skips the metadata parse.
+//   - "lens" entries hold the database camera and lens found for a
+//     camera and maker note lens ID. A hit skips the database search.
+//     They are only valid for the database they were resolved with.
+//
+// The EXIF data also travels with the image as parasite, so an image
+// saved as XCF still knows its lens after the original file is gone.
+const char *const cExifCacheVersion  = "1";
+const char *const cExifParasiteName  = "gimp-lensfun-exif";
+const gsize       cExifCacheMaxFiles = 4096;
+
+typedef struct
+{
+    GKeyFile *keys;
+    gchar    *path;
+    bool      bChanged;
+} ExifCache;
+//--------------------------------------------------------------------
+static bool keyfile_get_string(GKeyFile *keys, const gchar *group, const gchar *name, string *value)
+{
+    gchar *str = g_key_file_get_string (keys, group, name, NULL);
+    if (str == NULL)
+        return false;
+    *value = string(str);
+    g_free (str);
+    return true;
+}
+//--------------------------------------------------------------------
+// Group name of an entry, keys may hold characters group names can't
+static gchar *exif_cache_group(const gchar *kind, const string &key)
+{
+    gchar *hash  = g_compute_checksum_for_string (G_CHECKSUM_SHA1, key.c_str(), key.length());
+    gchar *group = g_strconcat (kind, " ", hash, NULL);
+    g_free (hash);
+    return group;
+}
+//--------------------------------------------------------------------
+static void exif_data_save(GKeyFile *keys, const gchar *group, const ExifLensData *data)
+{
+    g_key_file_set_string (keys, group, "Make", data->Make.c_str());
+    g_key_file_set_string (keys, group, "Model", data->Model.c_str());
+    g_key_file_set_string (keys, group, "LensID", data->LensID.c_str());
+    g_key_file_set_string (keys, group, "LensName", data->LensName.c_str());
+    g_key_file_set_double (keys, group, "Focal", data->Focal);
+    g_key_file_set_double (keys, group, "Aperture", data->Aperture);
+}
+//--------------------------------------------------------------------
+static bool exif_data_load(GKeyFile *keys, const gchar *group, ExifLensData *data)
+{
+    if (!keyfile_get_string(keys, group, "Make", &data->Make) ||
+        !keyfile_get_string(keys, group, "Model", &data->Model) ||
+        !keyfile_get_string(keys, group, "LensID", &data->LensID) ||
+        !keyfile_get_string(keys, group, "LensName", &data->LensName) ||
+        !g_key_file_has_key (keys, group, "Focal", NULL) ||
+        !g_key_file_has_key (keys, group, "Aperture", NULL)) {
+        return false;
+    }
+    data->Focal    = (float) g_key_file_get_double (keys, group, "Focal", NULL);
+    data->Aperture = (float) g_key_file_get_double (keys, group, "Aperture", NULL);
+    return true;
+}
+//--------------------------------------------------------------------
+static void exif_cache_open(ExifCache *cache)
+{
+    string version;
+
+    cache->path     = g_build_filename (g_get_user_cache_dir (), "gimp-lensfun", "exif.ini", NULL);
+    cache->keys     = g_key_file_new ();
+    cache->bChanged = false;
+
+    if (!g_key_file_load_from_file (cache->keys, cache->path, G_KEY_FILE_NONE, NULL) ||
+        !keyfile_get_string(cache->keys, "cache", "Version", &version) ||
+        (version != cExifCacheVersion))
+    {
+        g_key_file_free (cache->keys);
+        cache->keys = g_key_file_new ();
+        g_key_file_set_string (cache->keys, "cache", "Version", cExifCacheVersion);
+    }
+}
+//--------------------------------------------------------------------
+// Write the cache back if anything has been added. The oldest file
+// entries are dropped beyond cExifCacheMaxFiles.
+static void exif_cache_close(ExifCache *cache)
+{
+    if (cache->bChanged)
+    {
+        gsize   iNumGroups = 0;
+        gsize   iNumFiles  = 0;
+        gchar **groups     = g_key_file_get_groups (cache->keys, &iNumGroups);
+
+        for (gsize i = 0; i < iNumGroups; i++)
+            if (g_str_has_prefix (groups[i], "file "))
+                iNumFiles++;
+        for (gsize i = 0; (i < iNumGroups) && (iNumFiles > cExifCacheMaxFiles); i++) {
+            if (g_str_has_prefix (groups[i], "file ")) {
+                g_key_file_remove_group (cache->keys, groups[i], NULL);
+                iNumFiles--;
             }
         }
+        g_strfreev (groups);
+
+        gsize  length  = 0;
+        gchar *data    = g_key_file_to_data (cache->keys, &length, NULL);
+        gchar *dirname = g_path_get_dirname (cache->path);
+        gchar *tmppath = NULL;
+
+        // replace the file in one step, parallel runs may read it
+        g_mkdir_with_parents (dirname, 0755);
+        FILE *fp = open_temp_file (cache->path, &tmppath);
+        if (fp) {
+            bool bOK = (fwrite (data, 1, length, fp) == length);
+            bOK = (fclose (fp) == 0) && bOK;
+            if (bOK) {
+                g_unlink (cache->path);
+                bOK = (g_rename (tmppath, cache->path) == 0);
+            }
+            if (!bOK)
+                g_unlink (tmppath);
+        }
+
+        g_free (tmppath);
+        g_free (dirname);
+        g_free (data);
     }
 
-    if (camera) {
-        if (LensNameMN.size()>8) {  // only take lens names with significant length
-            lenses = ldb->FindLenses (camera, NULL, LensNameMN.c_str());
-        } else {
-            lenses = ldb->FindLenses (camera, NULL, NULL);
-        }
-        if (lenses) {
-            lens = lenses[0];
-            sLensfunParameters.Lens = string(lf_mlstr_get(lens->Model));
+    g_key_file_free (cache->keys);
+    g_free (cache->path);
+    cache->keys = NULL;
+    cache->path = NULL;
+}
+//--------------------------------------------------------------------
+// Path, size and mtime of a file. Returns false if it can't be read.
+static bool exif_file_key(const gchar *filename, string *key)
+{
+    GStatBuf st;
+
+    if ((filename == NULL) || (g_stat (filename, &st) != 0))
+        return false;
+
+    gchar *str = g_strdup_printf ("%s|%" G_GINT64_FORMAT "|%" G_GINT64_FORMAT,
+                                  filename, (gint64) st.st_size, (gint64) st.st_mtime);
+    *key = string(str);
+    g_free (str);
+    return true;
+}
+//--------------------------------------------------------------------
+// Cached EXIF data of a file. A file without EXIF data is cached with
+// an empty Make.
+static bool exif_cache_get_file(ExifCache *cache, const gchar *filename, ExifLensData *data)
+{
+    string key, stored;
+
+    if (!exif_file_key(filename, &key))
+        return false;
+
+    gchar *group = exif_cache_group("file", key);
+    bool   bHit  = keyfile_get_string(cache->keys, group, "Key", &stored) && (stored == key) &&
+                   exif_data_load(cache->keys, group, data);
+    g_free (group);
+
+    if (DEBUG) g_print ("EXIF cache %s: %s\n", bHit ? "hit" : "miss", filename);
+    return bHit;
+}
+//--------------------------------------------------------------------
+static void exif_cache_put_file(ExifCache *cache, const gchar *filename, const ExifLensData *data)
+{
+    string key;
+
+    if (!exif_file_key(filename, &key))
+        return;
+
+    gchar *group = exif_cache_group("file", key);
+    g_key_file_remove_group (cache->keys, group, NULL);
+    g_key_file_set_string (cache->keys, group, "Key", key.c_str());
+    exif_data_save(cache->keys, group, data);
+    g_free (group);
+    cache->bChanged = true;
+}
+//--------------------------------------------------------------------
+static bool exif_parasite_get(gint32 imageID, ExifLensData *data)
+{
+    GimpParasite *parasite = gimp_image_get_parasite (imageID, cExifParasiteName);
+    if (parasite == NULL)
+        return false;
+
+    GKeyFile *keys = g_key_file_new ();
+    bool      bOK  = g_key_file_load_from_data (keys, (const gchar *) gimp_parasite_data (parasite),
+                                                gimp_parasite_data_size (parasite),
+                                                G_KEY_FILE_NONE, NULL) &&
+                     exif_data_load(keys, "exif", data);
+
+    g_key_file_free (keys);
+    gimp_parasite_free (parasite);
+    return bOK;
+}
+//--------------------------------------------------------------------
+// Attach the EXIF data to the image. Attaching marks the image dirty,
+// so this is done once the image has been corrected.
+static void exif_parasite_set(gint32 imageID, const ExifLensData *data)
+{
+    GKeyFile *keys   = g_key_file_new ();
+    gsize     length = 0;
+
+    exif_data_save(keys, "exif", data);
+    gchar *text = g_key_file_to_data (keys, &length, NULL);
+
+    GimpParasite *parasite = gimp_parasite_new (cExifParasiteName, GIMP_PARASITE_PERSISTENT,
+                                                length, text);
+    gimp_image_attach_parasite (imageID, parasite);
+
+    gimp_parasite_free (parasite);
+    g_free (text);
+    g_key_file_free (keys);
+}
+//--------------------------------------------------------------------
+// EXIF data of an image from its parasite, the cache or, if neither
+// has it, from its file. *bParasite tells if the image already carries
+// the data. Only files that could be read are cached, a failed read
+// may have left part of the data behind. Returns false if there is no
+// usable EXIF data.
+static bool exif_lookup(ExifCache *cache, gint32 imageID, const gchar *filename,
+                        ExifLensData *data, bool *bParasite)
+{
+    *bParasite = exif_parasite_get(imageID, data);
+    if (!*bParasite && !exif_cache_get_file(cache, filename, data))
+    {
+        if ((filename == NULL) || (read_exif(filename, data) != 0) || data->Make.empty()) {
+            *data = ExifLensData();
+            data->Focal = data->Aperture = 0;
+            return false;
         }
-        lf_free (lenses);
+        exif_cache_put_file(cache, filename, data);
     }
-    lf_free (cameras);
+    return !data->Make.empty();
+}
+//--------------------------------------------------------------------
+// Find camera and lens of the EXIF data in the database, like
+// exif_to_opts(). The result is cached per camera and maker note lens
+// ID if both have been found. The decoded lens name is part of the
+// key, as some makers (e.g. Nikon) spread the identity of a lens over
+// several tags. Camera and lens of the previous image never carry
+// over, they are left empty if the database doesn't know them.
+static void exif_resolve(ExifCache *cache, const lfDatabase *db,
+                         const ExifLensData *data, MyLensfunOpts *opts)
+{
+    const string key = data->Make + "|" + data->Model + "|" + data->LensID + "|" + data->LensName;
+    gchar       *group = exif_cache_group("lens", key);
+    string       stored;
 
-    sLensfunParameters.Focal = exifData["Exif.Photo.FocalLength"].toFloat();
-    sLensfunParameters.Aperture = exifData["Exif.Photo.FNumber"].toFloat();
+    opts->Camera.clear();
+    opts->Lens.clear();
 
-    if (DEBUG) {
-        g_print("\nExif Data:\n");
-        g_print("\tCamera: %s, %s\n", sLensfunParameters.CamMaker.c_str(), sLensfunParameters.Camera.c_str());
-        g_print("\tLens: %s\n", sLensfunParameters.Lens.c_str());
-        g_print("\tFocal Length: %f\n", sLensfunParameters.Focal);
-        g_print("\tF-Stop: %f\n", sLensfunParameters.Aperture);
-        g_print("\tCrop Factor: %f\n", sLensfunParameters.Crop);
-        g_print("\tScale: %f\n", sLensfunParameters.Scale);
+    if (!keyfile_get_string(cache->keys, group, "Key", &stored) || (stored != key) ||
+        (g_key_file_get_uint64 (cache->keys, group, "Database", NULL) != sDBFingerprint) ||
+        !g_key_file_has_key (cache->keys, group, "Camera", NULL) ||
+        !g_key_file_has_key (cache->keys, group, "Lens", NULL))
+    {
+        exif_to_opts(db, data, opts);
+
+        g_key_file_remove_group (cache->keys, group, NULL);
+        if (!opts->Camera.empty() && !opts->Lens.empty()) {
+            g_key_file_set_string (cache->keys, group, "Key", key.c_str());
+            g_key_file_set_uint64 (cache->keys, group, "Database", sDBFingerprint);
+            g_key_file_set_string (cache->keys, group, "CamMaker", opts->CamMaker.c_str());
+            g_key_file_set_string (cache->keys, group, "Camera", opts->Camera.c_str());
+            g_key_file_set_double (cache->keys, group, "Crop", opts->Crop);
+            g_key_file_set_string (cache->keys, group, "Lens", opts->Lens.c_str());
+        }
+        cache->bChanged = true;
+    }
+    else
+    {
+        if (DEBUG) g_print ("Lens cache hit: %s\n", key.c_str());
+
+        keyfile_get_string(cache->keys, group, "CamMaker", &opts->CamMaker);
+        keyfile_get_string(cache->keys, group, "Camera", &opts->Camera);
+        keyfile_get_string(cache->keys, group, "Lens", &opts->Lens);
+        opts->Crop = (float) g_key_file_get_double (cache->keys, group, "Crop", NULL);
     }
+    opts->Focal    = data->Focal;
+    opts->Aperture = data->Aperture;
 
-    return 0;
+    g_free (group);
 }
 //--------------------------------------------------------------------
 
@@ -1180,6 +2799,14 @@ static void loadSettings() {
     sLensfunParameters.Aperture = sLensfunParameterStorage.Aperture;
     sLensfunParameters.Distance = sLensfunParameterStorage.Distance;
     sLensfunParameters.TargetGeom = sLensfunParameterStorage.TargetGeom;
+    sLensfunParameters.Interpolation = sLensfunParameterStorage.Interpolation;
+    if ((sLensfunParameters.Interpolation < GL_INTERPOL_NN) ||
+        (sLensfunParameters.Interpolation > GL_INTERPOL_LZ3))
+        sLensfunParameters.Interpolation = GL_INTERPOL_LZ;
+    sLensfunParameters.MaxMapError = sLensfunParameterStorage.MaxMapError;
+    if (!(sLensfunParameters.MaxMapError >= 0) || (sLensfunParameters.MaxMapError > 1))
+        sLensfunParameters.MaxMapError = cDefaultMapError;
+    sLensfunParameters.AutoCrop = sLensfunParameterStorage.AutoCrop;
 }
 //--------------------------------------------------------------------
 
@@ -1196,12 +2823,221 @@ static void storeSettings() {
     sLensfunParameterStorage.Aperture = sLensfunParameters.Aperture;
     sLensfunParameterStorage.Distance = sLensfunParameters.Distance;
     sLensfunParameterStorage.TargetGeom = sLensfunParameters.TargetGeom;
+    sLensfunParameterStorage.Interpolation = sLensfunParameters.Interpolation;
+    sLensfunParameterStorage.MaxMapError = sLensfunParameters.MaxMapError;
+    sLensfunParameterStorage.AutoCrop = sLensfunParameters.AutoCrop;
 
     gimp_set_data ("plug-in-gimplensfun", &sLensfunParameterStorage, sizeof (sLensfunParameterStorage));
 }
 //--------------------------------------------------------------------
 
 
+//####################################################################
+// Take the settings from the PDB arguments of a non-interactive call,
+// args points to the maker argument and holds nargs of the settings.
+// Scripts written before a setting was appended pass fewer, those
+// keep their defaults. Camera, lens, focal length and aperture are
+// skipped if bExif is true. Returns false if any of the settings is
+// out of range.
+static bool read_opts_from_params(const GimpParam *args, gint nargs, bool bExif, MyLensfunOpts *opts) {
+
+    const int iValidFlags = LF_MODIFY_TCA | LF_MODIFY_VIGNETTING | LF_MODIFY_DISTORTION |
+                            LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE;
+
+    if ((!bExif &&
+         ((args[0].data.d_string == NULL) ||
+          (args[1].data.d_string == NULL) || (args[2].data.d_string == NULL) ||
+          (args[3].data.d_float <= 0) ||
+          (args[4].data.d_float < 0))) ||
+        (args[5].data.d_float <= 0) ||
+        (args[6].data.d_float < 0) ||
+        (args[7].data.d_int32 <= LF_UNKNOWN) || (args[7].data.d_int32 > LF_FISHEYE_THOBY) ||
+        (args[8].data.d_int32 & ~iValidFlags) ||
+        (args[10].data.d_int32 < GL_INTERPOL_NN) || (args[10].data.d_int32 > GL_INTERPOL_LZ3) ||
+        ((nargs > 11) && (!(args[11].data.d_float >= 0) || (args[11].data.d_float > 1))))
+    {
+        return false;
+    }
+
+    if (!bExif) {
+        opts->CamMaker  = args[0].data.d_string;
+        opts->Camera    = args[1].data.d_string;
+        opts->Lens      = args[2].data.d_string;
+        opts->Focal     = args[3].data.d_float;
+        opts->Aperture  = args[4].data.d_float;
+    }
+    opts->Distance      = args[5].data.d_float;
+    opts->Scale         = args[6].data.d_float;
+    opts->TargetGeom    = (lfLensType) args[7].data.d_int32;
+    opts->ModifyFlags   = args[8].data.d_int32;
+    opts->Inverse       = (args[9].data.d_int32 != 0);
+    opts->Interpolation = (glInterpolationType) args[10].data.d_int32;
+    opts->MaxMapError   = (nargs > 11) ? args[11].data.d_float : cDefaultMapError;
+    opts->AutoCrop      = (nargs > 12) && (args[12].data.d_int32 != 0);
+
+    return true;
+}
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// Batch processing
+//
+// All images are corrected in one plug-in process, so the database
+// is loaded once and images with the same settings share modifier and
+// coordinate map. The EXIF data is read ahead by a worker thread while
+// the previous image is processed, unless the parasite of the image
+// or the EXIF cache already has it. Loading, saving and pixel transfer
+// go through the single libgimp connection and stay sequential.
+typedef struct
+{
+    vector<string>          files;      // empty if an image has no file
+    vector<ExifLensData *>  cached;     // from parasite or cache, NULL to read the file
+    GAsyncQueue            *queue;      // ExifLensData, in order of files
+} ExifPrefetch;
+//--------------------------------------------------------------------
+static gpointer exif_prefetch_thread(gpointer data)
+{
+    ExifPrefetch *prefetch = (ExifPrefetch *) data;
+
+    for (unsigned int i = 0; i < prefetch->files.size(); i++)
+    {
+        ExifLensData *exif = prefetch->cached[i];
+        if (exif == NULL) {
+            exif = new ExifLensData;
+            if (prefetch->files[i].empty() ||
+                (read_exif(prefetch->files[i].c_str(), exif) != 0)) {
+                *exif = ExifLensData();
+                exif->Focal = exif->Aperture = 0;
+            }
+        }
+        g_async_queue_push (prefetch->queue, exif);
+    }
+    return NULL;
+}
+//--------------------------------------------------------------------
+static GimpPDBStatusType run_batch(const GimpParam *param, gint nparams, gint *iNumCorrected)
+{
+    const gint     iNumFiles  = param[1].data.d_int32;
+    gchar        **files      = param[2].data.d_stringarray;
+    const gint     iNumImages = param[3].data.d_int32;
+    const gint32  *images     = param[4].data.d_int32array;
+    const gchar   *outdir     = param[5].data.d_string;
+    const GimpParam *settings = &param[6];
+
+    const bool     bExif = (settings[0].data.d_string == NULL) ||
+                           (settings[0].data.d_string[0] == '\0');
+    MyLensfunOpts  opts  = sLensfunParameters;
+
+    *iNumCorrected = 0;
+
+    if ((iNumFiles < 0) || (iNumImages < 0) ||
+        ((iNumFiles > 0) && ((outdir == NULL) || (outdir[0] == '\0'))) ||
+        !read_opts_from_params(settings, nparams - 6, bExif, &opts)) {
+        return GIMP_PDB_CALLING_ERROR;
+    }
+
+    const gint iNumTotal = iNumFiles + iNumImages;
+    ExifPrefetch prefetch;
+    ExifCache    cache;
+    GThread     *thread = NULL;
+    vector<bool> vParasite(iNumTotal, false);
+
+    if (bExif) {
+        exif_cache_open(&cache);
+        for (int i = 0; i < iNumTotal; i++) {
+            gchar *filename = (i < iNumFiles) ? g_strdup (files[i])
+                                              : gimp_image_get_filename (images[i - iNumFiles]);
+            ExifLensData *exif = new ExifLensData;
+            if ((i >= iNumFiles) && exif_parasite_get(images[i - iNumFiles], exif)) {
+                vParasite[i] = true;
+            } else if (!exif_cache_get_file(&cache, filename, exif)) {
+                delete exif;
+                exif = NULL;
+            }
+            prefetch.files.push_back (filename ? filename : "");
+            prefetch.cached.push_back (exif);
+            g_free (filename);
+        }
+        prefetch.queue = g_async_queue_new ();
+        thread = g_thread_new ("exif-prefetch", exif_prefetch_thread, &prefetch);
+    }
+
+    if (outdir && (outdir[0] != '\0'))
+        g_mkdir_with_parents (outdir, 0755);
+
+    ProcessContext ctx;
+    memset(&ctx, 0, sizeof(ProcessContext));
+
+    for (int i = 0; i < iNumTotal; i++)
+    {
+        const bool bFile = (i < iNumFiles);
+        MyLensfunOpts imgopts = opts;
+
+        ExifLensData exif;
+
+        if (bExif) {
+            ExifLensData *prefetched = (ExifLensData *) g_async_queue_pop (prefetch.queue);
+            exif = *prefetched;
+            if ((prefetch.cached[i] == NULL) && !prefetch.files[i].empty() && !exif.Make.empty())
+                exif_cache_put_file(&cache, prefetch.files[i].c_str(), &exif);
+            delete prefetched;
+            if (exif.Make.empty()) {
+                if (DEBUG) g_print ("Skipping image %d, no EXIF data\n", i);
+                continue;
+            }
+            exif_resolve(&cache, ldb, &exif, &imgopts);
+        }
+
+        const gint32 imageID = bFile ? gimp_file_load (GIMP_RUN_NONINTERACTIVE, files[i], files[i])
+                                     : images[i - iNumFiles];
+        if (imageID == -1)
+            continue;
+
+        const gint32  drawableID = gimp_image_get_active_drawable (imageID);
+        GimpDrawable *drawable   = gimp_drawable_get (drawableID);
+
+        // a loaded file is saved and dropped, nothing to undo there.
+        // Open images get the correction as a single undo step.
+        if (bFile)
+            gimp_image_undo_disable (imageID);
+        else
+            gimp_image_undo_group_start (imageID);
+
+        bool bOK = process_image(drawable, &imgopts, &ctx);
+
+        if (bFile) {
+            if (bOK) {
+                gchar *basename = g_path_get_basename (files[i]);
+                gchar *outfile  = g_build_filename (outdir, basename, NULL);
+                bOK = gimp_file_save (GIMP_RUN_NONINTERACTIVE, imageID, drawableID, outfile, outfile);
+                g_free (outfile);
+                g_free (basename);
+            }
+            gimp_image_delete (imageID);
+        } else {
+            if (bOK && bExif && !vParasite[i])
+                exif_parasite_set(imageID, &exif);
+            gimp_image_undo_group_end (imageID);
+        }
+
+        if (bOK)
+            (*iNumCorrected)++;
+    }
+
+    process_context_release(&ctx);
+
+    if (thread) {
+        g_thread_join (thread);
+        g_async_queue_unref (prefetch.queue);
+        exif_cache_close(&cache);
+    }
+
+    return GIMP_PDB_SUCCESS;
+}
+//--------------------------------------------------------------------
+
+
 //####################################################################
 // Run()
 static void
@@ -1211,63 +3047,148 @@ run (const gchar*   name,
      gint*          nreturn_vals,
      GimpParam**    return_vals)
 {
-    static GimpParam    values[1];
+    static GimpParam    values[2];
     GimpPDBStatusType   status = GIMP_PDB_SUCCESS;
     gint32              imageID;
     GimpRunMode         run_mode;
     GimpDrawable        *drawable;
+    ProcessContext      ctx;
 
     /* Setting mandatory output values */
     *nreturn_vals = 1;
     *return_vals  = values;
 
-    values[0].type = GIMP_PDB_STATUS;
-    values[0].data.d_status = status;
+    run_mode = GimpRunMode(param[0].data.d_int32);
+
+    if (strcmp (name, "plug-in-lensfun-batch") == 0)
+    {
+        gint iNumCorrected = 0;
+
+        if ((nparams < 6 + cMinSettingsArgs) || (nparams > cNumBatchArgs)) {
+            status = GIMP_PDB_CALLING_ERROR;
+        } else {
+#if GIMP_CHECK_VERSION(2,10,0)
+            gegl_init (NULL, NULL);
+#endif
+            gimp_progress_init ("Lensfun correction...");
+            ldb = load_database();
+            status = run_batch(param, nparams, &iNumCorrected);
+            delete ldb;
+        }
+
+        *nreturn_vals = 2;
+        values[0].type = GIMP_PDB_STATUS;
+        values[0].data.d_status = status;
+        values[1].type = GIMP_PDB_INT32;
+        values[1].data.d_int32 = iNumCorrected;
+        return;
+    }
+
+    // non-interactive calls pass either only the image and drawable
+    // or the settings, without the optional ones at the end if the
+    // script predates them. GIMP fills omitted trailing arguments with
+    // empty values, so an empty maker means "not given".
+    const bool bSettingsFromParams = (run_mode == GIMP_RUN_NONINTERACTIVE) &&
+                                     (nparams >= 3 + cMinSettingsArgs) &&
+                                     (param[3].data.d_string != NULL) &&
+                                     (param[3].data.d_string[0] != '\0');
+
+    if ((run_mode == GIMP_RUN_NONINTERACTIVE) && (nparams != 3) &&
+        ((nparams < 3 + cMinSettingsArgs) || (nparams > cNumPDBArgs))) {
+        status = GIMP_PDB_CALLING_ERROR;
+    } else if (bSettingsFromParams &&
+               !read_opts_from_params(&param[3], nparams - 3, false, &sLensfunParameters)) {
+        status = GIMP_PDB_CALLING_ERROR;
+    }
+
+    if (status != GIMP_PDB_SUCCESS) {
+        values[0].type = GIMP_PDB_STATUS;
+        values[0].data.d_status = status;
+        return;
+    }
 
     drawable = gimp_drawable_get (param[2].data.d_drawable);
 
+#if GIMP_CHECK_VERSION(2,10,0)
+    gegl_init (NULL, NULL);
+#endif
+
     gimp_progress_init ("Lensfun correction...");
 
     imageID = param[1].data.d_drawable;
 
     if (DEBUG) g_print ("Loading database...");
     //Load lensfun database
-    ldb = new lfDatabase ();
-    if (ldb->Load () != LF_NO_ERROR) {
-        if (DEBUG) g_print ("failed!\n");
-    } else {
-        if (DEBUG) g_print ("OK\n");
-    }
+    ldb = load_database();
 
-    // read exif data
-    const gchar *filename = gimp_image_get_filename(imageID);
-    if (DEBUG) g_print ("Image file path: %s\n", filename);
+    memset(&ctx, 0, sizeof(ProcessContext));
 
-    if ((filename == NULL) || (read_opts_from_exif(filename) != 0)) {
-	    loadSettings();
-    }
+    // merging the shadow, cropping the layer and resizing the canvas
+    // are undone as one step
+    gimp_image_undo_group_start (imageID);
 
-    run_mode = GimpRunMode(param[0].data.d_int32);
-    if (run_mode == GIMP_RUN_INTERACTIVE)
+    if (bSettingsFromParams)
     {
-	    if (DEBUG) g_print ("Creating dialog...\n");
-	    /* Display the dialog */
-	    if (create_dialog_window (drawable)) {
-		    process_image(drawable);
-	    }
-    } 
-    else 
+        // Everything is given by the caller, neither the EXIF data
+        // nor the settings shared with other runs of the plugin are
+        // involved. Parallel batch runs thus can't interfere.
+        if (!process_image(drawable, &sLensfunParameters, &ctx))
+            status = GIMP_PDB_EXECUTION_ERROR;
+    }
+    else
     {
-	    /* If run_mode is non-interactive, we use the configuration
-	     * from read_opts_from_exif. If that fails, we use the stored settings
-	     * (loadSettings()), e.g. the settings that have been made in the last 
-	     * interactive use of the plugin. One day, all settings should be 
-	     * available as arguments in non-interactive mode.
-	     */
-	    process_image(drawable);
+        // read exif data
+        gchar       *filename  = gimp_image_get_filename(imageID);
+        ExifCache    cache;
+        ExifLensData exif;
+        bool         bParasite = false;
+        if (DEBUG) g_print ("Image file path: %s\n", filename);
+
+        exif_cache_open(&cache);
+        const bool bExif = exif_lookup(&cache, imageID, filename, &exif, &bParasite);
+        if (bExif) {
+            exif_resolve(&cache, ldb, &exif, &sLensfunParameters);
+        } else {
+            loadSettings();
+        }
+        exif_cache_close(&cache);
+        g_free (filename);
+
+        bool bCorrected = false;
+
+        if (run_mode == GIMP_RUN_INTERACTIVE)
+        {
+            if (DEBUG) g_print ("Creating dialog...\n");
+            /* Display the dialog */
+            if (create_dialog_window (drawable)) {
+                bCorrected = process_image(drawable, &sLensfunParameters, &ctx);
+            }
+        }
+        else
+        {
+            /* Without arguments beyond the drawable we use the
+             * configuration from read_opts_from_exif. If that fails,
+             * we use the stored settings (loadSettings()), e.g. the
+             * settings that have been made in the last interactive
+             * use of the plugin.
+             */
+            bCorrected = process_image(drawable, &sLensfunParameters, &ctx);
+            if (!bCorrected)
+                status = GIMP_PDB_EXECUTION_ERROR;
+        }
+
+        if (bCorrected && bExif && !bParasite)
+            exif_parasite_set(imageID, &exif);
+
+        storeSettings();
     }
 
-    storeSettings();
+    gimp_image_undo_group_end (imageID);
+
+    process_context_release(&ctx);
+
+    values[0].type = GIMP_PDB_STATUS;
+    values[0].data.d_status = status;
 
     delete ldb;
 }
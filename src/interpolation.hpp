@@ -0,0 +1,932 @@
+/*
+ *
+ *
+ Copyright 2010-2011 Sebastian Kraft
+
+ This file is part of GimpLensfun.
+
+ GimpLensfun is free software: you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation, either version
+ 3 of the License, or (at your option) any later version.
+
+ GimpLensfun is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied
+ warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ PURPOSE. See the GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public
+ License along with GimpLensfun. If not, see
+ http://www.gnu.org/licenses/.
+
+*/
+
+/*
+ *  Interpolation kernels for resampling the corrected image
+ *
+ *  All kernels are templates over the sample type (unsigned char,
+ *  unsigned short or float, see PixelTraits), so the inner loops are
+ *  specialized at compile time for each pixel format. Samples are
+ *  accumulated in float and converted back by PixelTraits<T>::Clip().
+ *
+ *  Every kernel is separable and described by a policy class with a
+ *  compile time number of taps (NearestKernel, BilinearKernel,
+ *  BicubicKernel, LanczosKernel<2>, LanczosKernel<3>). For every
+ *  subpixel coordinate the weights in x and y direction are computed
+ *  once (KernelSetup) and the convolution then runs over all channels
+ *  of the footprint at once (KernelConv<T, Taps>::Func). The
+ *  convolution is selected at runtime from an AVX2, SSE2 or plain C++
+ *  implementation, see GetKernelConv(). 8 bit data with an even number
+ *  of taps is convolved in fixed point: the weights are quantized to
+ *  16 bit and multiplied with the samples by (v)pmaddwd into 32 bit
+ *  sums, two taps or two rows per instruction. This replaces SSE2 and,
+ *  from 4 taps on, the float AVX2 path. The result differs from the
+ *  float convolution by at most one step of the 8 bit output.
+ *
+ *  ResampleRow<T, Kernel, Channels> is the inner loop over one output
+ *  row, it is instantiated for every kernel and pixel layout (gray,
+ *  gray + alpha, RGB, RGBA) and picked at runtime through
+ *  GetResampler<T>(). A row whose footprints all lie inside the source
+ *  runs without bounds checks. Near the edge of the image footprints
+ *  are clamped to the edge, only coordinates that miss the image give
+ *  black. Alpha is resampled in the same pass as the color
+ *  channels, which come premultiplied by it and are divided by the
+ *  resampled alpha again. A GainMap, if given, scales the color channels of every
+ *  output pixel by the vignetting gain at its source position, so the
+ *  vignetting correction needs no pass of its own over the source.
+ *
+ *  The vectorized convolutions load 16 bytes per pixel or footprint
+ *  row, so every buffer passed to them needs cInterpolationPadding
+ *  bytes of slack behind the last pixel.
+ */
+
+#ifndef INTERPOLATION_H_
+#define INTERPOLATION_H_
+
+#include <math.h>
+#include <float.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GL_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define GL_X86_SIMD 0
+#endif
+
+
+//####################################################################
+// interpolation parameters
+const int cLanczosTableRes = 256;
+const int cInterpolationPadding = 16;
+const int cFixedBits = 14;              // fraction bits of the fixed point weights
+const int cFixedRowBits = 6;            // fraction bits of a convolved footprint row
+
+// the values are used as PDB arguments and in the stored settings,
+// new methods are appended
+typedef enum GL_INTERPOL {
+    GL_INTERPOL_NN,		// Nearest Neighbour
+    GL_INTERPOL_BL,		// Bilinear
+    GL_INTERPOL_LZ,		// Lanczos, 2 lobes
+    GL_INTERPOL_BC,		// Bicubic
+    GL_INTERPOL_LZ3		// Lanczos, 3 lobes
+} glInterpolationType;
+
+// footprint of one subpixel coordinate for a kernel with Taps taps
+// in each direction
+template <int Taps>
+struct KernelTaps
+{
+    int   x, y;                 // upper left source pixel
+    float wx[Taps];             // normalized weights in x direction
+    float wy[Taps];             // normalized weights in y direction
+};
+
+// convolve the footprint for all channels, out receives 4 values
+template <typename T, int Taps>
+struct KernelConv
+{
+    typedef void (*Func)(const T *ImgBuffer, int rowstride,
+                         int channels, const KernelTaps<Taps> *taps, float *out);
+};
+
+// Vignetting gains on a coarse grid of source positions, interpolated
+// bilinearly in between
+typedef struct
+{
+    int   cols, rows;           // grid nodes, at least 2 x 2
+    int   step;                 // pixels between nodes
+    float scale;                // 1 / step
+    std::vector<float> gain;    // cols x rows gains, row by row
+} GainMap;
+
+// resample n output pixels, coords holds three coordinate pairs (red,
+// green, blue) per pixel in source coordinates, the buffer starts at
+// (ox, oy). gain may be NULL.
+template <typename T>
+struct Resampler
+{
+    typedef void (*Func)(const T *ImgBuffer, int w, int h,
+                         const float *coords, int n, float ox, float oy,
+                         const GainMap *gain, T *out);
+};
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// Helper functions
+
+// Round float to integer value
+inline int roundfloat2int(float d)
+{
+    return d<0?d-.5:d+.5;
+}
+//--------------------------------------------------------------------
+// Vignetting gain at the source position (x, y), the grid is clamped
+// at its edges
+inline float GainAt(const GainMap *map, float x, float y)
+{
+    const float gx = std::min(std::max(x * map->scale, 0.0f), static_cast<float>(map->cols - 1));
+    const float gy = std::min(std::max(y * map->scale, 0.0f), static_cast<float>(map->rows - 1));
+    const int   ix = std::min(static_cast<int>(gx), map->cols - 2);
+    const int   iy = std::min(static_cast<int>(gy), map->rows - 2);
+    const float fx = gx - static_cast<float>(ix);
+    const float fy = gy - static_cast<float>(iy);
+
+    const float *g0 = &map->gain[iy * map->cols + ix];
+    const float *g1 = g0 + map->cols;
+    const float  top    = g0[0] + (g0[1] - g0[0]) * fx;
+    const float  bottom = g1[0] + (g1[1] - g1[0]) * fx;
+    return top + (bottom - top) * fy;
+}
+//--------------------------------------------------------------------
+// Conversion of accumulated float values back to the sample type
+template <typename T> struct PixelTraits;
+
+template <> struct PixelTraits<unsigned char>
+{
+    static float Max() { return 255.0f; }
+
+    static unsigned char Clip(float d)
+    {
+        if (d>255)
+            d = 255;
+        if (d<0)
+            d = 0;
+        return roundfloat2int(d);
+    }
+};
+
+template <> struct PixelTraits<unsigned short>
+{
+    static float Max() { return 65535.0f; }
+
+    static unsigned short Clip(float d)
+    {
+        if (d>65535)
+            d = 65535;
+        if (d<0)
+            d = 0;
+        return roundfloat2int(d);
+    }
+};
+
+template <> struct PixelTraits<float>
+{
+    static float Max() { return 1.0f; }
+
+    // float data is not clipped, it may carry values outside of 0..1
+    static float Clip(float d)
+    {
+        return d;
+    }
+};
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// Kernels
+//
+// Each kernel provides the number of taps, the source pixels it
+// reaches on each side of the coordinate (Radius), the first tap for
+// a coordinate and the weights of all taps for the distance d between
+// the coordinate and the first tap.
+struct NearestKernel
+{
+    static const int Taps = 1;
+    static const int Radius = 1;
+
+    static int First(float pos)
+    {
+        return roundfloat2int(pos);
+    }
+    static void Weights(float d, float *w)
+    {
+        w[0] = 1.0f;
+    }
+};
+//--------------------------------------------------------------------
+struct BilinearKernel
+{
+    static const int Taps = 2;
+    static const int Radius = 1;
+
+    static int First(float pos)
+    {
+        return static_cast<int>(floorf(pos));
+    }
+    static void Weights(float d, float *w)
+    {
+        w[0] = 1.0f - d;
+        w[1] = d;
+    }
+};
+//--------------------------------------------------------------------
+// Keys cubic convolution with a = -0.5 (Catmull-Rom)
+struct BicubicKernel
+{
+    static const int Taps = 4;
+    static const int Radius = 2;
+
+    static int First(float pos)
+    {
+        return static_cast<int>(floorf(pos)) - 1;
+    }
+    static void Weights(float d, float *w)
+    {
+        const float t  = d - 1.0f;
+        const float t2 = t * t;
+        const float t3 = t2 * t;
+        w[0] = -0.5f*t3 +      t2 - 0.5f*t;
+        w[1] =  1.5f*t3 - 2.5f*t2 + 1.0f;
+        w[2] = -1.5f*t3 + 2.0f*t2 + 0.5f*t;
+        w[3] =  0.5f*t3 - 0.5f*t2;
+    }
+};
+//--------------------------------------------------------------------
+inline float Lanczos(float x, int a)
+{
+    if ( (x<FLT_MIN) && (x>-FLT_MIN) )
+        return 1.0f;
+
+    if ( (x >= a) || (x <= (-1)*a) )
+        return 0.0f;
+
+    float xpi = x * static_cast<float>(M_PI);
+    return ( a * sin(xpi) * sin(xpi/a) ) / ( xpi*xpi );
+}
+//--------------------------------------------------------------------
+// Lanczos kernel with A lobes, the weights are read from a table that
+// InitInterpolation() fills
+template <int A>
+struct LanczosKernel
+{
+    static const int Taps = 2 * A;
+    static const int Radius = A;
+    static const int TableSize = A * 2 * cLanczosTableRes + 2;
+
+    static float Table[TableSize];
+
+    static void Init()
+    {
+        for (int i = 0; i < TableSize; i++) {
+            Table[i] = Lanczos(static_cast<float>(i - A*cLanczosTableRes)/static_cast<float>(cLanczosTableRes), A);
+        }
+    }
+    static int First(float pos)
+    {
+        return static_cast<int>(floorf(pos)) - A + 1;
+    }
+    // Neighbouring taps are exactly cLanczosTableRes entries apart in
+    // the table, so they share the same fractional index.
+    static void Weights(float d, float *w)
+    {
+        const float fidx = d * static_cast<float>(cLanczosTableRes) + static_cast<float>(A*cLanczosTableRes);
+        const int   idx  = static_cast<int>(fidx);
+        const float frac = fidx - static_cast<float>(idx);
+        float       norm = 0.0f;
+
+        for (int k = 0; k < Taps; k++) {
+            const float *t = &Table[idx - k*cLanczosTableRes];
+            w[k] = t[0] + (t[1] - t[0]) * frac;
+            norm += w[k];
+        }
+
+        norm = 1.0f / norm;
+        for (int k = 0; k < Taps; k++)
+            w[k] *= norm;
+    }
+};
+
+template <int A>
+float LanczosKernel<A>::Table[LanczosKernel<A>::TableSize];
+//--------------------------------------------------------------------
+inline void InitInterpolation(glInterpolationType intType)
+{
+    switch(intType) {
+        case GL_INTERPOL_NN: break;
+        case GL_INTERPOL_BL: break;
+        case GL_INTERPOL_BC: break;
+        case GL_INTERPOL_LZ:
+                LanczosKernel<2>::Init();
+                break;
+        case GL_INTERPOL_LZ3:
+                LanczosKernel<3>::Init();
+                break;
+    }
+}
+//--------------------------------------------------------------------
+// source pixels a kernel reaches on each side of a coordinate
+inline int InterpolationRadius(glInterpolationType intType)
+{
+    switch(intType) {
+        case GL_INTERPOL_NN:  return NearestKernel::Radius;
+        case GL_INTERPOL_BL:  return BilinearKernel::Radius;
+        case GL_INTERPOL_BC:  return BicubicKernel::Radius;
+        case GL_INTERPOL_LZ:  return LanczosKernel<2>::Radius;
+        case GL_INTERPOL_LZ3: return LanczosKernel<3>::Radius;
+    }
+    return LanczosKernel<3>::Radius;
+}
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// Convolution of the footprint
+
+// Check if the footprints of the n pixels at coords (three pairs each,
+// relative to the buffer at (ox, oy)) all lie inside the buffer. The
+// bounds are taken a little tight for the nearest neighbour, NaN
+// coordinates fail the test.
+template <typename Kernel>
+inline bool FootprintsInside(const float *coords, int n, int w, int h, float ox, float oy)
+{
+    const float x0 = ox + static_cast<float>(Kernel::Radius - 1);
+    const float y0 = oy + static_cast<float>(Kernel::Radius - 1);
+    const float x1 = ox + static_cast<float>(w - Kernel::Radius);
+    const float y1 = oy + static_cast<float>(h - Kernel::Radius);
+    bool        bInside = true;
+
+    for (int i = 0; i < n*3; i++) {
+        bInside &= (coords[2*i] >= x0) & (coords[2*i] < x1) &
+                   (coords[2*i+1] >= y0) & (coords[2*i+1] < y1);
+    }
+    return bInside;
+}
+//--------------------------------------------------------------------
+// Compute the footprint of a coordinate. Without bBorder the footprint
+// is known to lie inside the buffer and nothing is checked. With
+// bBorder it returns false if the coordinate misses the buffer, the
+// footprint may still reach over its edge then (see ConvFootprint()).
+template <typename Kernel, bool bBorder>
+inline bool KernelSetup(float xpos, float ypos, int w, int h, KernelTaps<Kernel::Taps> *taps)
+{
+    if (bBorder &&
+        !((xpos >= -0.5f) && (xpos <= static_cast<float>(w) - 0.5f) &&
+          (ypos >= -0.5f) && (ypos <= static_cast<float>(h) - 0.5f)))
+    {
+        return false;
+    }
+
+    const int x = Kernel::First(xpos);
+    const int y = Kernel::First(ypos);
+
+    taps->x = x;
+    taps->y = y;
+    Kernel::Weights(xpos - static_cast<float>(x), taps->wx);
+    Kernel::Weights(ypos - static_cast<float>(y), taps->wy);
+    return true;
+}
+//--------------------------------------------------------------------
+template <typename T, int Taps>
+inline void ConvScalar(const T *ImgBuffer, int rowstride,
+                       int channels, const KernelTaps<Taps> *taps, float *out)
+{
+    const T *row = ImgBuffer + taps->y*rowstride + taps->x*channels;
+
+    out[0] = out[1] = out[2] = out[3] = 0.0f;
+    for (int j = 0; j < Taps; j++, row += rowstride) {
+        float racc[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        for (int i = 0; i < Taps; i++) {
+            for (int c = 0; c < channels; c++)
+                racc[c] += static_cast<float>(row[i*channels + c]) * taps->wx[i];
+        }
+        for (int c = 0; c < channels; c++)
+            out[c] += racc[c] * taps->wy[j];
+    }
+}
+//--------------------------------------------------------------------
+#if GL_X86_SIMD
+// load the first 4 samples at p as floats
+__attribute__((target("sse2")))
+inline __m128 LoadPixelSSE2(const unsigned char *p)
+{
+    int v;
+    memcpy(&v, p, sizeof(v));
+    const __m128i zero = _mm_setzero_si128();
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero), zero));
+}
+__attribute__((target("sse2")))
+inline __m128 LoadPixelSSE2(const unsigned short *p)
+{
+    const __m128i v = _mm_loadl_epi64((const __m128i *) p);
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, _mm_setzero_si128()));
+}
+__attribute__((target("sse2")))
+inline __m128 LoadPixelSSE2(const float *p)
+{
+    return _mm_loadu_ps(p);
+}
+//--------------------------------------------------------------------
+// one pixel per vector, Taps loads per footprint row
+template <typename T, int Taps>
+__attribute__((target("sse2")))
+void ConvSSE2(const T *ImgBuffer, int rowstride,
+              int channels, const KernelTaps<Taps> *taps, float *out)
+{
+    const T *row = ImgBuffer + taps->y*rowstride + taps->x*channels;
+    __m128 acc = _mm_setzero_ps();
+
+    for (int j = 0; j < Taps; j++, row += rowstride) {
+        __m128 racc = _mm_setzero_ps();
+        for (int i = 0; i < Taps; i++) {
+            racc = _mm_add_ps(racc, _mm_mul_ps(LoadPixelSSE2(row + i*channels), _mm_set1_ps(taps->wx[i])));
+        }
+        acc = _mm_add_ps(acc, _mm_mul_ps(racc, _mm_set1_ps(taps->wy[j])));
+    }
+    _mm_storeu_ps(out, acc);
+}
+//--------------------------------------------------------------------
+// byte shuffles spreading 4 pixels of 1..4 8 bit channels to 4 bytes each
+static const signed char cPixelSpread8[4][16] = {
+    { 0,-1,-1,-1,  1,-1,-1,-1,  2,-1,-1,-1,  3,-1,-1,-1 },
+    { 0, 1,-1,-1,  2, 3,-1,-1,  4, 5,-1,-1,  6, 7,-1,-1 },
+    { 0, 1, 2,-1,  3, 4, 5,-1,  6, 7, 8,-1,  9,10,11,-1 },
+    { 0, 1, 2, 3,  4, 5, 6, 7,  8, 9,10,11, 12,13,14,15 }
+};
+// byte shuffles spreading 2 pixels of 1..4 16 bit channels to 8 bytes each
+static const signed char cPixelSpread16[4][16] = {
+    { 0, 1,-1,-1, -1,-1,-1,-1,  2, 3,-1,-1, -1,-1,-1,-1 },
+    { 0, 1, 2, 3, -1,-1,-1,-1,  4, 5, 6, 7, -1,-1,-1,-1 },
+    { 0, 1, 2, 3,  4, 5,-1,-1,  6, 7, 8, 9, 10,11,-1,-1 },
+    { 0, 1, 2, 3,  4, 5, 6, 7,  8, 9,10,11, 12,13,14,15 }
+};
+// load 4 pixels of a footprint row as pixel pairs (0,1) and (2,3)
+__attribute__((target("avx2,fma")))
+inline void LoadRowAVX2(const unsigned char *row, int channels, __m256 *p01, __m256 *p23)
+{
+    const __m128i spread = _mm_loadu_si128((const __m128i *) cPixelSpread8[channels-1]);
+    const __m128i px = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) row), spread);
+    *p01 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(px));
+    *p23 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(px, 8)));
+}
+__attribute__((target("avx2,fma")))
+inline void LoadRowAVX2(const unsigned short *row, int channels, __m256 *p01, __m256 *p23)
+{
+    const __m128i spread = _mm_loadu_si128((const __m128i *) cPixelSpread16[channels-1]);
+    const __m128i px01 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) row), spread);
+    const __m128i px23 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (row + 2*channels)), spread);
+    *p01 = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(px01));
+    *p23 = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(px23));
+}
+__attribute__((target("avx2,fma")))
+inline void LoadRowAVX2(const float *row, int channels, __m256 *p01, __m256 *p23)
+{
+    *p01 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(row)),
+                                _mm_loadu_ps(row + channels), 1);
+    *p23 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(row + 2*channels)),
+                                _mm_loadu_ps(row + 3*channels), 1);
+}
+//--------------------------------------------------------------------
+// load the pixels at p and p + channels into one vector
+__attribute__((target("avx2,fma")))
+inline __m256 LoadPairAVX2(const unsigned char *p, int channels)
+{
+    int v0, v1;
+    memcpy(&v0, p, sizeof(v0));
+    memcpy(&v1, p + channels, sizeof(v1));
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_unpacklo_epi32(_mm_cvtsi32_si128(v0), _mm_cvtsi32_si128(v1))));
+}
+__attribute__((target("avx2,fma")))
+inline __m256 LoadPairAVX2(const unsigned short *p, int channels)
+{
+    const __m128i px = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *) p),
+                                          _mm_loadl_epi64((const __m128i *) (p + channels)));
+    return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(px));
+}
+__attribute__((target("avx2,fma")))
+inline __m256 LoadPairAVX2(const float *p, int channels)
+{
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p)),
+                                _mm_loadu_ps(p + channels), 1);
+}
+//--------------------------------------------------------------------
+// two pixels per vector, groups of 4 taps are loaded with one row load
+template <typename T, int Taps>
+__attribute__((target("avx2,fma")))
+void ConvAVX2(const T *ImgBuffer, int rowstride,
+              int channels, const KernelTaps<Taps> *taps, float *out)
+{
+    const T *row = ImgBuffer + taps->y*rowstride + taps->x*channels;
+    __m256   w[Taps/2];
+    __m256   acc = _mm256_setzero_ps();
+
+    for (int i = 0; i < Taps/2; i++) {
+        const float w0 = taps->wx[2*i];
+        const float w1 = taps->wx[2*i+1];
+        w[i] = _mm256_setr_ps(w0, w0, w0, w0, w1, w1, w1, w1);
+    }
+
+    for (int j = 0; j < Taps; j++, row += rowstride) {
+        __m256 r = _mm256_setzero_ps();
+        int    i = 0;
+        for (; i + 4 <= Taps; i += 4) {
+            __m256 p01, p23;
+            LoadRowAVX2(row + i*channels, channels, &p01, &p23);
+            r = _mm256_fmadd_ps(p01, w[i/2], r);
+            r = _mm256_fmadd_ps(p23, w[i/2+1], r);
+        }
+        for (; i < Taps; i += 2)
+            r = _mm256_fmadd_ps(LoadPairAVX2(row + i*channels, channels), w[i/2], r);
+        acc = _mm256_fmadd_ps(r, _mm256_set1_ps(taps->wy[j]), acc);
+    }
+    _mm_storeu_ps(out, _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1)));
+}
+//--------------------------------------------------------------------
+// byte shuffles spreading the pixel pairs (0,1) and (2,3) of 1..4 8 bit
+// channels to 16 bit sample pairs, one pair per channel
+static const signed char cPairSpread8[4][2][16] = {
+    { { 0,-1, 1,-1, -1,-1,-1,-1, -1,-1,-1,-1, -1,-1,-1,-1 },
+      { 2,-1, 3,-1, -1,-1,-1,-1, -1,-1,-1,-1, -1,-1,-1,-1 } },
+    { { 0,-1, 2,-1,  1,-1, 3,-1, -1,-1,-1,-1, -1,-1,-1,-1 },
+      { 4,-1, 6,-1,  5,-1, 7,-1, -1,-1,-1,-1, -1,-1,-1,-1 } },
+    { { 0,-1, 3,-1,  1,-1, 4,-1,  2,-1, 5,-1, -1,-1,-1,-1 },
+      { 6,-1, 9,-1,  7,-1,10,-1,  8,-1,11,-1, -1,-1,-1,-1 } },
+    { { 0,-1, 4,-1,  1,-1, 5,-1,  2,-1, 6,-1,  3,-1, 7,-1 },
+      { 8,-1,12,-1,  9,-1,13,-1, 10,-1,14,-1, 11,-1,15,-1 } }
+};
+// Quantize the weights of a footprint to 16 bit fixed point. pairs[i]
+// receives the weights of taps 2i and 2i + 1 in every 32 bit lane, the
+// first in the lower half as pmaddwd pairs them with the samples.
+template <int Taps>
+__attribute__((target("sse2")))
+inline void FixedPairs(const float *w, __m128i *pairs)
+{
+    const __m128  one = _mm_set1_ps(static_cast<float>(1 << cFixedBits));
+    const __m128  w03 = _mm_setr_ps(w[0], w[1], (Taps > 2) ? w[2] : 0.0f, (Taps > 2) ? w[3] : 0.0f);
+    const __m128  w47 = _mm_setr_ps((Taps > 4) ? w[4] : 0.0f, (Taps > 4) ? w[5] : 0.0f, 0.0f, 0.0f);
+    const __m128i p   = _mm_packs_epi32(_mm_cvtps_epi32(_mm_mul_ps(w03, one)),
+                                        _mm_cvtps_epi32(_mm_mul_ps(w47, one)));
+
+    for (int i = 0; i < Taps/2; i++) {
+        switch (i) {
+            case 0:  pairs[i] = _mm_shuffle_epi32(p, 0x00); break;
+            case 1:  pairs[i] = _mm_shuffle_epi32(p, 0x55); break;
+            default: pairs[i] = _mm_shuffle_epi32(p, 0xaa); break;
+        }
+    }
+}
+//--------------------------------------------------------------------
+// Convolve one footprint row of 8 bit samples in x direction, two taps
+// of all channels per pmaddwd. The sums are rounded to cFixedRowBits
+// fraction bits so they fit 16 bit for the pass in y direction.
+template <int Taps>
+__attribute__((target("ssse3")))
+inline __m128i FixedRowSSSE3(const unsigned char *row, int channels,
+                             __m128i spread01, __m128i spread23, const __m128i *wx)
+{
+    __m128i acc = _mm_set1_epi32(1 << (cFixedBits - cFixedRowBits - 1));
+    int     i   = 0;
+
+    for (; i + 4 <= Taps; i += 4) {
+        const __m128i px = _mm_loadu_si128((const __m128i *) (row + i*channels));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_shuffle_epi8(px, spread01), wx[i/2]));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_shuffle_epi8(px, spread23), wx[i/2+1]));
+    }
+    for (; i < Taps; i += 2) {
+        const __m128i px = _mm_loadl_epi64((const __m128i *) (row + i*channels));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_shuffle_epi8(px, spread01), wx[i/2]));
+    }
+    return _mm_srai_epi32(acc, cFixedBits - cFixedRowBits);
+}
+//--------------------------------------------------------------------
+// Pass in y direction over the row sums r0 of row j and r1 of row j + 1,
+// paired per channel for one pmaddwd with wy, the weight pair of the rows
+__attribute__((target("ssse3")))
+inline __m128i FixedColumnSSSE3(__m128i r0, __m128i r1, __m128i wy)
+{
+    const __m128i r = _mm_packs_epi32(r0, r1);
+    return _mm_madd_epi16(_mm_unpacklo_epi16(r, _mm_srli_si128(r, 8)), wy);
+}
+//--------------------------------------------------------------------
+// 8 bit samples in fixed point, two footprint rows per pass. About
+// twice as fast as ConvSSE2().
+template <int Taps>
+__attribute__((target("ssse3")))
+void ConvFixedSSSE3(const unsigned char *ImgBuffer, int rowstride,
+                    int channels, const KernelTaps<Taps> *taps, float *out)
+{
+    const unsigned char *row = ImgBuffer + taps->y*rowstride + taps->x*channels;
+    const __m128i spread01 = _mm_loadu_si128((const __m128i *) cPairSpread8[channels-1][0]);
+    const __m128i spread23 = _mm_loadu_si128((const __m128i *) cPairSpread8[channels-1][1]);
+    __m128i       wx[Taps/2], wy[Taps/2];
+    __m128i       acc = _mm_setzero_si128();
+
+    FixedPairs<Taps>(taps->wx, wx);
+    FixedPairs<Taps>(taps->wy, wy);
+
+    for (int j = 0; j < Taps; j += 2, row += 2*rowstride) {
+        const __m128i r0 = FixedRowSSSE3<Taps>(row, channels, spread01, spread23, wx);
+        const __m128i r1 = FixedRowSSSE3<Taps>(row + rowstride, channels, spread01, spread23, wx);
+        acc = _mm_add_epi32(acc, FixedColumnSSSE3(r0, r1, wy[j/2]));
+    }
+    _mm_storeu_ps(out, _mm_mul_ps(_mm_cvtepi32_ps(acc),
+                                  _mm_set1_ps(1.0f / static_cast<float>(1 << (cFixedBits + cFixedRowBits)))));
+}
+//--------------------------------------------------------------------
+// FixedRowSSSE3() for the footprint rows at r0 and r1 at once, the
+// sums of r0 end up in the lower, the ones of r1 in the upper lane
+template <int Taps>
+__attribute__((target("avx2,fma")))
+inline __m256i FixedRowsAVX2(const unsigned char *r0, const unsigned char *r1, int channels,
+                             __m256i spread01, __m256i spread23, const __m256i *wx)
+{
+    __m256i acc = _mm256_set1_epi32(1 << (cFixedBits - cFixedRowBits - 1));
+    int     i   = 0;
+
+    for (; i + 4 <= Taps; i += 4) {
+        const __m256i px = _mm256_inserti128_si256(
+                               _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (r0 + i*channels))),
+                               _mm_loadu_si128((const __m128i *) (r1 + i*channels)), 1);
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_shuffle_epi8(px, spread01), wx[i/2]));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_shuffle_epi8(px, spread23), wx[i/2+1]));
+    }
+    for (; i < Taps; i += 2) {
+        const __m256i px = _mm256_inserti128_si256(
+                               _mm256_castsi128_si256(_mm_loadl_epi64((const __m128i *) (r0 + i*channels))),
+                               _mm_loadl_epi64((const __m128i *) (r1 + i*channels)), 1);
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_shuffle_epi8(px, spread01), wx[i/2]));
+    }
+    return _mm256_srai_epi32(acc, cFixedBits - cFixedRowBits);
+}
+//--------------------------------------------------------------------
+// ConvFixedSSSE3() with vpmaddwd, four footprint rows per pass. Rows
+// j and j + 2 share a vector, as do j + 1 and j + 3, so the pass in y
+// direction pairs the rows within the lanes. Faster than ConvAVX2()
+// from 4 taps on, see the -k option of the benchmark.
+template <int Taps>
+__attribute__((target("avx2,fma")))
+void ConvFixedAVX2(const unsigned char *ImgBuffer, int rowstride,
+                   int channels, const KernelTaps<Taps> *taps, float *out)
+{
+    const unsigned char *row = ImgBuffer + taps->y*rowstride + taps->x*channels;
+    const __m256i spread01 = _mm256_broadcastsi128_si256(
+                                 _mm_loadu_si128((const __m128i *) cPairSpread8[channels-1][0]));
+    const __m256i spread23 = _mm256_broadcastsi128_si256(
+                                 _mm_loadu_si128((const __m128i *) cPairSpread8[channels-1][1]));
+    __m128i       wx[Taps/2], wy[Taps/2];
+    __m256i       wx2[Taps/2];
+    __m256i       acc = _mm256_setzero_si256();
+    int           j   = 0;
+
+    FixedPairs<Taps>(taps->wx, wx);
+    FixedPairs<Taps>(taps->wy, wy);
+    for (int i = 0; i < Taps/2; i++)
+        wx2[i] = _mm256_broadcastsi128_si256(wx[i]);
+
+    for (; j + 4 <= Taps; j += 4, row += 4*rowstride) {
+        const __m256i r02 = FixedRowsAVX2<Taps>(row, row + 2*rowstride, channels, spread01, spread23, wx2);
+        const __m256i r13 = FixedRowsAVX2<Taps>(row + rowstride, row + 3*rowstride, channels, spread01, spread23, wx2);
+        const __m256i r   = _mm256_packs_epi32(r02, r13);
+        const __m256i w   = _mm256_inserti128_si256(_mm256_castsi128_si256(wy[j/2]), wy[j/2+1], 1);
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_unpacklo_epi16(r, _mm256_srli_si256(r, 8)), w));
+    }
+
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    for (; j < Taps; j += 2, row += 2*rowstride) {
+        const __m256i r01 = FixedRowsAVX2<Taps>(row, row + rowstride, channels, spread01, spread23, wx2);
+        sum = _mm_add_epi32(sum, FixedColumnSSSE3(_mm256_castsi256_si128(r01),
+                                                  _mm256_extracti128_si256(r01, 1), wy[j/2]));
+    }
+    _mm_storeu_ps(out, _mm_mul_ps(_mm_cvtepi32_ps(sum),
+                                  _mm_set1_ps(1.0f / static_cast<float>(1 << (cFixedBits + cFixedRowBits)))));
+}
+//--------------------------------------------------------------------
+// fixed point is used for 8 bit samples and pairs of taps only. With
+// AVX2 it takes over from 4 taps on, bilinear is faster in float.
+template <typename T, int Taps, bool bEven = (Taps % 2 == 0)>
+struct ConvFixedSelect
+{
+    static typename KernelConv<T, Taps>::Func Get() { return NULL; }
+    static typename KernelConv<T, Taps>::Func GetAVX2() { return NULL; }
+};
+template <int Taps>
+struct ConvFixedSelect<unsigned char, Taps, true>
+{
+    static typename KernelConv<unsigned char, Taps>::Func Get() { return ConvFixedSSSE3<Taps>; }
+    static typename KernelConv<unsigned char, Taps>::Func GetAVX2()
+    {
+        return (Taps >= 4) ? ConvFixedAVX2<Taps> : NULL;
+    }
+};
+//--------------------------------------------------------------------
+// AVX2 works on pixel pairs and needs an even number of taps
+template <typename T, int Taps, bool bEven = (Taps % 2 == 0)>
+struct ConvAVX2Select
+{
+    static typename KernelConv<T, Taps>::Func Get() { return ConvAVX2<T, Taps>; }
+};
+template <typename T, int Taps>
+struct ConvAVX2Select<T, Taps, false>
+{
+    static typename KernelConv<T, Taps>::Func Get() { return NULL; }
+};
+#endif
+//--------------------------------------------------------------------
+template <typename T, int Taps>
+inline typename KernelConv<T, Taps>::Func SelectKernelConv()
+{
+#if GL_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+        ConvFixedSelect<T, Taps>::GetAVX2())
+        return ConvFixedSelect<T, Taps>::GetAVX2();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+        ConvAVX2Select<T, Taps>::Get())
+        return ConvAVX2Select<T, Taps>::Get();
+    if (__builtin_cpu_supports("ssse3") && ConvFixedSelect<T, Taps>::Get())
+        return ConvFixedSelect<T, Taps>::Get();
+    if (__builtin_cpu_supports("sse2"))
+        return ConvSSE2<T, Taps>;
+#endif
+    return ConvScalar<T, Taps>;
+}
+//--------------------------------------------------------------------
+template <typename T, int Taps>
+inline typename KernelConv<T, Taps>::Func GetKernelConv()
+{
+    static const typename KernelConv<T, Taps>::Func conv = SelectKernelConv<T, Taps>();
+    return conv;
+}
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// Resampling
+//
+// Convolve the footprint of taps. With bBorder a footprint reaching over
+// the edge of the buffer is gathered first, with its pixels clamped to
+// the edge.
+template <typename T, typename Kernel, int Channels, bool bBorder>
+inline void ConvFootprint(const T *ImgBuffer, int w, int h, const KernelTaps<Kernel::Taps> *taps,
+                          typename KernelConv<T, Kernel::Taps>::Func conv, float *out)
+{
+    const int Taps = Kernel::Taps;
+
+    if (bBorder &&
+        ((taps->x < 0) || (taps->x + Taps > w) || (taps->y < 0) || (taps->y + Taps > h)))
+    {
+        T                 fp[Taps*Taps*Channels + cInterpolationPadding];
+        KernelTaps<Taps>  local = *taps;
+
+        for (int j = 0; j < Taps; j++) {
+            const T *row = ImgBuffer + std::min(std::max(taps->y + j, 0), h - 1) * w*Channels;
+            for (int i = 0; i < Taps; i++) {
+                const T *px = row + std::min(std::max(taps->x + i, 0), w - 1) * Channels;
+                for (int c = 0; c < Channels; c++)
+                    fp[(j*Taps + i)*Channels + c] = px[c];
+            }
+        }
+        memset(&fp[Taps*Taps*Channels], 0, sizeof(T) * cInterpolationPadding);
+
+        local.x = 0;
+        local.y = 0;
+        conv(fp, Taps*Channels, Channels, &local, out);
+        return;
+    }
+    conv(ImgBuffer, w*Channels, Channels, taps, out);
+}
+//--------------------------------------------------------------------
+// Factor that turns the premultiplied colors of a resampled pixel y
+// back into straight ones, 1 without alpha. Ringing kernels may give
+// an alpha of 0 or below, the colors are dropped then.
+template <typename T, int Channels>
+inline float UnpremultiplyScale(const float *y)
+{
+    if ((Channels != 2) && (Channels != 4))
+        return 1.0f;
+
+    const float a = y[Channels - 1];
+    return (a > 0) ? PixelTraits<T>::Max() / a : 0.0f;
+}
+//--------------------------------------------------------------------
+// Resample all channels of one output pixel with Channels channels.
+// coords holds one coordinate pair per color, if all pairs match (no
+// TCA correction) the footprint is shared by the channels. Gray and
+// alpha channels follow the green coordinates, which carry the
+// geometry without the lateral chromatic aberration. The gain of each
+// color is taken at its own coordinates, alpha is never scaled.
+//
+// With alpha (2 and 4 channels) the colors in ImgBuffer have to be
+// premultiplied (PremultiplyAlpha), so transparent pixels do not bleed
+// into their neighbours. They are divided by the resampled alpha again
+// before clipping, colors of fully transparent output are black.
+//
+// bBorder selects the path for pixels near the edge of the buffer:
+// coordinates outside of it give black, footprints reaching over the
+// edge are clamped to it. Without bBorder nothing is checked.
+template <typename T, typename Kernel, int Channels, bool bBorder>
+inline void Interpolate(const T *ImgBuffer, int w, int h,
+                        const float *coords, float ox, float oy,
+                        const GainMap *gain, T *out,
+                        typename KernelConv<T, Kernel::Taps>::Func conv)
+{
+    const int iColors = (Channels >= 3) ? 3 : 1;
+    KernelTaps<Kernel::Taps> taps;
+    float                    y[4];
+
+    if ((Channels < 3) ||
+        ((coords[0] == coords[2]) && (coords[0] == coords[4]) &&
+         (coords[1] == coords[3]) && (coords[1] == coords[5])))
+    {
+        if (!KernelSetup<Kernel, bBorder>(coords[2] - ox, coords[3] - oy, w, h, &taps)) {
+            for (int c = 0; c < Channels; c++)
+                out[c] = 0;
+            return;
+        }
+        ConvFootprint<T, Kernel, Channels, bBorder>(ImgBuffer, w, h, &taps, conv, y);
+        float g = UnpremultiplyScale<T, Channels>(y);
+        if (gain)
+            g *= GainAt(gain, coords[2], coords[3]);
+        for (int c = 0; c < iColors; c++)
+            y[c] *= g;
+        for (int c = 0; c < Channels; c++)
+            out[c] = PixelTraits<T>::Clip(y[c]);
+        return;
+    }
+
+    for (int c = 0; c < 3; c++) {
+        if (!KernelSetup<Kernel, bBorder>(coords[2*c] - ox, coords[2*c+1] - oy, w, h, &taps)) {
+            out[c] = 0;
+            if ((Channels == 4) && (c == 1))
+                out[3] = 0;
+            continue;
+        }
+        ConvFootprint<T, Kernel, Channels, bBorder>(ImgBuffer, w, h, &taps, conv, y);
+        y[c] *= UnpremultiplyScale<T, Channels>(y);
+        if (gain)
+            y[c] *= GainAt(gain, coords[2*c], coords[2*c+1]);
+        out[c] = PixelTraits<T>::Clip(y[c]);
+        if ((Channels == 4) && (c == 1))
+            out[3] = PixelTraits<T>::Clip(y[3]);
+    }
+}
+//--------------------------------------------------------------------
+// The row is classified up front: if all footprints lie inside the
+// buffer, which holds for all rows away from the edges of the image,
+// the pixels are resampled without any checks.
+template <typename T, typename Kernel, int Channels>
+void ResampleRow(const T *ImgBuffer, int w, int h,
+                 const float *coords, int n, float ox, float oy,
+                 const GainMap *gain, T *out)
+{
+    const typename KernelConv<T, Kernel::Taps>::Func conv = GetKernelConv<T, Kernel::Taps>();
+
+    if (FootprintsInside<Kernel>(coords, n, w, h, ox, oy)) {
+        for (int i = 0; i < n; i++, coords += 2*3, out += Channels)
+            Interpolate<T, Kernel, Channels, false>(ImgBuffer, w, h, coords, ox, oy, gain, out, conv);
+    } else {
+        for (int i = 0; i < n; i++, coords += 2*3, out += Channels)
+            Interpolate<T, Kernel, Channels, true>(ImgBuffer, w, h, coords, ox, oy, gain, out, conv);
+    }
+}
+//--------------------------------------------------------------------
+template <typename T, typename Kernel>
+inline typename Resampler<T>::Func SelectResampler(int channels)
+{
+    switch(channels) {
+        case 1:  return ResampleRow<T, Kernel, 1>;
+        case 2:  return ResampleRow<T, Kernel, 2>;
+        case 3:  return ResampleRow<T, Kernel, 3>;
+    }
+    return ResampleRow<T, Kernel, 4>;
+}
+//--------------------------------------------------------------------
+// resampler for pixels of 1 to 4 interleaved channels
+template <typename T>
+inline typename Resampler<T>::Func GetResampler(glInterpolationType intType, int channels)
+{
+    switch(intType) {
+        case GL_INTERPOL_NN:  return SelectResampler<T, NearestKernel>(channels);
+        case GL_INTERPOL_BL:  return SelectResampler<T, BilinearKernel>(channels);
+        case GL_INTERPOL_BC:  return SelectResampler<T, BicubicKernel>(channels);
+        case GL_INTERPOL_LZ:  return SelectResampler<T, LanczosKernel<2> >(channels);
+        case GL_INTERPOL_LZ3: return SelectResampler<T, LanczosKernel<3> >(channels);
+    }
+    return SelectResampler<T, LanczosKernel<2> >(channels);
+}
+//--------------------------------------------------------------------
+
+#endif /* INTERPOLATION_H_ */
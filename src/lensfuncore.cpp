@@ -0,0 +1,340 @@
+/*
+ *
+ *
+ Copyright 2010-2011 Sebastian Kraft
+
+ This file is part of GimpLensfun.
+
+ GimpLensfun is free software: you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation, either version
+ 3 of the License, or (at your option) any later version.
+
+ GimpLensfun is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied
+ warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ PURPOSE. See the GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public
+ License along with GimpLensfun. If not, see
+ http://www.gnu.org/licenses/.
+
+*/
+
+#include <stdio.h>
+#include <string>
+#include <algorithm>
+
+#include <lensfun/lensfun.h>
+
+#include <exiv2/error.hpp>
+#include <exiv2/image.hpp>
+#include <exiv2/exif.hpp>
+
+#ifndef DEBUG
+#define DEBUG 0
+#endif
+
+#include "lensfuncore.hpp"
+
+using namespace std;
+
+
+//####################################################################
+// Some helper functions
+
+void StrReplace(std::string& str, const std::string& old, const std::string& newstr)
+{
+    size_t pos = 0;
+    while ((pos = str.find(old, pos)) != std::string::npos)
+    {
+        str.replace(pos, old.length(), newstr);
+        pos += newstr.length();
+    }
+}
+//--------------------------------------------------------------------
+int StrCompare(const std::string& str1, const std::string& str2, bool CaseSensitive)
+{
+    string s1 = str1;
+    string s2 = str2;
+
+    if (!CaseSensitive)
+    {
+        transform(s1.begin(), s1.end(), s1.begin(), ::tolower);
+        transform(s2.begin(), s2.end(), s2.begin(), ::tolower);
+    }
+
+    return s1.compare(s2);
+
+}
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// Read camera and lens info from exif and try to find in database
+int read_exif(const char *filename, ExifLensData *data) {
+
+    Exiv2::Image::AutoPtr Exiv2image;
+    Exiv2::ExifData exifData;
+
+    if (DEBUG) {
+        printf ("Reading exif data...");
+    }
+
+    try {
+        // read exif from file
+        Exiv2image = Exiv2::ImageFactory::open(string(filename));
+        Exiv2image.get();
+        Exiv2image->readMetadata();
+        exifData = Exiv2image->exifData();
+
+        if (exifData.empty()) {
+            if (DEBUG) {
+                printf ("no exif data found. \n");
+            }
+            return -1;
+        }
+    }
+    catch (Exiv2::AnyError& e) {
+        if (DEBUG) {
+            printf ("exception on reading data. \n");
+        }
+        return -1;
+    }
+
+    data->Make  = exifData["Exif.Image.Make"].toString();
+    data->Model = exifData["Exif.Image.Model"].toString();
+
+    //Get lensID
+    string CamMaker = data->Make;
+    transform(CamMaker.begin(), CamMaker.end(),CamMaker.begin(), ::tolower);
+    string MakerNoteKey;
+
+    //Select special MakerNote Tag for lens depending on Maker
+    if ((CamMaker.find("pentax"))!=string::npos) {
+        MakerNoteKey = "Exif.Pentax.LensType";
+    }
+    else if ((CamMaker.find("canon"))!=string::npos) {
+        MakerNoteKey = "Exif.CanonCs.LensType";
+    }
+    else if ((CamMaker.find("minolta"))!=string::npos) {
+        MakerNoteKey = "Exif.Minolta.LensID";
+    }
+    else if ((CamMaker.find("nikon"))!=string::npos) {
+        MakerNoteKey = "Exif.NikonLd3.LensIDNumber";
+        if (exifData[MakerNoteKey].toString().size()==0) {
+            MakerNoteKey = "Exif.NikonLd2.LensIDNumber";
+        }
+        if (exifData[MakerNoteKey].toString().size()==0) {
+            MakerNoteKey = "Exif.NikonLd1.LensIDNumber";
+        }
+    }
+    else if ((CamMaker.find("olympus"))!=string::npos) {
+        MakerNoteKey = "Exif.OlympusEq.LensType";
+    }
+    else {
+        //Use default lens model tag for all other makers
+        MakerNoteKey = "Exif.Photo.LensModel";
+    }
+
+    //Decode Lens ID
+    if ((MakerNoteKey.size()>0) && (exifData[MakerNoteKey].toString().size()>0))  {
+        Exiv2::ExifKey ek(MakerNoteKey);
+        Exiv2::ExifData::const_iterator md = exifData.findKey(ek);
+        if (md != exifData.end()) {
+            data->LensID   = md->toString();
+            data->LensName = md->print(&exifData);
+
+            //Modify some lens names for better searching in lfDatabase
+            if ((CamMaker.find("nikon"))!=std::string::npos) {
+                StrReplace(data->LensName, "Nikon", "");
+                StrReplace(data->LensName, "Zoom-Nikkor", "");
+            }
+        }
+    }
+
+    data->Focal = exifData["Exif.Photo.FocalLength"].toFloat();
+    data->Aperture = exifData["Exif.Photo.FNumber"].toFloat();
+
+    return 0;
+}
+//--------------------------------------------------------------------
+// Find camera and lens of the EXIF data in the database
+void exif_to_opts(const lfDatabase *db, const ExifLensData *data, MyLensfunOpts *opts) {
+
+    const lfCamera  **cameras    = 0;
+    const lfCamera  *camera      = 0;
+
+    const lfLens    **lenses     = 0;
+    const lfLens    *lens        = 0;
+
+    // search database for camera
+    cameras = db->FindCameras (data->Make.c_str(), data->Model.c_str());
+    if (cameras) {
+        camera = cameras [0];
+        opts->Crop = camera->CropFactor;
+        opts->Camera = string(lf_mlstr_get(camera->Model));
+        opts->CamMaker = string(lf_mlstr_get(camera->Maker));
+    }  else {
+        opts->CamMaker = data->Make;
+    }
+    //PrintCameras(cameras, db);
+
+    if (camera) {
+        if (data->LensName.size()>8) {  // only take lens names with significant length
+            lenses = db->FindLenses (camera, NULL, data->LensName.c_str());
+        } else {
+            lenses = db->FindLenses (camera, NULL, NULL);
+        }
+        if (lenses) {
+            lens = lenses[0];
+            opts->Lens = string(lf_mlstr_get(lens->Model));
+        }
+        lf_free (lenses);
+    }
+    lf_free (cameras);
+
+    opts->Focal = data->Focal;
+    opts->Aperture = data->Aperture;
+
+    if (DEBUG) {
+        printf("\nExif Data:\n");
+        printf("\tCamera: %s, %s\n", opts->CamMaker.c_str(), opts->Camera.c_str());
+        printf("\tLens: %s\n", opts->Lens.c_str());
+        printf("\tFocal Length: %f\n", opts->Focal);
+        printf("\tF-Stop: %f\n", opts->Aperture);
+        printf("\tCrop Factor: %f\n", opts->Crop);
+        printf("\tScale: %f\n", opts->Scale);
+    }
+}
+//--------------------------------------------------------------------
+int read_opts_from_exif(const lfDatabase *db, const char *filename, MyLensfunOpts *opts) {
+
+    ExifLensData data;
+
+    if (read_exif(filename, &data) != 0)
+        return -1;
+
+    exif_to_opts(db, &data, opts);
+    return 0;
+}
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// Modifier setup
+
+// Only the polynomial models of lensfun are functions of the radius
+// alone. TCA moves the colors apart and a change of the projection
+// (other than none) can't be described by a radius either.
+static bool is_radial_correction(const lfLens *lens, const MyLensfunOpts *opts, int iModifyFlags)
+{
+    if (iModifyFlags & LF_MODIFY_TCA)
+        return false;
+
+    if ((iModifyFlags & LF_MODIFY_GEOMETRY) && (opts->TargetGeom != lens->Type))
+        return false;
+
+    if (iModifyFlags & LF_MODIFY_DISTORTION) {
+        lfLensCalibDistortion calib;
+        if (!lens->InterpolateDistortion (opts->Focal, calib))
+            return false;
+
+        switch (calib.Model) {
+            case LF_DIST_MODEL_POLY3:
+            case LF_DIST_MODEL_POLY5:
+            case LF_DIST_MODEL_PTLENS:
+                break;
+            default:
+                return false;
+        }
+    }
+
+    return true;
+}
+//--------------------------------------------------------------------
+lfModifier *create_modifier(const lfDatabase *db, MyLensfunOpts *opts,
+                            int width, int height, lfPixelFormat format,
+                            RadialMap **radial, GainMap **gain)
+{
+    if (radial)
+        *radial = NULL;
+    if (gain)
+        *gain = NULL;
+
+    if ((opts->CamMaker.length()==0) ||
+        (opts->Camera.length()==0) ||
+        (opts->Lens.length()==0)) {
+            return NULL;
+    }
+
+    const lfCamera **cameras = db->FindCamerasExt (opts->CamMaker.c_str(), opts->Camera.c_str());
+    if (!cameras)
+        return NULL;
+
+    const lfLens **lenses = db->FindLenses (cameras[0], NULL, opts->Lens.c_str());
+    if (!lenses) {
+        lf_free(cameras);
+        return NULL;
+    }
+
+    opts->Crop = cameras[0]->CropFactor;
+
+    int iModifyFlags = opts->ModifyFlags;
+    if (opts->Scale<1) {
+        iModifyFlags |= LF_MODIFY_SCALE;
+    }
+
+    if (DEBUG) {
+        printf("\nApplied settings:\n");
+        printf("\tCamera: %s, %s\n", cameras[0]->Maker, cameras[0]->Model);
+        printf("\tLens: %s\n", lenses[0]->Model);
+        printf("\tFocal Length: %f\n", opts->Focal);
+        printf("\tF-Stop: %f\n", opts->Aperture);
+        printf("\tCrop Factor: %f\n", opts->Crop);
+        printf("\tScale: %f\n", opts->Scale);
+    }
+
+    // vignetting as gain table for the resampler, sampled from a
+    // modifier for float data that does nothing else
+    if (gain && (iModifyFlags & LF_MODIFY_VIGNETTING)) {
+        lfModifier vmod (lenses[0], opts->Crop, width, height);
+        if (vmod.Initialize (lenses[0], LF_PF_F32, opts->Focal,
+                             opts->Aperture, opts->Distance, opts->Scale, opts->TargetGeom,
+                             LF_MODIFY_VIGNETTING, opts->Inverse) & LF_MODIFY_VIGNETTING) {
+            *gain = new GainMap;
+            if (BuildGainMap(&vmod, width, height, *gain)) {
+                iModifyFlags &= ~LF_MODIFY_VIGNETTING;
+            } else {
+                delete *gain;
+                *gain = NULL;
+            }
+        }
+        if (DEBUG) {
+            printf("\tGain map: %s\n", *gain ? "yes" : "no");
+        }
+    }
+
+    //init lensfun modifier
+    lfModifier *mod = new lfModifier (lenses[0], opts->Crop, width, height);
+    mod->Initialize (  lenses[0], format, opts->Focal,
+                         opts->Aperture, opts->Distance, opts->Scale, opts->TargetGeom,
+                         iModifyFlags, opts->Inverse);
+
+    if (radial && is_radial_correction(lenses[0], opts, iModifyFlags)) {
+        *radial = new RadialMap;
+        if (!BuildRadialMap(mod, width, height, *radial)) {
+            delete *radial;
+            *radial = NULL;
+        }
+        if (DEBUG) {
+            printf("\tRadial map: %s\n", *radial ? "yes" : "no");
+        }
+    }
+
+    lf_free(lenses);
+    lf_free(cameras);
+
+    return mod;
+}
+//--------------------------------------------------------------------
@@ -0,0 +1,189 @@
+/*
+ *
+ *
+ Copyright 2010-2011 Sebastian Kraft
+
+ This file is part of GimpLensfun.
+
+ GimpLensfun is free software: you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation, either version
+ 3 of the License, or (at your option) any later version.
+
+ GimpLensfun is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied
+ warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ PURPOSE. See the GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public
+ License along with GimpLensfun. If not, see
+ http://www.gnu.org/licenses/.
+
+*/
+
+/*
+ *  Correction core, independent of GIMP
+ *
+ *  Everything needed to correct an image held in plain buffers:
+ *  reading the lens data from EXIF, looking up camera and lens in
+ *  the lensfun database, setting up the modifier and running the
+ *  stages of pipeline.hpp over the whole image.
+ *
+ *  Used by the GIMP plug-in and by the command line front end.
+ */
+
+#ifndef LENSFUNCORE_H_
+#define LENSFUNCORE_H_
+
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include <lensfun/lensfun.h>
+
+#include "interpolation.hpp"
+#include "pipeline.hpp"
+
+
+//####################################################################
+// struct for holding camera/lens info and parameters
+typedef struct
+{
+    int ModifyFlags;
+    bool Inverse;
+    std::string Camera;
+    std::string CamMaker;
+    std::string Lens;
+    float Scale;
+    float Crop;
+    float Focal;
+    float Aperture;
+    float Distance;
+    lfLensType TargetGeom;
+    glInterpolationType Interpolation;
+    float MaxMapError;          // pixels, 0 evaluates lensfun at every pixel
+    bool AutoCrop;              // output only the valid rectangle (GetValidRect())
+} MyLensfunOpts;
+
+// Default accuracy of the approximated coordinate map in the plug-in
+// and the GEGL operation, far below what interpolation can resolve
+const float cDefaultMapError = 0.05f;
+//--------------------------------------------------------------------
+// lens related EXIF data of an image
+typedef struct
+{
+    std::string Make;
+    std::string Model;
+    std::string LensID;         // raw value of the maker note lens tag
+    std::string LensName;       // decoded from the maker notes
+    float Focal;
+    float Aperture;
+} ExifLensData;
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// Some helper functions
+void StrReplace(std::string& str, const std::string& old, const std::string& newstr);
+int  StrCompare(const std::string& str1, const std::string& str2, bool CaseSensitive = false);
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// Camera and lens lookup
+//
+// read_exif() only parses the file and does not touch the database,
+// so it may run in a worker thread.
+int  read_exif(const char *filename, ExifLensData *data);
+void exif_to_opts(const lfDatabase *db, const ExifLensData *data, MyLensfunOpts *opts);
+int  read_opts_from_exif(const lfDatabase *db, const char *filename, MyLensfunOpts *opts);
+
+// Look up camera and lens of opts in the database and set up a
+// modifier for an image of the given size. Returns NULL if either
+// of them is unknown. If radial is given, it receives a radial map
+// of the correction (see BuildRadialMap()) when the lens model and
+// the flags allow one, NULL otherwise. If gain is given, it receives
+// the vignetting correction as GainMap (see BuildGainMap()), which
+// the modifier then leaves out, or NULL. Both are freed with delete.
+lfModifier *create_modifier(const lfDatabase *db, MyLensfunOpts *opts,
+                            int width, int height, lfPixelFormat format,
+                            RadialMap **radial = NULL, GainMap **gain = NULL);
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// Correction of an image in memory
+//
+// src and dst hold width x height pixels of channels interleaved
+// samples each and must not overlap. The modifier has to be set up
+// for this image size and sample type, and InitInterpolation() must
+// have been called for the interpolation. fMaxMapError and radial
+// are passed on to MapCoordinates(), gain to the resampler. The
+// tiles are spread over all threads by a TileScheduler. If area is
+// given, only that part of the output is corrected and dst holds
+// area->width x area->height pixels.
+template <typename T>
+void correct_image(lfModifier *mod, glInterpolationType interpolation, float fMaxMapError,
+                   const T *src, T *dst, int width, int height, int channels,
+                   const RadialMap *radial = NULL, const GainMap *gain = NULL,
+                   const ImgRect *area = NULL)
+{
+    const typename Resampler<T>::Func resample = GetResampler<T>(interpolation, channels);
+    const int iRadius = InterpolationRadius(interpolation);
+    const ImgRect full = { 0, 0, width, height };
+
+    if (!area)
+        area = &full;
+
+    TileScheduler sched;
+    InitTileScheduler(&sched, area->width, area->height);
+
+    #pragma omp parallel
+    {
+        std::vector<float> coords(cStreamTileSize * cStreamTileSize * 2 * 3);
+        std::vector<T>     out(channels * cStreamTileSize * cStreamTileSize);
+        std::vector<T>     window;
+        ImgRect            tile;
+
+        while (NextTile(&sched, &tile))
+        {
+            const int tx = tile.x, ty = tile.y;
+            const int tw = tile.width, th = tile.height;
+            ImgRect   win;
+
+            MapCoordinates(mod, area->x + tx, area->y + ty, tw, th, &coords[0], fMaxMapError, radial);
+
+            if (GetSourceWindow(&coords[0], tw*th, iRadius, width, height, &win))
+            {
+                const size_t iWindowSize = channels * win.width * win.height;
+                if (window.size() < iWindowSize + cInterpolationPadding)
+                    window.resize(iWindowSize + cInterpolationPadding);
+
+                for (int i = 0; i < win.height; i++)
+                    memcpy(&window[channels * win.width * i],
+                           &src[channels * ((size_t) (win.y + i) * width + win.x)],
+                           sizeof(T) * channels * win.width);
+
+                ModifyColors<T>(mod, &window[0], &win, channels);
+                PremultiplyAlpha<T>(&window[0], &win, channels);
+                ResampleTile<T>(resample, &window[0], &win, channels,
+                                &coords[0], tw, th, gain, &out[0]);
+            }
+            else
+            {
+                // tile maps completely outside of the source image
+                memset(&out[0], 0, sizeof(T) * channels * tw * th);
+            }
+
+            for (int i = 0; i < th; i++)
+                memcpy(&dst[channels * ((size_t) (ty + i) * area->width + tx)],
+                       &out[channels * tw * i],
+                       sizeof(T) * channels * tw);
+
+            FinishTile(&sched);
+        }
+    }
+}
+//--------------------------------------------------------------------
+
+#endif /* LENSFUNCORE_H_ */
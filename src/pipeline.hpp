@@ -0,0 +1,917 @@
+/*
+ *
+ *
+ Copyright 2010-2011 Sebastian Kraft
+
+ This file is part of GimpLensfun.
+
+ GimpLensfun is free software: you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation, either version
+ 3 of the License, or (at your option) any later version.
+
+ GimpLensfun is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied
+ warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ PURPOSE. See the GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public
+ License along with GimpLensfun. If not, see
+ http://www.gnu.org/licenses/.
+
+*/
+
+/*
+ *  Stages of the correction pipeline, independent of GIMP
+ *
+ *  The output is produced tile by tile. For each output tile
+ *
+ *    1. the undistorted coordinates of all its pixels are computed
+ *       by lensfun (MapCoordinates), exactly, approximated from a
+ *       sparse grid or looked up in a radial table,
+ *    2. the window of source pixels they refer to is determined
+ *       (GetSourceWindow) and copied in by the caller,
+ *    3. vignetting is corrected on that copy (ModifyColors), unless
+ *       a GainMap lets the resampler apply it on the fly, and colors
+ *       are premultiplied by alpha (PremultiplyAlpha),
+ *    4. the output pixels are resampled from it (ResampleTile) and
+ *       copied out by the caller, or resampled piecewise straight
+ *       into the destination (ResampleRect). Pixels at the ends of a
+ *       row that miss the source are cleared instead.
+ *
+ *  The output may be limited to the largest rectangle that has image
+ *  data everywhere (GetValidRect), the tiles then only cover that.
+ *
+ *  Peak memory thus depends on the tile size and the distortion
+ *  footprint, not on the size of the image.
+ *
+ *  Each stage runs its rows in parallel with OpenMP and ends with the
+ *  implicit barrier of its parallel loop, so a stage only starts once
+ *  the previous one is complete. Within a stage every row is computed
+ *  by exactly one thread from data no other thread writes: vignetting
+ *  modifies the private copy of the window before resampling reads
+ *  any of it. The rows are processed the same way whichever thread
+ *  runs them, hence the result is bit-identical for any number of
+ *  threads. Callers running several tiles at once need a separate
+ *  window copy per tile.
+ *
+ *  Whole images are better split at the tile level: a TileScheduler
+ *  hands the output tiles to the threads of a parallel region, each
+ *  with its own buffers. The stage loops are nested then and run on
+ *  the calling thread only. The tiles do not depend on each other, so
+ *  the result is the same in any order.
+ */
+
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+#include <vector>
+#include <atomic>
+
+#include <lensfun/lensfun.h>
+
+#include "interpolation.hpp"
+
+
+//####################################################################
+// streaming parameters
+const int cStreamTileSize = 256;    // edge length of the output tiles
+const int cMapGridStep    = 32;     // coarse grid of the approximated map
+
+const int cCacheBudget    = 256 * 1024; // bytes of source a resampled block may span
+const int cCacheLine      = 64;
+const int cPrefetchRows   = 2;      // output rows the source is prefetched ahead
+const int cMinBlockWidth  = 16;
+
+const float cRadialTableStep = 0.25f;   // radius step of the radial table
+const float cRadialMaxError  = 0.01f;   // pixels, tolerated by BuildRadialMap()
+const int   cRadialCheckGrid = 9;       // points per direction checked against lensfun
+
+const int   cGainGridStep  = 32;        // pixels between the nodes of a GainMap
+const float cGainMaxError  = 0.001f;    // relative error tolerated by BuildGainMap()
+const int   cGainCheckGrid = 9;         // points per direction checked against lensfun
+
+typedef struct
+{
+    int x, y;
+    int width, height;
+} ImgRect;
+
+// Coordinate map of a distortion that is symmetric about the optical
+// center: source = center + (pixel - center) * scale(radius)
+typedef struct
+{
+    float cx, cy;               // optical center in pixels
+    std::vector<float> scale;   // by radius in steps of cRadialTableStep
+} RadialMap;
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// Stages
+
+// Undistorted coordinates (3 subpixel pairs) of the pixel at (x, y).
+// lensfun leaves them alone if no geometry correction is enabled.
+inline void MapPoint(const lfModifier *mod, float x, float y, float *c)
+{
+    if (!mod->ApplySubpixelGeometryDistortion (x, y, 1, 1, c)) {
+        for (int k = 0; k < 3; k++) {
+            c[2*k]   = x;
+            c[2*k+1] = y;
+        }
+    }
+}
+//--------------------------------------------------------------------
+// Bilinear interpolation of the coordinates at the corners of a cell
+// at the relative position (fx, fy)
+inline void LerpCoords(const float *c00, const float *c10, const float *c01, const float *c11,
+                       float fx, float fy, float *c)
+{
+    for (int k = 0; k < 6; k++) {
+        const float top    = c00[k] + (c10[k] - c00[k]) * fx;
+        const float bottom = c01[k] + (c11[k] - c01[k]) * fx;
+        c[k] = top + (bottom - top) * fy;
+    }
+}
+//--------------------------------------------------------------------
+inline bool CoordsFinite(const float *c)
+{
+    for (int k = 0; k < 6; k++) {
+        if (!(fabsf(c[k]) <= FLT_MAX))
+            return false;
+    }
+    return true;
+}
+//--------------------------------------------------------------------
+// Fill the cell (x0, y0) - (x1, y1) of a tile with tile width tw by
+// interpolating the coordinates of its corners, or split it if the
+// interpolation misses the exact coordinates at the center or at the
+// middle of an edge by more than fMaxError pixels.
+//
+// Cells own their upper and left edge only, the lower and right edge
+// belong to the neighbour unless bLastCol/bLastRow, so every pixel is
+// written exactly once.
+inline void MapCell(const lfModifier *mod, int tx, int ty, int tw, float fMaxError,
+                    int x0, int y0, int x1, int y1, bool bLastCol, bool bLastRow,
+                    const float *c00, const float *c10, const float *c01, const float *c11,
+                    float *coords)
+{
+    const bool bSplitX = (x1 - x0 >= 2);
+    const bool bSplitY = (y1 - y0 >= 2);
+    const int  xm      = bSplitX ? (x0 + x1) / 2 : x0;
+    const int  ym      = bSplitY ? (y0 + y1) / 2 : y0;
+    const float fx     = (x1 > x0) ? static_cast<float>(xm - x0) / (x1 - x0) : 0.0f;
+    const float fy     = (y1 > y0) ? static_cast<float>(ym - y0) / (y1 - y0) : 0.0f;
+
+    // exact coordinates at the middle of the edges and the center
+    float top[6], bottom[6], left[6], right[6], center[6];
+    bool  bFits = CoordsFinite(c00) && CoordsFinite(c10) &&
+                  CoordsFinite(c01) && CoordsFinite(c11);
+
+    if (bSplitX || bSplitY) {
+        float approx[6];
+        float fError = 0.0f;
+
+        if (bSplitX) {
+            MapPoint(mod, tx + xm, ty + y0, top);
+            MapPoint(mod, tx + xm, ty + y1, bottom);
+            LerpCoords(c00, c10, c01, c11, fx, 0.0f, approx);
+            for (int k = 0; k < 6; k++) fError = std::max(fError, fabsf(approx[k] - top[k]));
+            LerpCoords(c00, c10, c01, c11, fx, 1.0f, approx);
+            for (int k = 0; k < 6; k++) fError = std::max(fError, fabsf(approx[k] - bottom[k]));
+            bFits = bFits && CoordsFinite(top) && CoordsFinite(bottom);
+        }
+        if (bSplitY) {
+            MapPoint(mod, tx + x0, ty + ym, left);
+            MapPoint(mod, tx + x1, ty + ym, right);
+            LerpCoords(c00, c10, c01, c11, 0.0f, fy, approx);
+            for (int k = 0; k < 6; k++) fError = std::max(fError, fabsf(approx[k] - left[k]));
+            LerpCoords(c00, c10, c01, c11, 1.0f, fy, approx);
+            for (int k = 0; k < 6; k++) fError = std::max(fError, fabsf(approx[k] - right[k]));
+            bFits = bFits && CoordsFinite(left) && CoordsFinite(right);
+        }
+        if (bSplitX && bSplitY) {
+            MapPoint(mod, tx + xm, ty + ym, center);
+            LerpCoords(c00, c10, c01, c11, fx, fy, approx);
+            for (int k = 0; k < 6; k++) fError = std::max(fError, fabsf(approx[k] - center[k]));
+            bFits = bFits && CoordsFinite(center);
+        }
+
+        // NaN errors fail the test as well
+        bFits = bFits && (fError <= fMaxError);
+    }
+    else
+    {
+        // all pixels of the cell are corners, interpolation is exact
+        bFits = true;
+    }
+
+    if (!bFits)
+    {
+        if (bSplitX && bSplitY) {
+            MapCell(mod, tx, ty, tw, fMaxError, x0, y0, xm, ym, false, false,
+                    c00, top, left, center, coords);
+            MapCell(mod, tx, ty, tw, fMaxError, xm, y0, x1, ym, bLastCol, false,
+                    top, c10, center, right, coords);
+            MapCell(mod, tx, ty, tw, fMaxError, x0, ym, xm, y1, false, bLastRow,
+                    left, center, c01, bottom, coords);
+            MapCell(mod, tx, ty, tw, fMaxError, xm, ym, x1, y1, bLastCol, bLastRow,
+                    center, right, bottom, c11, coords);
+        } else if (bSplitX) {
+            MapCell(mod, tx, ty, tw, fMaxError, x0, y0, xm, y1, false, bLastRow,
+                    c00, top, c01, bottom, coords);
+            MapCell(mod, tx, ty, tw, fMaxError, xm, y0, x1, y1, bLastCol, bLastRow,
+                    top, c10, bottom, c11, coords);
+        } else {
+            MapCell(mod, tx, ty, tw, fMaxError, x0, y0, x1, ym, bLastCol, false,
+                    c00, c10, left, right, coords);
+            MapCell(mod, tx, ty, tw, fMaxError, x0, ym, x1, y1, bLastCol, bLastRow,
+                    left, right, c01, c11, coords);
+        }
+        return;
+    }
+
+    const int   xend = bLastCol ? x1 : x1 - 1;
+    const int   yend = bLastRow ? y1 : y1 - 1;
+    const float fdx  = (x1 > x0) ? 1.0f / (x1 - x0) : 0.0f;
+    const float fdy  = (y1 > y0) ? 1.0f / (y1 - y0) : 0.0f;
+
+    for (int y = y0; y <= yend; y++) {
+        const float fy = (y - y0) * fdy;
+        float       l[6], d[6];
+
+        // left edge and slope along the row
+        for (int k = 0; k < 6; k++) {
+            l[k] = c00[k] + (c01[k] - c00[k]) * fy;
+            d[k] = (c10[k] + (c11[k] - c10[k]) * fy - l[k]) * fdx;
+        }
+
+        float *c = &coords[(y*tw + x0)*2*3];
+        for (int x = 0; x <= xend - x0; x++, c += 2*3) {
+            for (int k = 0; k < 6; k++)
+                c[k] = l[k] + d[k] * x;
+        }
+    }
+}
+//--------------------------------------------------------------------
+// Scale of the radial map at radius r
+inline float RadialScale(const RadialMap *map, float r)
+{
+    const int   n    = static_cast<int>(map->scale.size());
+    const float fidx = r * (1.0f / cRadialTableStep);
+    const int   idx  = std::min(static_cast<int>(fidx), n - 2);
+    const float frac = fidx - static_cast<float>(idx);
+
+    return map->scale[idx] + (map->scale[idx+1] - map->scale[idx]) * frac;
+}
+//--------------------------------------------------------------------
+// Sample the geometry correction of the modifier along a ray from the
+// optical center into a radial table. Only done if the correction is
+// known to be symmetric (radial distortion model, no TCA, no change of
+// the projection), the table is then verified against lensfun on a
+// grid over the image. Returns false if it misses by more than
+// cRadialMaxError pixels anywhere.
+//
+// The optical center is where the displacement vectors at the middle
+// of the left and top edge intersect, which spares us lensfun's
+// conventions for the lens center.
+inline bool BuildRadialMap(const lfModifier *mod, int width, int height, RadialMap *map)
+{
+    const float x1 = 0.0f, y1 = 0.5f * (height - 1);
+    const float x2 = 0.5f * (width - 1), y2 = 0.0f;
+    float q1[2], q2[2];
+
+    if (!mod->ApplyGeometryDistortion (x1, y1, 1, 1, q1) ||
+        !mod->ApplyGeometryDistortion (x2, y2, 1, 1, q2))
+        return false;
+
+    const float dx1 = q1[0] - x1, dy1 = q1[1] - y1;
+    const float dx2 = q2[0] - x2, dy2 = q2[1] - y2;
+    const float det = dx2 * dy1 - dx1 * dy2;
+
+    if (fabsf(det) < 1e-6f)
+        return false;
+
+    // x1 + t*d1 = x2 + u*d2
+    const float t = (dx2 * (y2 - y1) - dy2 * (x2 - x1)) / det;
+    map->cx = x1 + t * dx1;
+    map->cy = y1 + t * dy1;
+
+    if (!(fabsf(map->cx) <= width) || !(fabsf(map->cy) <= height))
+        return false;
+
+    // the farthest corner limits the radius
+    float rmax = 0.0f;
+    for (int k = 0; k < 4; k++) {
+        const float ex = ((k & 1) ? (width - 1) : 0) - map->cx;
+        const float ey = ((k & 2) ? (height - 1) : 0) - map->cy;
+        rmax = std::max(rmax, sqrtf(ex * ex + ey * ey));
+    }
+
+    const float dirx = (width - 1) - map->cx >= 0 ? 1.0f : -1.0f;
+    const int   n    = static_cast<int>(rmax / cRadialTableStep) + 3;
+    map->scale.resize(n);
+
+    for (int i = 1; i < n; i++) {
+        const float r = i * cRadialTableStep;
+        float q[2];
+        mod->ApplyGeometryDistortion (map->cx + dirx * r, map->cy, 1, 1, q);
+        map->scale[i] = (q[0] - map->cx) * dirx / r;
+        if (!(fabsf(map->scale[i]) < 1e6f) || (fabsf(q[1] - map->cy) > cRadialMaxError))
+            return false;
+    }
+    map->scale[0] = map->scale[1];
+
+    // verify against lensfun, all subpixels have to follow the geometry
+    for (int i = 0; i < cRadialCheckGrid; i++) {
+        for (int j = 0; j < cRadialCheckGrid; j++) {
+            const float x = static_cast<float>(j * (width - 1)) / (cRadialCheckGrid - 1);
+            const float y = static_cast<float>(i * (height - 1)) / (cRadialCheckGrid - 1);
+            const float ex = x - map->cx, ey = y - map->cy;
+            const float s  = RadialScale(map, sqrtf(ex * ex + ey * ey));
+            float c[6];
+
+            mod->ApplySubpixelGeometryDistortion (x, y, 1, 1, c);
+            for (int k = 0; k < 3; k++) {
+                if (!(fabsf(c[2*k]   - (map->cx + ex * s)) <= cRadialMaxError) ||
+                    !(fabsf(c[2*k+1] - (map->cy + ey * s)) <= cRadialMaxError))
+                    return false;
+            }
+        }
+    }
+
+    return true;
+}
+//--------------------------------------------------------------------
+// Coordinates of a tile from the radial table, a table lookup and a
+// scale per pixel
+inline void MapRadial(const RadialMap *map, int tx, int ty, int tw, int th, float *coords)
+{
+    #pragma omp parallel for
+    for (int i = 0; i < th; i++)
+    {
+        const float ey = (ty + i) - map->cy;
+        float      *c  = &coords[i*tw*2*3];
+
+        for (int j = 0; j < tw; j++, c += 2*3) {
+            const float ex = (tx + j) - map->cx;
+            const float s  = RadialScale(map, sqrtf(ex * ex + ey * ey));
+            const float x  = map->cx + ex * s;
+            const float y  = map->cy + ey * s;
+            c[0] = c[2] = c[4] = x;
+            c[1] = c[3] = c[5] = y;
+        }
+    }
+}
+//--------------------------------------------------------------------
+// Undistorted coordinates (3 subpixel pairs per pixel) of the tile at
+// (tx, ty) of the image the modifier was set up for.
+//
+// With fMaxError > 0 lensfun is only evaluated on a grid with a
+// spacing of cMapGridStep pixels and the coordinates in between are
+// interpolated. Grid cells are split where the interpolation deviates
+// by more than fMaxError pixels at the tested points, e.g. towards the
+// edges of fisheye images. For smooth distortions lensfun then only
+// runs for a few percent of the pixels.
+//
+// A radial map, if given, replaces lensfun completely.
+inline void MapCoordinates(lfModifier *mod, int tx, int ty, int tw, int th, float *coords,
+                           float fMaxError = 0.0f, const RadialMap *radial = NULL)
+{
+    if (radial)
+    {
+        MapRadial(radial, tx, ty, tw, th, coords);
+        return;
+    }
+
+    if (fMaxError <= 0.0f)
+    {
+        #pragma omp parallel for
+        for (int i = 0; i < th; i++)
+        {
+            float *row = &coords[i*tw*2*3];
+            if (!mod->ApplySubpixelGeometryDistortion (tx, ty + i, tw, 1, row)) {
+                for (int j = 0; j < tw; j++)
+                    for (int k = 0; k < 3; k++) {
+                        row[(j*3 + k)*2]     = tx + j;
+                        row[(j*3 + k)*2 + 1] = ty + i;
+                    }
+            }
+        }
+        return;
+    }
+
+    // grid nodes, the last one sits on the last pixel of the tile
+    const int iCols = (tw - 2 + cMapGridStep) / cMapGridStep + 1;
+    const int iRows = (th - 2 + cMapGridStep) / cMapGridStep + 1;
+    std::vector<float> nodes(iCols * iRows * 2 * 3);
+
+    #pragma omp parallel for
+    for (int i = 0; i < iRows; i++)
+    {
+        const int y = std::min(i * cMapGridStep, th - 1);
+        for (int j = 0; j < iCols; j++)
+            MapPoint(mod, tx + std::min(j * cMapGridStep, tw - 1), ty + y,
+                     &nodes[(i*iCols + j)*2*3]);
+    }
+
+    // a tile of one pixel width or height has a single column or row
+    // of nodes and degenerate cells
+    const int iCellCols = std::max(iCols - 1, 1);
+    const int iCellRows = std::max(iRows - 1, 1);
+
+    #pragma omp parallel for
+    for (int i = 0; i < iCellRows; i++)
+    {
+        const int i1 = std::min(i + 1, iRows - 1);
+        for (int j = 0; j < iCellCols; j++)
+        {
+            const int j1 = std::min(j + 1, iCols - 1);
+            MapCell(mod, tx, ty, tw, fMaxError,
+                    std::min(j * cMapGridStep, tw - 1), std::min(i * cMapGridStep, th - 1),
+                    std::min(j1 * cMapGridStep, tw - 1), std::min(i1 * cMapGridStep, th - 1),
+                    j == iCellCols - 1, i == iCellRows - 1,
+                    &nodes[(i*iCols + j)*2*3], &nodes[(i*iCols + j1)*2*3],
+                    &nodes[(i1*iCols + j)*2*3], &nodes[(i1*iCols + j1)*2*3],
+                    coords);
+        }
+    }
+}
+//--------------------------------------------------------------------
+// Find the window of source pixels needed to resample a block of
+// undistorted coordinates (3 subpixel pairs per pixel), including the
+// iRadius source pixels the interpolation kernel reaches on each side.
+// Returns false if no coordinate hits the image at all.
+inline bool GetSourceWindow(const float *coords, int iNumPixels, int iRadius,
+                            int imgwidth, int imgheight, ImgRect *win)
+{
+    float xmin = FLT_MAX, xmax = -FLT_MAX;
+    float ymin = FLT_MAX, ymax = -FLT_MAX;
+
+    for (int i = 0; i < iNumPixels*3; i++) {
+        const float x = coords[2*i];
+        const float y = coords[2*i+1];
+        if (x < xmin) xmin = x;
+        if (x > xmax) xmax = x;
+        if (y < ymin) ymin = y;
+        if (y > ymax) ymax = y;
+    }
+
+    if ((xmin > xmax) || (ymin > ymax))
+        return false;
+
+    // clamp in float first, coordinates far outside would overflow int
+    xmin = std::min(std::max(xmin, -1.0f), static_cast<float>(imgwidth));
+    xmax = std::min(std::max(xmax, -1.0f), static_cast<float>(imgwidth));
+    ymin = std::min(std::max(ymin, -1.0f), static_cast<float>(imgheight));
+    ymax = std::min(std::max(ymax, -1.0f), static_cast<float>(imgheight));
+
+    const int x0 = std::max(static_cast<int>(floor(xmin)) - iRadius + 1, 0);
+    const int x1 = std::min(static_cast<int>(floor(xmax)) + iRadius, imgwidth - 1);
+    const int y0 = std::max(static_cast<int>(floor(ymin)) - iRadius + 1, 0);
+    const int y1 = std::min(static_cast<int>(floor(ymax)) + iRadius, imgheight - 1);
+
+    if ((x0 > x1) || (y0 > y1))
+        return false;
+
+    win->x = x0;
+    win->y = y0;
+    win->width  = x1 - x0 + 1;
+    win->height = y1 - y0 + 1;
+    return true;
+}
+//--------------------------------------------------------------------
+// lensfun component roles of pixels with 1 to 4 channels, alpha is
+// left untouched
+inline int ColorComponentRoles(int channels)
+{
+    switch(channels) {
+        case 1:  return LF_CR_1(INTENSITY);
+        case 2:  return LF_CR_2(INTENSITY, UNKNOWN);
+        case 3:  return LF_CR_3(RED, GREEN, BLUE);
+    }
+    return LF_CR_4(RED, GREEN, BLUE, UNKNOWN);
+}
+//--------------------------------------------------------------------
+// Correct vignetting of the source window in buf. Always done row by
+// row, lensfun evaluates the model incrementally along a call.
+template <typename T>
+inline void ModifyColors(lfModifier *mod, T *buf, const ImgRect *win, int channels)
+{
+    const int iRoles = ColorComponentRoles(channels);
+
+    #pragma omp parallel for
+    for (int i = 0; i < win->height; i++)
+    {
+        mod->ApplyColorModification( &buf[(channels*win->width*i)],
+                                    win->x, win->y + i, win->width, 1,
+                                    iRoles,
+                                    channels*win->width);
+    }
+}
+//--------------------------------------------------------------------
+// Multiply the colors of the source window in buf by their alpha, as
+// the resampler expects them with 2 and 4 channels. Runs after
+// ModifyColors, lensfun corrects vignetting on straight colors.
+template <typename T>
+inline void PremultiplyAlpha(T *buf, const ImgRect *win, int channels)
+{
+    if ((channels != 2) && (channels != 4))
+        return;
+
+    const float fScale = 1.0f / PixelTraits<T>::Max();
+
+    #pragma omp parallel for
+    for (int i = 0; i < win->height; i++)
+    {
+        T *px = &buf[(size_t) channels * win->width * i];
+        for (int j = 0; j < win->width; j++, px += channels) {
+            const float a = px[channels - 1] * fScale;
+            for (int c = 0; c < channels - 1; c++)
+                px[c] = PixelTraits<T>::Clip(px[c] * a);
+        }
+    }
+}
+//--------------------------------------------------------------------
+// Sample the vignetting correction of the modifier on a grid over the
+// source image. The modifier has to be set up for float data and for
+// vignetting only, the gain of a node is then what lensfun makes of a
+// pixel of value 1 there. Between the nodes the grid is verified
+// against lensfun. Returns false if it misses by more than
+// cGainMaxError anywhere.
+inline bool BuildGainMap(const lfModifier *mod, int width, int height, GainMap *map)
+{
+    map->step  = cGainGridStep;
+    map->scale = 1.0f / static_cast<float>(cGainGridStep);
+    map->cols  = std::max((width  + cGainGridStep - 2) / cGainGridStep + 1, 2);
+    map->rows  = std::max((height + cGainGridStep - 2) / cGainGridStep + 1, 2);
+    map->gain.resize(map->cols * map->rows);
+
+    for (int i = 0; i < map->rows; i++) {
+        for (int j = 0; j < map->cols; j++) {
+            float g = 1.0f;
+            if (!mod->ApplyColorModification (&g, j * cGainGridStep, i * cGainGridStep, 1, 1,
+                                              LF_CR_1(INTENSITY), sizeof(float)) ||
+                !(fabsf(g) < 1e6f))
+                return false;
+            map->gain[i * map->cols + j] = g;
+        }
+    }
+
+    // verify in between the nodes
+    for (int i = 0; i < cGainCheckGrid; i++) {
+        for (int j = 0; j < cGainCheckGrid; j++) {
+            const float x = (j + 0.5f) * (width - 1) / cGainCheckGrid;
+            const float y = (i + 0.5f) * (height - 1) / cGainCheckGrid;
+            float g = 1.0f;
+
+            mod->ApplyColorModification (&g, x, y, 1, 1, LF_CR_1(INTENSITY), sizeof(float));
+            if (!(fabsf(GainAt(map, x, y) - g) <= cGainMaxError * fabsf(g)))
+                return false;
+        }
+    }
+
+    return true;
+}
+//--------------------------------------------------------------------
+// Prefetch the source pixels that the n output pixels at coords will
+// read. The extent is judged from the green coordinates of the first,
+// middle and last pixel, which covers the bulge of a curved row.
+template <typename T>
+inline void PrefetchSource(const T *buf, const ImgRect *win, int channels,
+                           const float *coords, int n)
+{
+#if defined(__GNUC__)
+    float xmin = FLT_MAX, xmax = -FLT_MAX;
+    float ymin = FLT_MAX, ymax = -FLT_MAX;
+    const int idx[3] = { 0, n / 2, n - 1 };
+
+    for (int k = 0; k < 3; k++) {
+        const float x = coords[idx[k]*2*3 + 2] - win->x;
+        const float y = coords[idx[k]*2*3 + 3] - win->y;
+        xmin = std::min(xmin, x);  xmax = std::max(xmax, x);
+        ymin = std::min(ymin, y);  ymax = std::max(ymax, y);
+    }
+
+    if (!(xmin <= xmax) || !(ymin <= ymax))
+        return;
+
+    // clamp as float first, unmapped pixels are far outside
+    const float fw = static_cast<float>(win->width - 1);
+    const float fh = static_cast<float>(win->height - 1);
+    const int x0 = static_cast<int>(std::min(std::max(xmin - 2.0f, 0.0f), fw));
+    const int x1 = static_cast<int>(std::min(std::max(xmax + 3.0f, 0.0f), fw));
+    const int y0 = static_cast<int>(std::min(std::max(ymin - 2.0f, 0.0f), fh));
+    const int y1 = static_cast<int>(std::min(std::max(ymax + 3.0f, 0.0f), fh));
+    const int iLine = cCacheLine / static_cast<int>(sizeof(T));
+
+    for (int y = y0; y <= y1; y++) {
+        const T *row = &buf[(size_t) y * win->width * channels];
+        for (int e = x0 * channels; e < (x1 + 1) * channels; e += iLine)
+            __builtin_prefetch(&row[e]);
+    }
+#endif
+}
+//--------------------------------------------------------------------
+// true if any color of the output pixel at coords hits the window, in
+// the same way Interpolate() tells black pixels on its border path
+inline bool CoordsHitWindow(const float *coords, const ImgRect *win)
+{
+    const float w = static_cast<float>(win->width) - 0.5f;
+    const float h = static_cast<float>(win->height) - 0.5f;
+
+    for (int c = 0; c < 3; c++) {
+        const float x = coords[2*c]   - static_cast<float>(win->x);
+        const float y = coords[2*c+1] - static_cast<float>(win->y);
+        if ((x >= -0.5f) && (x <= w) && (y >= -0.5f) && (y <= h))
+            return true;
+    }
+    return false;
+}
+//--------------------------------------------------------------------
+// Resample n pixels of an output row. The pixels at either end that
+// miss the window would come out black, they are cleared without
+// going through the resampler. This skips the empty corners of a
+// correction that is not scaled to fit.
+template <typename T>
+inline void ResampleSpan(typename Resampler<T>::Func resample, const T *buf,
+                         const ImgRect *win, int channels,
+                         const float *coords, int n, const GainMap *gain, T *out)
+{
+    int first = 0, last = n;
+
+    while ((first < last) && !CoordsHitWindow(&coords[first*2*3], win))
+        first++;
+    while ((last > first) && !CoordsHitWindow(&coords[(last - 1)*2*3], win))
+        last--;
+
+    memset(out, 0, sizeof(T) * channels * first);
+    memset(&out[channels*last], 0, sizeof(T) * channels * (n - last));
+    if (first < last)
+        resample(buf, win->width, win->height,
+                 &coords[first*2*3], last - first,
+                 static_cast<float>(win->x), static_cast<float>(win->y),
+                 gain, &out[channels*first]);
+}
+//--------------------------------------------------------------------
+// Resample the output tile from the source window in buf
+//
+// Each output row maps onto a curved band of source rows. If the
+// whole window is larger than cCacheBudget, the tile is resampled in
+// blocks of columns that span about that much of the window, so the
+// source rows of one block stay in cache from one output row to the
+// next. The source of the upcoming rows is prefetched. bLocal = false
+// resamples whole rows without prefetching, for comparison. gain, if
+// not NULL, is applied to the resampled colors.
+template <typename T>
+inline void ResampleTile(typename Resampler<T>::Func resample, const T *buf,
+                         const ImgRect *win, int channels,
+                         const float *coords, int tw, int th,
+                         const GainMap *gain, T *out,
+                         bool bLocal = true)
+{
+    const size_t iWindowBytes = sizeof(T) * channels * (size_t) win->width * win->height;
+    int bw = tw;
+
+    if (bLocal && (iWindowBytes > (size_t) cCacheBudget))
+        bw = std::max(cMinBlockWidth,
+                      static_cast<int>((size_t) tw * cCacheBudget / iWindowBytes) & ~(cMinBlockWidth - 1));
+
+    for (int bx = 0; bx < tw; bx += bw)
+    {
+        const int n = std::min(bw, tw - bx);
+
+        #pragma omp parallel for
+        for (int i = 0; i < th; i++)
+        {
+            if (bLocal && (i + cPrefetchRows < th))
+                PrefetchSource<T>(buf, win, channels, &coords[((i + cPrefetchRows)*tw + bx)*2*3], n);
+
+            ResampleSpan<T>(resample, buf, win, channels,
+                            &coords[(i*tw + bx)*2*3], n, gain, &out[channels*(i*tw + bx)]);
+        }
+    }
+}
+//--------------------------------------------------------------------
+// Resample the part rect (in tile coordinates) of the output tile into
+// out, rows iOutStride samples apart. Lets the caller write into the
+// memory of its destination directly.
+template <typename T>
+inline void ResampleRect(typename Resampler<T>::Func resample, const T *buf,
+                         const ImgRect *win, int channels,
+                         const float *coords, int tw, const ImgRect *rect,
+                         const GainMap *gain, T *out, size_t iOutStride)
+{
+    #pragma omp parallel for
+    for (int i = 0; i < rect->height; i++)
+    {
+        ResampleSpan<T>(resample, buf, win, channels,
+                        &coords[((rect->y + i)*tw + rect->x)*2*3], rect->width,
+                        gain, &out[i*iOutStride]);
+    }
+}
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// Valid part of the output
+//
+// Without scaling to fit, a correction leaves parts of the output
+// that map outside of the source image. A pixel counts as valid if
+// all its colors come from inside the image. Along an output row the
+// valid pixels are taken as one run through the middle column, which
+// holds for the radially symmetric models of lensfun.
+inline bool OutputPixelValid(const lfModifier *mod, int x, int y, int width, int height)
+{
+    float coords[2*3];
+
+    if (!mod->ApplySubpixelGeometryDistortion (x, y, 1, 1, coords))
+        return true;
+
+    for (int c = 0; c < 3; c++) {
+        if (!((coords[2*c] >= 0.0f) && (coords[2*c] <= static_cast<float>(width - 1)) &&
+              (coords[2*c+1] >= 0.0f) && (coords[2*c+1] <= static_cast<float>(height - 1))))
+            return false;
+    }
+    return true;
+}
+//--------------------------------------------------------------------
+// Find the largest rectangle of valid output pixels, the result can
+// be cropped to it. The run of every row is found by bisection from
+// the middle column. Returns false if there are no valid pixels.
+inline bool GetValidRect(const lfModifier *mod, int width, int height, ImgRect *rect)
+{
+    const int        xc = width / 2;
+    std::vector<int> first(height), last(height);
+
+    #pragma omp parallel for
+    for (int y = 0; y < height; y++)
+    {
+        if (!OutputPixelValid(mod, xc, y, width, height)) {
+            first[y] = last[y] = xc;
+            continue;
+        }
+
+        int lo = -1, hi = xc;       // lo invalid, hi valid
+        while (hi - lo > 1) {
+            const int m = (lo + hi) / 2;
+            if (OutputPixelValid(mod, m, y, width, height))
+                hi = m;
+            else
+                lo = m;
+        }
+        first[y] = hi;
+
+        lo = xc;                    // lo valid, hi invalid
+        hi = width;
+        while (hi - lo > 1) {
+            const int m = (lo + hi) / 2;
+            if (OutputPixelValid(mod, m, y, width, height))
+                lo = m;
+            else
+                hi = m;
+        }
+        last[y] = hi;
+    }
+
+    // largest rectangle under the runs, for every top row the bottom
+    // row is moved down until the runs no longer overlap
+    long iBestArea = 0;
+    for (int a = 0; a < height; a++)
+    {
+        int x0 = 0, x1 = width;
+        for (int b = a; b < height; b++) {
+            x0 = std::max(x0, first[b]);
+            x1 = std::min(x1, last[b]);
+            if ((x1 <= x0) || ((long) (x1 - x0) * (height - a) <= iBestArea))
+                break;
+
+            const long iArea = (long) (x1 - x0) * (b - a + 1);
+            if (iArea > iBestArea) {
+                iBestArea    = iArea;
+                rect->x      = x0;
+                rect->y      = a;
+                rect->width  = x1 - x0;
+                rect->height = b - a + 1;
+            }
+        }
+    }
+    return iBestArea > 0;
+}
+//--------------------------------------------------------------------
+
+
+//####################################################################
+// Tile scheduler
+//
+// Tiles are claimed one at a time from a shared counter. A thread that
+// got cheap tiles just claims more of them while another one is busy
+// with the strongly distorted border, no thread waits for a fixed
+// share. The finished tiles are counted as well, so a single thread
+// can report progress without the workers synchronizing with it. A
+// cancelled job hands out no further tiles, tiles being processed are
+// finished.
+//
+// By default the tiles are handed out in Morton (Z) order. Tiles
+// claimed at about the same time are then close to each other in both
+// directions and share much of their source, in the caches and in the
+// tile cache of GIMP.
+typedef enum
+{
+    TILE_ORDER_ROWS,
+    TILE_ORDER_MORTON
+} TileOrder;
+
+typedef struct
+{
+    int width, height;
+    int iTileCols;
+    int iNumTiles;
+    std::vector<int>  order;        // tile index as column + row * columns
+    std::atomic<int>  next;         // next tile to hand out
+    std::atomic<int>  done;         // finished tiles
+    std::atomic<bool> cancelled;
+} TileScheduler;
+
+inline void InitTileScheduler(TileScheduler *sched, int width, int height,
+                              TileOrder order = TILE_ORDER_MORTON)
+{
+    const int iCols = (width + cStreamTileSize - 1) / cStreamTileSize;
+    const int iRows = (height + cStreamTileSize - 1) / cStreamTileSize;
+
+    sched->width     = width;
+    sched->height    = height;
+    sched->iTileCols = iCols;
+    sched->iNumTiles = iCols * iRows;
+    sched->order.clear();
+    sched->order.reserve(sched->iNumTiles);
+
+    if (order == TILE_ORDER_MORTON)
+    {
+        // walk the Z curve over the enclosing power of two square
+        int iSide = 1;
+        while ((iSide < iCols) || (iSide < iRows))
+            iSide *= 2;
+
+        for (int code = 0; code < iSide * iSide; code++) {
+            int col = 0, row = 0;
+            for (int bit = 0; (1 << bit) < iSide; bit++) {
+                col |= ((code >> (2*bit))     & 1) << bit;
+                row |= ((code >> (2*bit + 1)) & 1) << bit;
+            }
+            if ((col < iCols) && (row < iRows))
+                sched->order.push_back(col + row * iCols);
+        }
+    }
+    else
+    {
+        for (int i = 0; i < sched->iNumTiles; i++)
+            sched->order.push_back(i);
+    }
+
+    sched->next      = 0;
+    sched->done      = 0;
+    sched->cancelled = false;
+}
+//--------------------------------------------------------------------
+// Claim the next tile, false if there is none left or the job has
+// been cancelled
+inline bool NextTile(TileScheduler *sched, ImgRect *tile)
+{
+    if (sched->cancelled.load(std::memory_order_relaxed))
+        return false;
+
+    const int iNext = sched->next.fetch_add(1, std::memory_order_relaxed);
+    if (iNext >= sched->iNumTiles)
+        return false;
+
+    const int iTile = sched->order[iNext];
+    tile->x      = (iTile % sched->iTileCols) * cStreamTileSize;
+    tile->y      = (iTile / sched->iTileCols) * cStreamTileSize;
+    tile->width  = std::min(cStreamTileSize, sched->width - tile->x);
+    tile->height = std::min(cStreamTileSize, sched->height - tile->y);
+    return true;
+}
+//--------------------------------------------------------------------
+inline void FinishTile(TileScheduler *sched)
+{
+    sched->done.fetch_add(1, std::memory_order_release);
+}
+//--------------------------------------------------------------------
+inline void CancelTiles(TileScheduler *sched)
+{
+    sched->cancelled = true;
+}
+//--------------------------------------------------------------------
+// Fraction of the tiles finished so far
+inline double TileProgress(const TileScheduler *sched)
+{
+    return sched->iNumTiles > 0 ?
+        static_cast<double>(sched->done.load(std::memory_order_acquire)) / sched->iNumTiles : 1.0;
+}
+//--------------------------------------------------------------------
+
+#endif /* PIPELINE_H_ */